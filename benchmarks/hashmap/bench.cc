@@ -44,6 +44,8 @@ double getTime() {
 	return tv.tv_sec + tv.tv_nsec / 1000000000.0;
 }
 
+static struct gil_vm vm;
+
 struct GiliaSpec {
 	static struct gil_vm_value alloc() {
 		struct gil_vm_value val;
@@ -54,17 +56,37 @@ struct GiliaSpec {
 	}
 
 	static void free(struct gil_vm_value &ns) {
-		::free(ns.ns.ns);
+		if (!(ns.flags & GIL_VAL_SBO)) {
+			gil_vm_dealloc(&vm, ns.ns.ns);
+		}
 	}
 
 	static void insert(struct gil_vm_value &ns, gil_word key, gil_word val) {
-		gil_vm_namespace_set(&ns, key, val);
+		gil_vm_namespace_set(&vm, &ns, key, val);
+	}
+
+	static void erase(struct gil_vm_value &ns, gil_word key) {
+		gil_vm_namespace_set(&vm, &ns, key, 0);
 	}
 
 	static gil_word lookup(struct gil_vm_value &ns, gil_word key) {
-		return gil_vm_namespace_get(NULL, &ns, key);
+		return gil_vm_namespace_get(&vm, &ns, key);
+	}
+
+	static struct gil_vm_namespace_stats stats;
+
+	static void recordStats(struct gil_vm_value &ns) {
+		gil_vm_namespace_get_stats(&ns, &stats);
+	}
+
+	static void printStats() {
+		std::cout
+			<< "\t\t(" << stats.len << " entries, " << stats.tombs << " tombstones, "
+			<< stats.size << " slots, max probe " << stats.max_probes << ", mean probe "
+			<< (stats.len ? (double)stats.total_probes / stats.len : 0) << ")\n";
 	}
 };
+struct gil_vm_namespace_stats GiliaSpec::stats;
 
 template<typename T>
 struct CppSpec {
@@ -86,6 +108,12 @@ struct CppSpec {
 	static void insert(T &map, gil_word key, gil_word val) {
 		map[key] = val;
 	}
+
+	static void erase(T &map, gil_word key) {
+		map.erase(key);
+	}
+
+	static void recordStats(T &) {}
 };
 using UnorderedMapSpec = CppSpec<std::unordered_map<gil_word, gil_word>>;
 using MapSpec = CppSpec<std::map<gil_word, gil_word>>;
@@ -171,7 +199,63 @@ double testSmallRandLookup() {
 	return t;
 }
 
+// A sliding window of live keys: every step deletes the oldest key
+// and inserts a new one, so a table which doesn't clean up after deletes
+// fills up with tombstones
+template<typename Spec>
+double testBigChurn() {
+	auto map = Spec::alloc();
+	for (int i = 1; i <= 100000; ++i) {
+		Spec::insert(map, i, i * 10);
+	}
+
+	volatile gil_word sum = 0;
+	double start = getTime();
+	for (int i = 1; i < 10000000; ++i) {
+		Spec::erase(map, i);
+		Spec::insert(map, i + 100000, i);
+		sum += Spec::lookup(map, i + 50000);
+	}
+	double t = getTime() - start;
+
+	Spec::recordStats(map);
+	Spec::free(map);
+	return t;
+}
+
+// Repeatedly fill a small map and delete everything in it again
+template<typename Spec>
+double testSmallRandDelete() {
+	srand(0);
+	gil_word rands[100];
+	for (int i = 0; i < 100; ++i) {
+		rands[i] = rand() + 1;
+	}
+
+	auto map = Spec::alloc();
+	volatile gil_word sum = 0;
+	double start = getTime();
+	for (int i = 0; i < 100000; ++i) {
+		for (int j = 0; j < 100; ++j) {
+			Spec::insert(map, rands[j], j + 1);
+		}
+		for (int j = 0; j < 100; ++j) {
+			sum += Spec::lookup(map, rands[(j * 7) % 100]);
+		}
+		for (int j = 0; j < 100; j += (i % 2) + 1) {
+			Spec::erase(map, rands[j]);
+		}
+	}
+	double t = getTime() - start;
+
+	Spec::recordStats(map);
+	Spec::free(map);
+	return t;
+}
+
 int main() {
+	gil_arena_init(&vm.arena);
+
 	std::cout << "Big sequential insert:\n";
 	std::cout << "\tGilia namespace: " << testBigSeqInsert<GiliaSpec>() << '\n';
 	std::cout << "\tAbsl flat map:   " << testBigSeqInsert<AbslFlatSpec>() << '\n';
@@ -199,4 +283,22 @@ int main() {
 	std::cout << "\tAbsl node map:   " << testSmallRandLookup<AbslNodeSpec>() << '\n';
 	std::cout << "\tunordered map:   " << testSmallRandLookup<UnorderedMapSpec>() << '\n';
 	std::cout << "\tmap:             " << testSmallRandLookup<MapSpec>() << '\n';
+
+	std::cout << "Big churn:\n";
+	std::cout << "\tGilia namespace: " << testBigChurn<GiliaSpec>() << '\n';
+	GiliaSpec::printStats();
+	std::cout << "\tAbsl flat map:   " << testBigChurn<AbslFlatSpec>() << '\n';
+	std::cout << "\tAbsl node map:   " << testBigChurn<AbslNodeSpec>() << '\n';
+	std::cout << "\tunordered map:   " << testBigChurn<UnorderedMapSpec>() << '\n';
+	std::cout << "\tmap:             " << testBigChurn<MapSpec>() << '\n';
+
+	std::cout << "Small rand delete:\n";
+	std::cout << "\tGilia namespace: " << testSmallRandDelete<GiliaSpec>() << '\n';
+	GiliaSpec::printStats();
+	std::cout << "\tAbsl flat map:   " << testSmallRandDelete<AbslFlatSpec>() << '\n';
+	std::cout << "\tAbsl node map:   " << testSmallRandDelete<AbslNodeSpec>() << '\n';
+	std::cout << "\tunordered map:   " << testSmallRandDelete<UnorderedMapSpec>() << '\n';
+	std::cout << "\tmap:             " << testSmallRandDelete<MapSpec>() << '\n';
+
+	gil_arena_free(&vm.arena);
 }
@@ -6,8 +6,16 @@
 #if defined(__unix__) || defined(__unix) || (defined(__APPLE__) && defined(__MACH__))
 #define USE_READLINE
 #define USE_POSIX
+#include <errno.h>
+#include <signal.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 #endif
@@ -30,14 +38,55 @@ struct gil_module;
 static int do_step = 0;
 static int do_serialize_bytecode = 0;
 static int do_repl = 0;
+static int do_mem_stats = 0;
+static int gc_threads = 1;
+static struct gil_vm_gc_policy gc_policy;
+static size_t mem_limit = 0;
 static char *input_filename = "-";
+static char *snapshot_in = NULL;
+static char *snapshot_out = NULL;
+#ifdef USE_POSIX
+static double timeout = -1;
+static char *fork_server_path = NULL;
+static char *fork_client_path = NULL;
+#endif
 
 static struct gil_mod_builtins builtins;
 static struct gil_module **modules;
 static size_t moduleslen;
 static struct gil_fs_resolver resolver;
 
-static int parse_text(FILE *inf, struct gil_io_mem_writer *w) {
+static void init_gen(
+		struct gil_generator *gen, struct gil_io_mem_writer *w,
+		struct gil_generator_resolver *resolver) {
+	gil_gen_init(gen, &w->w, &builtins.base, resolver);
+	for (size_t i = 0; i < moduleslen; ++i) {
+		gil_gen_register_module(gen, modules[i]);
+	}
+}
+
+// Atoms can be made at runtime, so the VM's and the generator's atom sets
+// are kept in step by catching one up with the other whenever it's its turn
+static int sync_atoms(struct gil_strset *set, struct gil_strset *from) {
+	if (gil_strset_extend(set, from) < 0) {
+		fprintf(stderr, "The VM's and the generator's atoms don't match\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+// Catch the VM up with the generator, which also lets it make new atoms
+static int sync_vm_atoms(struct gil_vm *vm, struct gil_generator *gen) {
+	if (gil_vm_add_atoms(vm, &gen->atomset) < 0) {
+		fprintf(stderr, "The VM's and the generator's atoms don't match\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int parse_text(FILE *inf, struct gil_io_mem_writer *w, struct gil_generator *gen) {
 	// Init lexer with its input reader
 	struct gil_io_file_reader r;
 	r.r.read = gil_io_file_read;
@@ -45,30 +94,112 @@ static int parse_text(FILE *inf, struct gil_io_mem_writer *w) {
 	struct gil_lexer lexer;
 	gil_lexer_init(&lexer, &r.r);
 
-	// Init gen with its output writer
-	struct gil_generator gen;
-	gil_gen_init(&gen, &w->w, &builtins.base, &resolver.base);
-	for (size_t i = 0; i < moduleslen; ++i) {
-		gil_gen_register_module(&gen, modules[i]);
-	}
-
 	struct gil_parse_error err;
-	struct gil_parse_context ctx = {&lexer, &gen, &err};
+	struct gil_parse_context ctx = {&lexer, gen, &err};
 	if (gil_parse_program(&ctx) < 0) {
 		fprintf(stderr, "Parse error: %s:%i:%i: %s\n",
 				input_filename, err.line, err.ch, err.message);
 		gil_parse_error_free(&err);
-		gil_gen_free(&gen);
 		return -1;
 	}
 
-	for (gil_word i = 0; i < gen.relocslen; ++i) {
-		gil_word pos = gen.relocs[i].pos;
-		gil_word rep = gen.relocs[i].replacement;
+	for (gil_word i = 0; i < gen->relocslen; ++i) {
+		gil_word pos = gen->relocs[i].pos;
+		gil_word rep = gen->relocs[i].replacement;
 		gil_gen_fixup_reloc(&((unsigned char *)w->mem)[pos], rep);
 	}
 
-	gil_gen_free(&gen);
+	return 0;
+}
+
+// Load the VM from the snapshot given with --snapshot. Its bytecode is copied
+// to 'w', and the generator continues after it, so that new code can be
+// run in the snapshot's root namespace. The VM keeps using the payloads
+// in the image, so it stays around until the process exits.
+static int load_snapshot(
+		struct gil_vm *vm, struct gil_generator *gen, struct gil_io_mem_writer *w) {
+	FILE *f = fopen(snapshot_in, "r");
+	if (f == NULL) {
+		perror(snapshot_in);
+		return -1;
+	}
+
+	void *image;
+	size_t len;
+#ifdef USE_POSIX
+	struct stat st;
+	if (fstat(fileno(f), &st) < 0) {
+		perror(snapshot_in);
+		fclose(f);
+		return -1;
+	}
+
+	len = st.st_size;
+	image = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(f), 0);
+	if (image == MAP_FAILED) {
+		perror(snapshot_in);
+		fclose(f);
+		return -1;
+	}
+#else
+	struct gil_io_mem_writer iw = {
+		.w.write = gil_io_mem_write,
+	};
+	char buf[4096];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+		iw.w.write(&iw.w, buf, n);
+	}
+
+	image = iw.mem;
+	len = iw.len;
+#endif
+	fclose(f);
+
+	int ret = gil_vm_snapshot_load(
+			vm, image, len, &builtins.base, modules, moduleslen, &gen->atomset);
+	if (ret >= 0) {
+		w->w.write(&w->w, vm->ops, vm->opslen);
+		vm->ops = w->mem;
+		gen->pos = w->len;
+		if (sync_atoms(&gen->atomset, &vm->atomset) < 0) {
+			gil_vm_free(vm);
+			ret = -1;
+		}
+	}
+
+	if (ret < 0) {
+#ifdef USE_POSIX
+		munmap(image, len);
+#else
+		free(image);
+#endif
+	}
+
+	return ret;
+}
+
+static int save_snapshot(struct gil_vm *vm, struct gil_generator *gen) {
+	struct gil_io_file_writer w = {
+		.w.write = gil_io_file_write,
+		.f = fopen(snapshot_out, "w"),
+	};
+	if (w.f == NULL) {
+		perror(snapshot_out);
+		return -1;
+	}
+
+	if (gil_vm_snapshot_save(vm, gen == NULL ? NULL : &gen->atomset, &w.w) < 0) {
+		fclose(w.f);
+		return -1;
+	}
+
+	int failed = ferror(w.f);
+	if (fclose(w.f) != 0 || failed) {
+		fprintf(stderr, "%s: Write error\n", snapshot_out);
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -101,6 +232,361 @@ static void step_through(struct gil_vm *vm) {
 	}
 }
 
+// Run the VM until it halts, honoring --step and --timeout,
+// and print memory statistics if asked to
+static int run(struct gil_vm *vm) {
+	if (do_step) {
+		step_through(vm);
+#ifdef USE_POSIX
+	} else if (timeout > 0) {
+		// I usually like to work with time as doubles containing seconds,
+		// but we're gonna have to check if we're over after every single instruction,
+		// so we do some work ahead of time to make that check really cheap
+		// in the hot loop
+		struct timespec end, now;
+		if (clock_gettime(CLOCK_MONOTONIC, &end) < 0) {
+			perror("clock_gettime");
+			return -1;
+		}
+
+		end.tv_sec += (time_t)timeout;
+		end.tv_nsec += (long)((timeout - (long)timeout) * 1000000000);
+		if (end.tv_nsec > 1000000000) {
+			end.tv_nsec -= 1000000000;
+			end.tv_sec += 1;
+		}
+
+		while (!vm->halted) {
+			gil_vm_step(vm);
+
+			if (clock_gettime(CLOCK_MONOTONIC, &now) < 0) {
+				perror("clock_gettime");
+				return -1;
+			} else if (
+					now.tv_sec > end.tv_sec ||
+					(now.tv_sec == end.tv_sec && now.tv_nsec >= end.tv_nsec)) {
+				fprintf(stderr, "Timeout reached.\n");
+				break;
+			}
+		}
+#endif
+	} else {
+		gil_vm_run(vm);
+	}
+
+	if (do_mem_stats) {
+		struct gil_vm_memory_usage mem;
+		gil_vm_get_memory_usage(vm, &mem);
+		fprintf(stderr, "Memory: %zu bytes of values, %zu bytes of payloads\n",
+				mem.value_bytes, mem.payload_bytes);
+
+		struct gil_arena_stats stats;
+		gil_vm_get_arena_stats(vm, &stats);
+		fprintf(stderr, "Values: %zu slots\n", vm->valuessize);
+		fprintf(stderr, "Arena: %zu bytes in slabs, %zu bytes in large blocks\n",
+				stats.slab_bytes, stats.large_bytes);
+		fprintf(stderr, "Arena: %zu bytes in mapped blocks\n", stats.mapped_bytes);
+		fprintf(stderr, "Arena: %zu bytes used (%zu requested), %zu bytes free\n",
+				stats.used_bytes, stats.requested_bytes, stats.free_bytes);
+		fprintf(stderr, "Arena: %zu bytes wasted\n", gil_arena_wasted_bytes(&vm->arena));
+	}
+
+	return 0;
+}
+
+#ifdef USE_POSIX
+
+// What the fork server sends back to the client once its program has exited.
+// The client and server are always the same binary on the same machine,
+// so it's just sent as-is.
+struct fork_server_result {
+	int64_t status; // Exit status, or 128 + the signal number if it was killed
+	int64_t wall_usec;
+	int64_t user_usec;
+	int64_t sys_usec;
+	int64_t maxrss_kb;
+};
+
+static int fork_server_address(struct sockaddr_un *addr, const char *path) {
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		fprintf(stderr, "%s: Socket path too long\n", path);
+		return -1;
+	}
+
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+static int64_t timeval_usec(struct timeval *tv) {
+	return (int64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+	const char *ptr = buf;
+	while (len > 0) {
+		ssize_t n = write(fd, ptr, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n <= 0) {
+			return -1;
+		}
+
+		ptr += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len) {
+	char *ptr = buf;
+	while (len > 0) {
+		ssize_t n = read(fd, ptr, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n <= 0) {
+			return -1;
+		}
+
+		ptr += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+// Serve one request from a client. This runs in a child of the server,
+// which forks once more to get a fresh copy of the VM for the program,
+// and waits for it so that it can report how it went.
+static void fork_server_handle(struct gil_vm *vm, int conn) {
+	char byte;
+	struct iovec iov = {&byte, 1};
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+	} control;
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+
+	ssize_t n;
+	do {
+		n = recvmsg(conn, &msg, 0);
+	} while (n < 0 && errno == EINTR);
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (
+			n != 1 || cmsg == NULL ||
+			cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+			cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int))) {
+		fprintf(stderr, "Fork server: Bad request\n");
+		_exit(1);
+	}
+
+	int fds[3];
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		_exit(1);
+	} else if (pid == 0) {
+		close(conn);
+		for (int fd = 0; fd < 3; ++fd) {
+			if (dup2(fds[fd], fd) < 0) {
+				_exit(1);
+			}
+		}
+		for (int i = 0; i < 3; ++i) {
+			if (fds[i] > 2) {
+				close(fds[i]);
+			}
+		}
+
+		int ret = run(vm) < 0 ? 1 : 0;
+		fflush(NULL);
+		_exit(ret);
+	}
+
+	for (int i = 0; i < 3; ++i) {
+		close(fds[i]);
+	}
+
+	int status;
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			perror("waitpid");
+			_exit(1);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	struct rusage usage;
+	getrusage(RUSAGE_CHILDREN, &usage);
+
+	struct fork_server_result result;
+	if (WIFSIGNALED(status)) {
+		result.status = 128 + WTERMSIG(status);
+	} else {
+		result.status = WEXITSTATUS(status);
+	}
+	result.wall_usec =
+		((int64_t)end.tv_sec - start.tv_sec) * 1000000 +
+		(end.tv_nsec - start.tv_nsec) / 1000;
+	result.user_usec = timeval_usec(&usage.ru_utime);
+	result.sys_usec = timeval_usec(&usage.ru_stime);
+	result.maxrss_kb = usage.ru_maxrss;
+
+	// If the client went away, there's nobody left to tell
+	write_all(conn, &result, sizeof(result));
+	_exit(0);
+}
+
+// Listen on a Unix socket, and run the program once for every client
+// which connects, in a copy-on-write copy of the loaded VM.
+// That way, the program is only parsed (and its snapshot only loaded) once.
+static int fork_server(struct gil_vm *vm) {
+	struct sockaddr_un addr;
+	if (fork_server_address(&addr, fork_server_path) < 0) {
+		return -1;
+	}
+
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	// Replace the socket left behind by an earlier server,
+	// but nothing else
+	struct stat st;
+	if (stat(fork_server_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		unlink(fork_server_path);
+	}
+
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror(fork_server_path);
+		close(sock);
+		return -1;
+	}
+
+	if (listen(sock, 64) < 0) {
+		perror("listen");
+		close(sock);
+		return -1;
+	}
+
+	// Handlers are never waited for, so let them be reaped automatically.
+	// Handlers need to wait for their own children though.
+	signal(SIGCHLD, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+
+	while (1) {
+		int conn = accept(sock, NULL, NULL);
+		if (conn < 0 && errno == EINTR) {
+			continue;
+		} else if (conn < 0) {
+			perror("accept");
+			close(sock);
+			return -1;
+		}
+
+		// The children shouldn't get a copy of whatever's in our buffers
+		fflush(NULL);
+
+		pid_t pid = fork();
+		if (pid < 0) {
+			perror("fork");
+		} else if (pid == 0) {
+			close(sock);
+			signal(SIGCHLD, SIG_DFL);
+			fork_server_handle(vm, conn);
+		}
+
+		close(conn);
+	}
+}
+
+// Run the program in the fork server listening on 'path',
+// with our stdin, stdout and stderr.
+static int fork_client(const char *path) {
+	struct sockaddr_un addr;
+	if (fork_server_address(&addr, path) < 0) {
+		return 1;
+	}
+
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) {
+		perror("socket");
+		return 1;
+	}
+
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror(path);
+		close(sock);
+		return 1;
+	}
+
+	int fds[3] = {0, 1, 2};
+	char byte = 0;
+	struct iovec iov = {&byte, 1};
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(fds))];
+	} control;
+	memset(&control, 0, sizeof(control));
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	ssize_t n;
+	do {
+		n = sendmsg(sock, &msg, 0);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) {
+		perror("sendmsg");
+		close(sock);
+		return 1;
+	}
+
+	struct fork_server_result result;
+	if (read_all(sock, &result, sizeof(result)) < 0) {
+		fprintf(stderr, "Fork server: No result\n");
+		close(sock);
+		return 1;
+	}
+	close(sock);
+
+	if (do_mem_stats) {
+		fprintf(stderr, "Time: %.3fs wall, %.3fs user, %.3fs system\n",
+				result.wall_usec / 1000000.0,
+				result.user_usec / 1000000.0,
+				result.sys_usec / 1000000.0);
+		fprintf(stderr, "Max RSS: %lld KiB\n", (long long)result.maxrss_kb);
+	}
+
+	return (int)result.status;
+}
+
+#endif
+
 static void repl(void) {
 	struct gil_io_mem_writer w = {
 		.w.write = gil_io_mem_write,
@@ -113,17 +599,26 @@ static void repl(void) {
 	struct gil_lexer lexer;
 
 	struct gil_generator gen;
-	gil_gen_init(&gen, &w.w, &builtins.base, NULL);
-	for (size_t i = 0; i < moduleslen; ++i) {
-		gil_gen_register_module(&gen, modules[i]);
-	}
+	init_gen(&gen, &w, NULL);
 
 	struct gil_vm vm;
-	gil_vm_init(&vm, NULL, 0, &builtins.base);
-	for (size_t i = 0; i < moduleslen; ++i) {
-		gil_vm_register_module(&vm, modules[i]);
+	if (snapshot_in != NULL) {
+		if (load_snapshot(&vm, &gen, &w) < 0) {
+			gil_gen_free(&gen);
+			free(w.mem);
+			return;
+		}
+	} else {
+		gil_vm_init(&vm, NULL, 0, &builtins.base);
+		for (size_t i = 0; i < moduleslen; ++i) {
+			gil_vm_register_module(&vm, modules[i]);
+		}
 	}
 
+	vm.gc_threads = gc_threads;
+	gil_vm_set_gc_policy(&vm, &gc_policy);
+	gil_vm_set_memory_limit(&vm, mem_limit);
+
 	struct gil_io_file_writer stdout_writer = {
 		.w.write = gil_io_file_write,
 		.f = stdout,
@@ -154,6 +649,9 @@ static void repl(void) {
 
 		// The next instruction should be the code we're about to generate
 		vm.iptr = w.len;
+		if (sync_atoms(&gen.atomset, &vm.atomset) < 0) {
+			goto out;
+		}
 
 		// Generate code for the user's line, store the output
 		// in the variable '$$'
@@ -201,6 +699,10 @@ static void repl(void) {
 		gen.relocs = NULL;
 		gen.relocslen = 0;
 
+		if (sync_vm_atoms(&vm, &gen) < 0) {
+			goto out;
+		}
+
 		// Run the resulting code
 		vm.ops = w.mem;
 		vm.opslen = w.len;
@@ -231,8 +733,27 @@ static void usage(const char *argv0) {
 	printf("  --repl:            Start a repl\n");
 	printf("  --output,-o <out>: Write bytecode to file\n");
 	printf("  --bc:              Allow reading bytecode files\n");
+	printf("  --gc-threads <n>:  Use <n> threads for garbage collection\n");
+	printf("  --gc-growth <f>:   Grow the value heap by a factor of <f>\n");
+	printf("  --gc-min-heap <n>: Start with room for <n> values\n");
+	printf("  --gc-max-heap <n>: Never grow beyond <n> values (0: no limit)\n");
+	printf("  --gc-reserve <n>:  Reserve address space for <n> values\n");
+	printf("  --gc-trigger-bytes <n>:\n");
+	printf("                     Collect after allocating <n> bytes (0: never)\n");
+	printf("  --gc-compact-ratio <f>:\n");
+	printf("                     Compact the heap when less than <f> is live\n");
+	printf("  --gc-huge-pages:   Use huge pages for the value heap\n");
+	printf("  --mem-limit <n>:   Stop the program if it uses more than <n> bytes\n");
+	printf("  --mem-stats:       Print memory statistics when the program exits\n");
+	printf("  --snapshot <file>: Start from a snapshot, then run the input\n");
+	printf("  --snapshot-save <file>:\n");
+	printf("                     Save a snapshot when the program exits\n");
 #ifdef USE_POSIX
 	printf("  --timeout <secs>:  Run instructions for <secs> seconds\n");
+	printf("  --fork-server <socket>:\n");
+	printf("                     Load the input, then run it for every client\n");
+	printf("  --fork-client <socket>:\n");
+	printf("                     Run the program loaded by a fork server\n");
 #endif
 #ifdef GIL_ENABLE_TRACE
 	printf("  --trace-lexer:     Trace the lexer\n");
@@ -243,10 +764,6 @@ static void usage(const char *argv0) {
 }
 
 int main(int argc, char **argv) {
-#ifdef USE_POSIX
-	double timeout = -1;
-#endif
-
 	int was_inf_set = 0;
 	int enable_bc = 0;
 	FILE *inf = stdin;
@@ -256,6 +773,8 @@ int main(int argc, char **argv) {
 	do_repl = isatty(0);
 #endif
 
+	gil_vm_gc_policy_init(&gc_policy);
+
 	int dashes = 0;
 	for (int i = 1; i < argc; ++i) {
 		if (!dashes && strcmp(argv[i], "--help") == 0) {
@@ -285,6 +804,90 @@ int main(int argc, char **argv) {
 			}
 		} else if (!dashes && strcmp(argv[i], "--bc") == 0) {
 			enable_bc = 1;
+		} else if (!dashes && strcmp(argv[i], "--gc-threads") == 0) {
+			if (i == argc - 1) {
+				fprintf(stderr, "%s expects an argument\n", argv[i]);
+				return 1;
+			}
+
+			i += 1;
+			gc_threads = atoi(argv[i]);
+			if (gc_threads < 1) {
+				fprintf(stderr, "Invalid GC thread count: %s\n", argv[i]);
+				return 1;
+			}
+		} else if (!dashes && strcmp(argv[i], "--gc-growth") == 0) {
+			if (i == argc - 1) {
+				fprintf(stderr, "%s expects an argument\n", argv[i]);
+				return 1;
+			}
+
+			i += 1;
+			gc_policy.growth_factor = strtod(argv[i], NULL);
+			if (!(gc_policy.growth_factor > 1)) {
+				fprintf(stderr, "Invalid GC growth factor: %s\n", argv[i]);
+				return 1;
+			}
+		} else if (!dashes && (
+				strcmp(argv[i], "--snapshot") == 0 ||
+				strcmp(argv[i], "--snapshot-save") == 0)) {
+			if (i == argc - 1) {
+				fprintf(stderr, "%s expects an argument\n", argv[i]);
+				return 1;
+			}
+
+			if (strcmp(argv[i], "--snapshot") == 0) {
+				snapshot_in = argv[i + 1];
+			} else {
+				snapshot_out = argv[i + 1];
+			}
+			i += 1;
+		} else if (!dashes && strcmp(argv[i], "--mem-stats") == 0) {
+			do_mem_stats = 1;
+		} else if (!dashes && strcmp(argv[i], "--gc-huge-pages") == 0) {
+			gc_policy.huge_pages = 1;
+		} else if (!dashes && strcmp(argv[i], "--gc-compact-ratio") == 0) {
+			if (i == argc - 1) {
+				fprintf(stderr, "%s expects an argument\n", argv[i]);
+				return 1;
+			}
+
+			i += 1;
+			gc_policy.compact_ratio = strtod(argv[i], NULL);
+			if (!(gc_policy.compact_ratio >= 0 && gc_policy.compact_ratio < 1)) {
+				fprintf(stderr, "Invalid GC compaction ratio: %s\n", argv[i]);
+				return 1;
+			}
+		} else if (!dashes && (
+				strcmp(argv[i], "--gc-min-heap") == 0 ||
+				strcmp(argv[i], "--gc-max-heap") == 0 ||
+				strcmp(argv[i], "--gc-reserve") == 0 ||
+				strcmp(argv[i], "--gc-trigger-bytes") == 0 ||
+				strcmp(argv[i], "--mem-limit") == 0)) {
+			if (i == argc - 1) {
+				fprintf(stderr, "%s expects an argument\n", argv[i]);
+				return 1;
+			}
+
+			char *end;
+			size_t num = strtoull(argv[i + 1], &end, 10);
+			if (*argv[i + 1] == '\0' || *end != '\0') {
+				fprintf(stderr, "%s: Invalid number: %s\n", argv[i], argv[i + 1]);
+				return 1;
+			}
+
+			if (strcmp(argv[i], "--gc-min-heap") == 0) {
+				gc_policy.min_values = num;
+			} else if (strcmp(argv[i], "--gc-max-heap") == 0) {
+				gc_policy.max_values = num;
+			} else if (strcmp(argv[i], "--gc-reserve") == 0) {
+				gc_policy.reserve_values = num;
+			} else if (strcmp(argv[i], "--mem-limit") == 0) {
+				mem_limit = num;
+			} else {
+				gc_policy.trigger_bytes = num;
+			}
+			i += 1;
 #ifdef USE_POSIX
 		} else if (!dashes && strcmp(argv[i], "--timeout") == 0) {
 			if (i == argc - 1) {
@@ -294,6 +897,20 @@ int main(int argc, char **argv) {
 
 			i += 1;
 			timeout = strtod(argv[i], NULL);
+		} else if (!dashes && (
+				strcmp(argv[i], "--fork-server") == 0 ||
+				strcmp(argv[i], "--fork-client") == 0)) {
+			if (i == argc - 1) {
+				fprintf(stderr, "%s expects an argument\n", argv[i]);
+				return 1;
+			}
+
+			if (strcmp(argv[i], "--fork-server") == 0) {
+				fork_server_path = argv[i + 1];
+			} else {
+				fork_client_path = argv[i + 1];
+			}
+			i += 1;
 #endif
 #ifdef GIL_ENABLE_TRACE
 		} else if (!dashes && strcmp(argv[i], "--trace-lexer") == 0) {
@@ -327,6 +944,34 @@ int main(int argc, char **argv) {
 		}
 	}
 
+	if (snapshot_in != NULL && do_serialize_bytecode) {
+		fprintf(stderr, "--snapshot can't be used with --output\n");
+		return 1;
+	}
+
+#ifdef USE_POSIX
+	// The client only passes on its stdio, so everything else
+	// is up to the server
+	if (fork_client_path != NULL) {
+		if (was_inf_set) {
+			fprintf(stderr, "--fork-client doesn't take an input\n");
+			return 1;
+		}
+
+		return fork_client(fork_client_path);
+	}
+
+	if (fork_server_path != NULL) {
+		if (do_step || do_serialize_bytecode || snapshot_out != NULL) {
+			fprintf(stderr,
+					"--fork-server can't be used with --step, --output or --snapshot-save\n");
+			return 1;
+		}
+
+		do_repl = 0;
+	}
+#endif
+
 	gil_mod_builtins_init(&builtins);
 
 	struct gil_mod_fs mod_fs;
@@ -351,6 +996,19 @@ int main(int argc, char **argv) {
 		.w.write = gil_io_mem_write,
 	};
 
+	struct gil_generator gen;
+	init_gen(&gen, &bytecode_writer, &resolver.base);
+
+	// With a snapshot, the input is run after the snapshot's code
+	struct gil_vm vm;
+	if (snapshot_in != NULL && load_snapshot(&vm, &gen, &bytecode_writer) < 0) {
+		gil_gen_free(&gen);
+		free(bytecode_writer.mem);
+		return 1;
+	}
+	gil_word start = (gil_word)bytecode_writer.len;
+	int is_bytecode = 0;
+
 	int headerbyte = fgetc(inf);
 	if (headerbyte != EOF) {
 		if (ungetc(headerbyte, inf) == EOF) {
@@ -372,7 +1030,12 @@ int main(int argc, char **argv) {
 			fprintf(stderr, "Refusing to use bytecode file without --bc.\n");
 			return 1;
 		}
-		if (gil_bc_load(inf, &bytecode_writer.w) < 0) {
+		if (snapshot_in != NULL) {
+			fprintf(stderr, "Can't run a bytecode file with --snapshot.\n");
+			return 1;
+		}
+		is_bytecode = 1;
+		if (gil_bc_load(inf, &bytecode_writer.w, &gen.atomset) < 0) {
 			return 1;
 		}
 	} else if (headerbyte == 0x1b) {
@@ -382,8 +1045,9 @@ int main(int argc, char **argv) {
 				input_filename);
 		return 1;
 	} else {
-		if (parse_text(inf, &bytecode_writer) < 0) {
+		if (parse_text(inf, &bytecode_writer, &gen) < 0) {
 			fclose(inf);
+			gil_gen_free(&gen);
 			free(bytecode_writer.mem);
 			return 1;
 		}
@@ -391,65 +1055,71 @@ int main(int argc, char **argv) {
 	fclose(inf);
 
 	if (do_serialize_bytecode) {
-		if (gil_bc_serialize(outbc, bytecode_writer.mem, bytecode_writer.len) < 0) {
+		if (gil_bc_serialize(
+				outbc, bytecode_writer.mem, bytecode_writer.len, &gen.atomset) < 0) {
 			return 1;
 		}
 	}
 
 	if (do_serialize_bytecode) {
+		gil_gen_free(&gen);
 		free(bytecode_writer.mem);
 		return 0;
 	}
 
-	struct gil_vm vm;
-	gil_vm_init(&vm, bytecode_writer.mem, bytecode_writer.len, &builtins.base);
-	for (size_t i = 0; i < moduleslen; ++i) {
-		gil_vm_register_module(&vm, modules[i]);
-	}
-
-	if (do_step) {
-		step_through(&vm);
-#ifdef USE_POSIX
-	} else if (timeout > 0) {
-		// I usually like to work with time as doubles containing seconds,
-		// but we're gonna have to check if we're over after every single instruction,
-		// so we do some work ahead of time to make that check really cheap
-		// in the hot loop
-		struct timespec end, now;
-		if (clock_gettime(CLOCK_MONOTONIC, &end) < 0) {
-			perror("clock_gettime");
-			gil_vm_free(&vm);
-			free(bytecode_writer.mem);
-			return 1;
+	if (snapshot_in != NULL) {
+		vm.ops = bytecode_writer.mem;
+		vm.opslen = bytecode_writer.len;
+		vm.iptr = start;
+		vm.halted = 0;
+	} else {
+		gil_vm_init(&vm, bytecode_writer.mem, bytecode_writer.len, &builtins.base);
+		for (size_t i = 0; i < moduleslen; ++i) {
+			gil_vm_register_module(&vm, modules[i]);
 		}
+	}
 
-		end.tv_sec += (time_t)timeout;
-		end.tv_nsec += (long)((timeout - (long)timeout) * 1000000000);
-		if (end.tv_nsec > 1000000000) {
-			end.tv_nsec -= 1000000000;
-			end.tv_sec += 1;
-		}
+	if (sync_vm_atoms(&vm, &gen) < 0) {
+		gil_vm_free(&vm);
+		gil_gen_free(&gen);
+		free(bytecode_writer.mem);
+		return 1;
+	}
 
-		while (!vm.halted) {
-			gil_vm_step(&vm);
+	vm.gc_threads = gc_threads;
+	gil_vm_set_gc_policy(&vm, &gc_policy);
+	gil_vm_set_memory_limit(&vm, mem_limit);
 
-			if (clock_gettime(CLOCK_MONOTONIC, &now) < 0) {
-				perror("clock_gettime");
-				gil_vm_free(&vm);
-				free(bytecode_writer.mem);
-				return 1;
-			} else if (
-					now.tv_sec > end.tv_sec ||
-					(now.tv_sec == end.tv_sec && now.tv_nsec >= end.tv_nsec)) {
-				fprintf(stderr, "Timeout reached.\n");
-				break;
-			}
-		}
+#ifdef USE_POSIX
+	if (fork_server_path != NULL) {
+		int ret = fork_server(&vm) < 0 ? 1 : 0;
+		gil_vm_free(&vm);
+		gil_gen_free(&gen);
+		free(bytecode_writer.mem);
+		return ret;
+	}
 #endif
-	} else {
-		gil_vm_run(&vm);
+
+	if (run(&vm) < 0) {
+		gil_vm_free(&vm);
+		gil_gen_free(&gen);
+		free(bytecode_writer.mem);
+		return 1;
+	}
+
+	// A snapshot of a program which failed isn't worth starting from
+	int ret = 0;
+	if (snapshot_out != NULL && vm.error != 0) {
+		fprintf(stderr, "Not saving a snapshot, since the program failed.\n");
+		ret = 1;
+	} else if (
+			snapshot_out != NULL &&
+			save_snapshot(&vm, is_bytecode ? NULL : &gen) < 0) {
+		ret = 1;
 	}
 
 	gil_vm_free(&vm);
+	gil_gen_free(&gen);
 	free(bytecode_writer.mem);
+	return ret;
 }
@@ -0,0 +1,28 @@
+#ifndef GIL_ALLOC_H
+#define GIL_ALLOC_H
+
+#include <stdlib.h>
+
+// A set of allocation functions, which behave like malloc, realloc and free.
+// 'data' is passed to each of them.
+// A VM only calls its allocator from the thread which runs it,
+// even when it collects garbage with more than one thread,
+// so the functions don't have to be thread safe.
+struct gil_allocator {
+	void *(*alloc)(void *data, size_t size);
+	void *(*realloc)(void *data, void *ptr, size_t size);
+	void (*free)(void *data, void *ptr);
+	void *data;
+};
+
+// Uses malloc, realloc and free.
+extern struct gil_allocator gil_default_allocator;
+
+void *gil_allocator_alloc(struct gil_allocator *alloc, size_t size);
+
+// Allocates zeroed memory for 'count' items of 'size' bytes.
+void *gil_allocator_calloc(struct gil_allocator *alloc, size_t count, size_t size);
+void *gil_allocator_realloc(struct gil_allocator *alloc, void *ptr, size_t size);
+void gil_allocator_free(struct gil_allocator *alloc, void *ptr);
+
+#endif
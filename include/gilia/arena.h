@@ -0,0 +1,75 @@
+#ifndef GIL_ARENA_H
+#define GIL_ARENA_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "alloc.h"
+
+// Allocations up to this size (including an 8 byte header) are carved out
+// of slabs and recycled through per-size-class freelists.
+// Anything bigger goes straight to the arena's allocator.
+#define GIL_ARENA_MAX_SMALL 4096
+
+// Where mmap is available, and the arena uses the default allocator,
+// allocations of at least this size get a mapping of their own,
+// which is unmapped as soon as they're freed.
+#ifndef GIL_ARENA_MAP_THRESHOLD
+#define GIL_ARENA_MAP_THRESHOLD (256 * 1024)
+#endif
+
+// 16 byte steps up to 256 bytes, then powers of two up to GIL_ARENA_MAX_SMALL
+#define GIL_ARENA_NCLASSES (16 + 4)
+
+struct gil_arena_slab;
+struct gil_arena_large;
+
+struct gil_arena_stats {
+	size_t slab_bytes; // Bytes in slabs
+	size_t large_bytes; // Bytes in allocations which are too big for slabs
+	size_t mapped_bytes; // Bytes mapped for allocations above GIL_ARENA_MAP_THRESHOLD
+	size_t used_bytes; // Bytes in live small blocks, rounded up to their size class
+	size_t requested_bytes; // Bytes asked for by live small blocks
+	size_t free_bytes; // Bytes in freelists
+};
+
+struct gil_arena {
+	struct gil_arena_slab *slabs;
+	struct gil_arena_large *large;
+	struct gil_arena_large *mapped;
+	char *bump;
+	char *bumpend;
+	void *freelists[GIL_ARENA_NCLASSES];
+	struct gil_arena_stats stats;
+	struct gil_allocator *alloc; // Where slabs and large allocations come from
+};
+
+void gil_arena_init(struct gil_arena *arena);
+void gil_arena_init_with_allocator(struct gil_arena *arena, struct gil_allocator *alloc);
+
+// Release everything the arena has allocated, all at once.
+void gil_arena_free(struct gil_arena *arena);
+
+void *gil_arena_alloc(struct gil_arena *arena, size_t size);
+void *gil_arena_realloc(struct gil_arena *arena, void *ptr, size_t size);
+void gil_arena_dealloc(struct gil_arena *arena, void *ptr);
+
+// The size which an allocation was last allocated or reallocated with.
+size_t gil_arena_size(struct gil_arena *arena, void *ptr);
+
+// Every allocation is preceded by a header of this many bytes.
+#define GIL_ARENA_HEADER_SIZE 8
+
+// Make an allocation of 'size' bytes out of memory which the arena doesn't own,
+// with the header written to the GIL_ARENA_HEADER_SIZE bytes at 'mem'.
+// It works with every arena function, but it isn't counted in the stats,
+// deallocating it does nothing, and reallocating it copies it into the arena.
+// 'size' must be less than 4 GiB. Returns the allocation, right after the header.
+void *gil_arena_adopt(void *mem, size_t size);
+
+// Bytes of memory held by the arena which aren't in use:
+// slab space in freelists or not handed out yet, plus the rounding
+// of live blocks up to their size class.
+size_t gil_arena_wasted_bytes(struct gil_arena *arena);
+
+#endif
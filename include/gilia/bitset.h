@@ -3,6 +3,8 @@
 
 #include <stdlib.h>
 
+#include "alloc.h"
+
 typedef unsigned long long int gil_bitset_entry;
 
 struct gil_bitset {
@@ -13,14 +15,41 @@ struct gil_bitset {
 	gil_bitset_entry *dirs;
 	size_t dirslen;
 	size_t currdir;
+
+	struct gil_allocator *alloc;
 };
 
 void gil_bitset_init(struct gil_bitset *bs);
+void gil_bitset_init_with_allocator(struct gil_bitset *bs, struct gil_allocator *alloc);
 void gil_bitset_free(struct gil_bitset *bs);
 int gil_bitset_get(struct gil_bitset *bs, size_t id);
 size_t gil_bitset_set_next(struct gil_bitset *bs);
+
+// Set the lowest unset id, and the unset ids directly after it
+// in the same table, but none at or above 'limit' except the first.
+// The first id is written to 'start', and the number of ids is returned.
+size_t gil_bitset_set_run(struct gil_bitset *bs, size_t limit, size_t *start);
+
+// Make gil_bitset_set_next continue from the first non-full table
+// which contains 'id' or comes after it.
+void gil_bitset_seek(struct gil_bitset *bs, size_t id);
 void gil_bitset_unset(struct gil_bitset *bs, size_t id);
 
+// Set an id within the existing tables.
+void gil_bitset_set(struct gil_bitset *bs, size_t id);
+
+// Keep only the ids in table 'tblidx' which are also set in 'mask'.
+// Returns the ids which were removed.
+gil_bitset_entry gil_bitset_retain(
+		struct gil_bitset *bs, size_t tblidx, gil_bitset_entry mask);
+
+// Count the set ids.
+size_t gil_bitset_count(struct gil_bitset *bs);
+
+// Free trailing tables and directories which have no ids set,
+// and make gil_bitset_set_next start over from the beginning.
+void gil_bitset_shrink(struct gil_bitset *bs);
+
 struct gil_bitset_iterator {
 	size_t tableidx;
 	gil_bitset_entry table;
@@ -68,6 +68,8 @@ void gil_gen_named_param(
 		struct gil_generator *gen, gil_word idx, char **ident);
 void gil_gen_named_param_copy(
 		struct gil_generator *gen, gil_word idx, const char *ident);
+void gil_gen_named_param_id(
+		struct gil_generator *gen, gil_word idx, gil_word atom_id);
 
 void gil_gen_halt(struct gil_generator *gen);
 void gil_gen_rjmp(struct gil_generator *gen, gil_word len);
@@ -83,15 +85,18 @@ void gil_gen_number(struct gil_generator *gen, double num);
 void gil_gen_string(struct gil_generator *gen, char **str);
 void gil_gen_string_copy(struct gil_generator *gen, char *str);
 void gil_gen_atom(struct gil_generator *gen, char **ident);
-void gil_gen_atom_copy(struct gil_generator *gen, char *ident);
+void gil_gen_atom_copy(struct gil_generator *gen, const char *ident);
+void gil_gen_atom_id(struct gil_generator *gen, gil_word atom_id);
 void gil_gen_function(struct gil_generator *gen, gil_word pos);
 void gil_gen_array(struct gil_generator *gen, gil_word count);
 void gil_gen_module(struct gil_generator *gen, gil_word pos);
 void gil_gen_namespace(struct gil_generator *gen);
 void gil_gen_namespace_set(struct gil_generator *gen, char **ident);
-void gil_gen_namespace_set_copy(struct gil_generator *gen, char *ident);
+void gil_gen_namespace_set_copy(struct gil_generator *gen, const char *ident);
+void gil_gen_namespace_set_id(struct gil_generator *gen, gil_word atom_id);
 void gil_gen_namespace_lookup(struct gil_generator *gen, char **ident);
-void gil_gen_namespace_lookup_copy(struct gil_generator *gen, char *ident);
+void gil_gen_namespace_lookup_copy(struct gil_generator *gen, const char *ident);
+void gil_gen_namespace_lookup_id(struct gil_generator *gen, gil_word atom_id);
 void gil_gen_array_lookup(struct gil_generator *gen, int number);
 void gil_gen_array_set(struct gil_generator *gen, int number);
 void gil_gen_dynamic_lookup(struct gil_generator *gen);
@@ -99,11 +104,14 @@ void gil_gen_dynamic_set(struct gil_generator *gen);
 void gil_gen_stack_frame_get_args(struct gil_generator *gen);
 void gil_gen_stack_frame_get_arg(struct gil_generator *gen, gil_word idx);
 void gil_gen_stack_frame_lookup(struct gil_generator *gen, char **ident);
-void gil_gen_stack_frame_lookup_copy(struct gil_generator *gen, char *ident);
+void gil_gen_stack_frame_lookup_copy(struct gil_generator *gen, const char *ident);
+void gil_gen_stack_frame_lookup_id(struct gil_generator *gen, gil_word atom_id);
 void gil_gen_stack_frame_set(struct gil_generator *gen, char **ident);
-void gil_gen_stack_frame_set_copy(struct gil_generator *gen, char *ident);
+void gil_gen_stack_frame_set_copy(struct gil_generator *gen, const char *ident);
+void gil_gen_stack_frame_set_id(struct gil_generator *gen, gil_word atom_id);
 void gil_gen_stack_frame_replace(struct gil_generator *gen, char **ident);
-void gil_gen_stack_frame_replace_copy(struct gil_generator *gen, char *ident);
+void gil_gen_stack_frame_replace_copy(struct gil_generator *gen, const char *ident);
+void gil_gen_stack_frame_replace_id(struct gil_generator *gen, gil_word atom_id);
 void gil_gen_assert(struct gil_generator *gen);
 void gil_gen_func_call(struct gil_generator *gen, gil_word argc);
 void gil_gen_func_call_infix(struct gil_generator *gen);
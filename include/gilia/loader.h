@@ -3,8 +3,14 @@
 
 #include <stdio.h>
 struct gil_io_writer;
+struct gil_strset;
 
-int gil_bc_serialize(FILE *outf, unsigned char *data, size_t len);
-int gil_bc_load(FILE *inf, struct gil_io_writer *w);
+// The bytecode is preceded by the names of the atoms it uses,
+// so that the VM can be given the same atoms when the bytecode is loaded.
+int gil_bc_serialize(
+		FILE *outf, unsigned char *data, size_t len, struct gil_strset *atoms);
+// Read the atoms into 'atoms', which must have the same ids for the names
+// it already has (like the generator's atom set), and the bytecode into 'w'.
+int gil_bc_load(FILE *inf, struct gil_io_writer *w, struct gil_strset *atoms);
 
 #endif
@@ -4,8 +4,18 @@
 
 struct gil_vm;
 
+typedef gil_word (*gil_vm_cfunction)(
+		struct gil_vm *vm, gil_word mid, gil_word self,
+		gil_word argc, gil_word *argv);
+
 struct gil_module {
 	char *name;
+
+	// Every C function the module creates, terminated by NULL.
+	// VM snapshots refer to C functions by their index in this list.
+	// Can be NULL, in which case VMs using the module can't be snapshotted.
+	const gil_vm_cfunction *functions;
+
 	void (*init)(
 			struct gil_module *mod,
 			gil_word (*alloc)(void *data, const char *name), void *data);
@@ -13,4 +23,11 @@ struct gil_module {
 	void (*marker)(
 			struct gil_module *mod, struct gil_vm *vm,
 			void (*mark)(struct gil_vm *vm, gil_word id));
+
+	// Called with a pointer to every id the marker marks, when the heap is
+	// compacted, so that each can be rewritten to where its value was moved.
+	// Can be NULL, in which case those values are never moved.
+	void (*relocator)(
+			struct gil_module *mod, struct gil_vm *vm,
+			void (*relocate)(struct gil_vm *vm, gil_word *id));
 };
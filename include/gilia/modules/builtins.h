@@ -8,7 +8,7 @@ struct gil_mod_builtins {
 	gil_word
 		kadd, ksub, kmul, kdiv, keq, kneq,
 		klt, klteq, kgt, kgteq, kland, klor, kfirst,
-		kprint, kwrite, klen,
+		kprint, kwrite, klen, kfreeze, katom,
 		kif, kloop, kwhile, kfor, kguard, kmatch;
 	gil_word knone;
 };
@@ -2,6 +2,9 @@
 #define GIL_PARSE_LEX_H
 
 #include "../io.h"
+#include "../bytecode.h"
+
+struct gil_strset;
 
 enum gil_token_kind {
 	GIL_TOK_OPEN_PAREN_NS,
@@ -30,6 +33,10 @@ enum gil_token_kind {
 
 enum gil_token_flags {
 	GIL_TOK_SMALL = 1 << 7,
+
+	// An identifier interned in the lexer's atom set. 'atom' is its id,
+	// and 'str' points to the set's copy of it, which the token doesn't own.
+	GIL_TOK_ATOM = 1 << 6,
 };
 
 const char *gil_token_kind_name(enum gil_token_kind kind);
@@ -38,6 +45,7 @@ struct gil_token_value {
 	union {
 		struct {
 			unsigned char flags;
+			gil_word atom;
 			union {
 				char *str;
 				double num;
@@ -53,7 +61,7 @@ struct gil_token_value {
 };
 
 #define gil_token_value_free(val) \
-	if (!((val).flags & GIL_TOK_SMALL)) free((val).str)
+	if (!((val).flags & (GIL_TOK_SMALL | GIL_TOK_ATOM))) free((val).str)
 #define gil_token_value_str(val) \
 	((val).flags & GIL_TOK_SMALL \
 	? (val).strbuf \
@@ -66,9 +74,11 @@ struct gil_token {
 	struct gil_token_value v;
 };
 
-#define gil_token_get_kind(tok) ((enum gil_token_kind)((tok)->v.flags & ~(1 << 7)))
+#define gil_token_get_kind(tok) \
+	((enum gil_token_kind)((tok)->v.flags & ~(GIL_TOK_SMALL | GIL_TOK_ATOM)))
 #define gil_token_get_name(tok) (gil_token_kind_name(gil_token_get_kind(tok)))
 #define gil_token_is_small(tok) ((tok)->v.flags & GIL_TOK_SMALL)
+#define gil_token_is_atom(tok) ((tok)->v.flags & GIL_TOK_ATOM)
 void gil_token_free(struct gil_token *tok);
 struct gil_token_value gil_token_extract_val(struct gil_token *tok);
 const char *gil_token_get_str(struct gil_token_value *val);
@@ -82,10 +92,15 @@ struct gil_lexer {
 	int parens;
 	int prev_tok_is_expr;
 
+	// If set, identifiers are interned here as they're read
+	struct gil_strset *atoms;
+
 	struct gil_bufio_reader reader;
 };
 
 void gil_lexer_init(struct gil_lexer *lexer, struct gil_io_reader *r);
+void gil_lexer_init_with_atoms(
+		struct gil_lexer *lexer, struct gil_io_reader *r, struct gil_strset *atoms);
 struct gil_token *gil_lexer_peek(struct gil_lexer *lexer, int count);
 void gil_lexer_consume(struct gil_lexer *lexer);
 void gil_lexer_skip_opt(struct gil_lexer *lexer, enum gil_token_kind kind);
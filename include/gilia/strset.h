@@ -2,20 +2,108 @@
 #define GIL_STRSET_H
 
 #include <stdlib.h>
+#include <stdint.h>
+
+#include "alloc.h"
+#include "arena.h"
+
+// A slot in the hash table. The full hash is kept, so that most mismatches
+// don't have to look at the string, and growing doesn't have to hash again.
+// A match only has to look at the string itself, not at 'names'.
+struct gil_strset_slot {
+	size_t hash;
+	size_t id; // 0 for an empty slot
+	const char *str;
+	size_t len;
+};
+
+struct gil_strset_name {
+	const char *str; // NUL-terminated
+	size_t len;
+};
 
 struct gil_strset {
 	size_t next;
 	size_t len;
 	size_t size;
 	size_t mask;
-	char **keys;
-	size_t *vals;
+	struct gil_strset_slot *slots;
+
+	// The strings, indexed by id - 1
+	struct gil_strset_name *names;
+	size_t namessize;
+
+	// Where the strings are copied to
+	struct gil_arena arena;
+
+	struct gil_allocator *alloc;
 };
 
 void gil_strset_init(struct gil_strset *set);
+void gil_strset_init_with_allocator(struct gil_strset *set, struct gil_allocator *alloc);
 void gil_strset_free(struct gil_strset *set);
+
+// The put functions return the string's id, or 0 if memory for it
+// couldn't be allocated.
+// Takes ownership of '*str', which must come from the set's allocator.
 size_t gil_strset_put(struct gil_strset *set, char **str);
 size_t gil_strset_put_copy(struct gil_strset *set, const char *str);
+size_t gil_strset_put_copy_n(struct gil_strset *set, const char *str, size_t len);
+// Like gil_strset_put_copy_n, with a hash from a gil_strset_hasher
+size_t gil_strset_put_hashed(
+		struct gil_strset *set, const char *str, size_t len, size_t hash);
 size_t gil_strset_get(struct gil_strset *set, const char *str);
+size_t gil_strset_get_n(struct gil_strset *set, const char *str, size_t len);
+
+// The hash which the set uses for strings
+size_t gil_strset_hash(const char *str, size_t len);
+
+// Add the strings 'from' has beyond the end of 'set' to 'set', with the same ids.
+// That keeps two sets in step, as long as only one of them grows at a time.
+// Fails if one of the strings is already in 'set' with a different id.
+int gil_strset_extend(struct gil_strset *set, struct gil_strset *from);
+
+// The string with the given id, or NULL if there's none.
+// If 'len' isn't NULL, the string's length is stored there.
+const char *gil_strset_name(struct gil_strset *set, size_t id, size_t *len);
+
+// Computes the set's hash of a string one byte at a time,
+// for callers which see the string a byte at a time anyway
+struct gil_strset_hasher {
+	uint64_t h;
+	uint64_t tail;
+	size_t len;
+};
+
+#define GIL_STRSET_HASH_SEED UINT64_C(0x9e3779b97f4a7c15)
+#define GIL_STRSET_HASH_MUL UINT64_C(0xa0761d6478bd642f)
+
+static inline void gil_strset_hasher_init(struct gil_strset_hasher *hasher);
+static inline void gil_strset_hasher_add(struct gil_strset_hasher *hasher, unsigned char ch);
+size_t gil_strset_hasher_finish(struct gil_strset_hasher *hasher);
+
+/*
+ * Defined in the header to let the compiler inline
+ */
+
+static inline uint64_t gil_strset_hash_fold(uint64_t h, uint64_t block) {
+	h = (h ^ block) * GIL_STRSET_HASH_MUL;
+	return h ^ (h >> 32);
+}
+
+static inline void gil_strset_hasher_init(struct gil_strset_hasher *hasher) {
+	hasher->h = GIL_STRSET_HASH_SEED;
+	hasher->tail = 0;
+	hasher->len = 0;
+}
+
+static inline void gil_strset_hasher_add(struct gil_strset_hasher *hasher, unsigned char ch) {
+	hasher->tail |= (uint64_t)ch << ((hasher->len & 7) * 8);
+	hasher->len += 1;
+	if ((hasher->len & 7) == 0) {
+		hasher->h = gil_strset_hash_fold(hasher->h, hasher->tail);
+		hasher->tail = 0;
+	}
+}
 
 #endif
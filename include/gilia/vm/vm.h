@@ -4,19 +4,27 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include "../alloc.h"
+#include "../arena.h"
 #include "../bitset.h"
 #include "../bytecode.h"
+#include "../module.h"
 #include "../strset.h"
 
 struct gil_vm;
-typedef gil_word (*gil_vm_cfunction)(
-		struct gil_vm *vm, gil_word mid, gil_word self,
-		gil_word argc, gil_word *argv);
 typedef gil_word (*gil_vm_contcallback)(
 		struct gil_vm *vm, gil_word retval, gil_word cont);
 typedef void (*gil_vm_gcmarker)(
 		struct gil_vm *vm, void *data, int depth,
 		void (*mark)(struct gil_vm *vm, gil_word id, int depth));
+// Called with a pointer to every id a marker marks, when the heap
+// is compacted, so that each can be rewritten to where its value was moved.
+typedef void (*gil_vm_gcrelocator)(
+		struct gil_vm *vm, void *data,
+		void (*relocate)(struct gil_vm *vm, gil_word *id));
+// Called with the C value of a collected value of a C type,
+// to release whatever it holds. Never called with a NULL C value.
+typedef void (*gil_vm_ctype_finalizer)(struct gil_vm *vm, void *cval);
 
 enum gil_value_type {
 	GIL_VAL_TYPE_NONE,
@@ -36,17 +44,25 @@ enum gil_value_type {
 const char *gil_value_type_name(enum gil_value_type typ);
 
 enum gil_value_flags {
-	GIL_VAL_MARKED = 1 << 7,
+	GIL_VAL_HASHED = 1 << 7, // A buffer's payload has its hash
 	GIL_VAL_CONST = 1 << 6,
 	GIL_VAL_SBO = 1 << 5,
 };
 
+// Continuation contexts are payloads, so they must be allocated
+// with gil_vm_malloc.
+// If a context has a marker but no relocator, the values it marks
+// are never moved.
 struct gil_vm_contcontext {
 	gil_vm_contcallback callback;
 	gil_vm_gcmarker marker;
 	gil_word args;
+	gil_vm_gcrelocator relocator;
 };
 
+// Buffers up to this long are stored in the value itself, with GIL_VAL_SBO
+#define GIL_VM_SHORT_BUFFER_MAX 13
+
 // The smallest size an gil_vm_value can be is 16 bytes on common platforms.
 // Pointers are 8 bytes, and since we need to store _at least_ 1 pointer +
 // 1 byte for flags, it's going to be padded up to 16 bytes anyways.
@@ -68,9 +84,16 @@ struct gil_vm_value {
 		struct {
 			uint8_t padding;
 			gil_word length;
-			char *buffer;
+			struct gil_vm_buffer *buffer;
 		} buffer;
 
+		// A buffer with GIL_VAL_SBO, followed by a NUL byte
+		struct {
+			uint8_t padding;
+			uint8_t length;
+			char data[GIL_VM_SHORT_BUFFER_MAX + 1];
+		} shortbuffer;
+
 		struct {
 			uint8_t padding;
 			gil_word length;
@@ -84,7 +107,15 @@ struct gil_vm_value {
 		struct {
 			uint8_t padding;
 			gil_word parent;
-			struct gil_vm_namespace *ns;
+
+			// With GIL_VAL_SBO, the namespace's only entry is stored inline
+			union {
+				struct gil_vm_namespace *ns;
+				struct {
+					gil_word shortkey;
+					gil_word shortval;
+				};
+			};
 		} ns;
 
 		struct {
@@ -143,19 +174,126 @@ gil_word *gil_vm_array_data(struct gil_vm *vm, struct gil_vm_value *val);
 gil_word gil_vm_array_get(struct gil_vm *vm, struct gil_vm_value *val, gil_word k);
 gil_word gil_vm_array_set(struct gil_vm *vm, struct gil_vm_value *val, gil_word k, gil_word v);
 
+// The data is followed by a NUL byte, which isn't part of the buffer.
+// Buffers don't change once they've been made, so their hash is computed
+// the first time it's needed, and kept.
+struct gil_vm_buffer {
+	size_t hash; // Only set with GIL_VAL_HASHED
+	char data[];
+};
+
+// Buffers at least this long are compared by their hashes first
+#ifndef GIL_VM_BUFFER_HASH_MIN
+#define GIL_VM_BUFFER_HASH_MIN 64
+#endif
+
+// Work for short buffers and buffers with a payload alike.
+// The data is never NULL, and is always followed by a NUL byte.
+static inline gil_word gil_vm_buffer_length(struct gil_vm_value *val);
+static inline const char *gil_vm_buffer_data(struct gil_vm_value *val);
+
+// Short buffers have no room to keep their hash, so it's computed every time
+size_t gil_vm_buffer_hash(struct gil_vm_value *val);
+int gil_vm_buffer_equals(struct gil_vm_value *a, struct gil_vm_value *b);
+
+// Namespaces which get the same keys added in the same order share a shape,
+// which holds their keys. Shapes form a tree, where each child
+// has one more key than its parent. They live as long as the VM.
+struct gil_vm_shape {
+	struct gil_vm_shape *children;
+	struct gil_vm_shape *next; // The next child of this shape's parent
+	gil_word nchildren;
+	gil_word len;
+	gil_word keys[];
+};
+
+// A namespace is either shaped, with the value for shape->keys[i] in data[i],
+// or a hash table: room for size / 2 key/value pairs, kept in insertion order,
+// followed by 'size' 8, 16 or 32-bit indexes into them. The first
+// 'len + tombs' pairs are in use, with a key of 0 for a deleted entry.
+// A namespace with a single entry keeps it inline in its value (GIL_VAL_SBO).
+// Bigger ones start out shaped, and become hash tables when they get too big,
+// when keys are deleted, or when their shape can't be extended.
 struct gil_vm_namespace {
-	size_t len;
-	size_t size;
+	struct gil_vm_shape *shape; // NULL for hash tables
+	gil_word len; // Live entries
+	gil_word tombs; // Holes left behind in a hash table's entries by deleted entries
+	gil_word size; // Index slots in a hash table, or room for values in a shaped namespace
 	gil_word mask;
+	gil_word shift; // 32 - log2(size)
 	gil_word data[];
 };
 
+// Caches where a key was last found by a lookup instruction,
+// for namespaces of one shape
+struct gil_vm_namespace_cache {
+	struct gil_vm_shape *shape;
+	gil_word key;
+	gil_word index;
+};
+
+// Caches what a lookup instruction found in a frozen namespace (GIL_VAL_CONST).
+// Frozen namespaces never change, but value IDs do when the GC runs,
+// so the cache is cleared by every collection.
+struct gil_vm_frozen_cache {
+	gil_word ns;
+	gil_word key;
+	gil_word val;
+};
+
+#define GIL_VM_NAMESPACE_CACHE_SIZE 256
+
 gil_word gil_vm_namespace_get(struct gil_vm *vm, struct gil_vm_value *ns, gil_word key);
 gil_word gil_vm_namespace_get_or(
 		struct gil_vm *vm, struct gil_vm_value *ns, gil_word key, gil_word alt);
-void gil_vm_namespace_set(struct gil_vm_value *ns, gil_word key, gil_word val);
+
+// Like gil_vm_namespace_get, but remembers where the key was found for
+// the instruction at 'site', so that the next lookup there is a single load
+// if the namespace has the same shape.
+gil_word gil_vm_namespace_get_cached(
+		struct gil_vm *vm, struct gil_vm_value *ns, gil_word key, gil_word site);
+// Returns -1, and leaves the namespace as it was, if memory couldn't be allocated.
+int gil_vm_namespace_set(
+		struct gil_vm *vm, struct gil_vm_value *ns, gil_word key, gil_word val);
+
+// Set a key in the namespace or parent namespace which already has it.
+// Returns -1 if none of them have it, -2 if the one which has it is frozen,
+// or -3 if memory couldn't be allocated.
 int gil_vm_namespace_replace(struct gil_vm *vm, struct gil_vm_value *ns, gil_word key, gil_word val);
 
+// Look up a key in the namespace itself, not its parents
+gil_word gil_vm_namespace_get_own(struct gil_vm_value *ns, gil_word key);
+
+// Turn a shaped namespace into a hash table. Returns -1 if memory
+// couldn't be allocated.
+int gil_vm_namespace_unshape(struct gil_vm *vm, struct gil_vm_value *ns);
+
+// The size of a namespace's payload
+size_t gil_vm_namespace_bytes(struct gil_vm_namespace *ns);
+
+// Check that a hash table payload of 'bytes' bytes which came from outside
+// (e.g. a snapshot image) is well-formed, and that every value in it
+// is below 'valueslen'. Returns -1 if it isn't.
+int gil_vm_namespace_check(struct gil_vm_namespace *ns, size_t bytes, size_t valueslen);
+
+// Walk the entries in insertion order. 'it' starts out as 0.
+// Returns 0 when there are no more entries.
+int gil_vm_namespace_next(
+		struct gil_vm_value *ns, gil_word *it, gil_word *key, gil_word *val);
+
+struct gil_vm_namespace_stats {
+	size_t len;
+	size_t tombs;
+	size_t size; // 0 for a namespace with its only entry stored inline
+	int shaped;
+	size_t max_probes; // The most slots looked at to find an entry
+	size_t total_probes; // Slots looked at to find every entry once
+};
+
+// Walks the whole table, so it's meant for diagnostics and benchmarks,
+// not for hot paths.
+void gil_vm_namespace_get_stats(struct gil_vm_value *ns, struct gil_vm_namespace_stats *stats);
+
 struct gil_vm_stack_frame {
 	gil_word ns;
 	gil_word sptr;
@@ -176,8 +314,61 @@ struct gil_vm_module {
 	gil_word ns;
 };
 
+struct gil_vm_gc_policy {
+	// How much the value heap grows by when it's full,
+	// or when a GC leaves it mostly full. Must be greater than 1.
+	double growth_factor;
+
+	// The value heap starts out with this many slots.
+	size_t min_values;
+
+	// The value heap never grows beyond this many slots (0 means no limit).
+	size_t max_values;
+
+	// Run a GC once this many bytes of out-of-line memory (buffers, array
+	// bodies, namespace tables, etc.) have been allocated since the last GC.
+	// 0 disables this trigger.
+	size_t trigger_bytes;
+
+	// After a GC triggered by allocation, compact the heap and give memory
+	// back if less than this fraction of it is live. 0 disables compaction.
+	double compact_ratio;
+
+	// Ask the OS to back the value heap with huge pages, where supported.
+	int huge_pages;
+
+	// Where mmap is available, address space for this many value slots
+	// is reserved up front, so that the heap doesn't move until it outgrows it.
+	// If max_values is set, that many slots are reserved instead.
+	// If the address space can't be reserved (e.g. because of RLIMIT_AS),
+	// or this is 0, the heap is allocated with the VM's allocator,
+	// and 'valuesreserved' in struct gil_vm is 0.
+	size_t reserve_values;
+};
+
+struct gil_vm_memory_usage {
+	size_t value_bytes; // Bytes in the value heap
+	size_t payload_bytes; // Bytes in live value payloads
+	size_t limit; // The memory limit, or 0 if there is none
+};
+
+struct gil_vm_ctype {
+	gil_vm_ctype_finalizer finalize; // Can be NULL
+};
+
+struct gil_vm_finalization {
+	gil_vm_ctype_finalizer finalize;
+	void *cval;
+};
+
 struct gil_vm {
+	// Every allocation the VM makes goes through this, except for the
+	// value heap when it's mapped straight from the OS. Huge payloads
+	// are also mapped straight from the OS, but only with the default allocator.
+	struct gil_allocator *alloc;
+
 	int halted;
+	gil_word error; // The uncaught error which halted the VM, or 0
 	int need_gc;
 	int need_check_retval;
 	unsigned char *ops;
@@ -187,18 +378,77 @@ struct gil_vm {
 	struct gil_io_writer *std_output;
 	struct gil_io_writer *std_error;
 
+	// Where mmap is available, the value heap is a reservation of address
+	// space for 'valuesreserved' values, which is made usable a chunk at a time
+	// ('valuescommitted' values so far), and chunks which end up empty
+	// are given back to the OS. Growing the heap only moves it if it outgrows
+	// the reservation. Otherwise, 'valuesreserved' is 0 and the heap is realloc'd.
 	struct gil_vm_value *values;
 	size_t valuessize;
+	size_t valuesreserved;
+	size_t valuescommitted;
 	struct gil_bitset valueset;
+	gil_word alloc_next, alloc_end; // Free ids claimed from 'valueset'
 
 	gil_word kundeclared, knone;
 	gil_word ktrue, kfalse, kstop;
 
 	gil_word gc_start;
+	gil_word *gc_stack;
+	size_t gc_stacklen;
+	size_t gc_stacksize;
+	int gc_failed;
+
+	// Mark bits, one per value id, laid out like the tables of 'valueset'
+	gil_bitset_entry *gc_marks;
+	size_t gc_markslen;
+
+	// Number of threads to use for marking and sweeping.
+	// With 1 (the default), or on platforms without thread support,
+	// the GC is single threaded.
+	int gc_threads;
+
+	// After a GC triggered by allocation, sweeping happens lazily.
+	// Bitset tables before gc_sweep_table have been swept.
+	int gc_sweeping;
+	size_t gc_sweep_table;
+
+	struct gil_vm_gc_policy gc_policy;
+
+	// Once the value heap and payloads take up more than this many bytes,
+	// the VM collects garbage, and halts with an error if that doesn't help.
+	// 0 means no limit. See gil_vm_set_memory_limit.
+	size_t mem_limit;
+	size_t gc_bytes; // Out-of-line bytes allocated since the last GC
+	size_t gc_marked; // Values marked by the last GC
+	size_t gc_compact_top; // Ids at or above this have moved during compaction
+
+	// Value payloads (array bodies, namespace tables, buffers,
+	// error messages and continuation contexts) live in this arena.
+	struct gil_arena arena;
 
 	struct gil_strset atomset;
 
-	gil_word next_ctype;
+	// Whether 'atomset' has every atom the bytecode uses (see gil_vm_add_atoms).
+	// Until it does, gil_vm_intern_atom can't make new atoms.
+	int atoms_complete;
+
+	// The shape of a namespace without keys, the root of the shape tree
+	struct gil_vm_shape *shape_root;
+	struct gil_vm_namespace_cache nscache[GIL_VM_NAMESPACE_CACHE_SIZE];
+	struct gil_vm_frozen_cache frozencache[GIL_VM_NAMESPACE_CACHE_SIZE];
+
+	// Registered C types, indexed by ctype. Ctype 0 isn't used.
+	struct gil_vm_ctype *ctypes;
+	size_t ctypeslen;
+
+	// Finalizers aren't run by the GC itself, but queued up
+	// and run between instructions
+	struct gil_vm_finalization *finalizequeue;
+	size_t finalizequeuelen;
+	size_t finalizequeuesize;
+
+	struct gil_module *builtins;
 	struct gil_vm_cmodule *cmodules;
 	size_t cmoduleslen;
 
@@ -213,21 +463,115 @@ struct gil_vm {
 
 void gil_vm_init(
 		struct gil_vm *vm, unsigned char *ops, size_t opslen, struct gil_module *builtins);
+// The allocator has to outlive the VM.
+void gil_vm_init_with_allocator(
+		struct gil_vm *vm, unsigned char *ops, size_t opslen, struct gil_module *builtins,
+		struct gil_allocator *alloc);
 void gil_vm_register_module(struct gil_vm *vm, struct gil_module *mod);
+void gil_vm_gc_policy_init(struct gil_vm_gc_policy *policy);
+void gil_vm_set_gc_policy(struct gil_vm *vm, const struct gil_vm_gc_policy *policy);
+void gil_vm_account_bytes(struct gil_vm *vm, size_t bytes);
+void *gil_vm_malloc(struct gil_vm *vm, size_t size);
+void *gil_vm_realloc(struct gil_vm *vm, void *ptr, size_t size);
+void gil_vm_dealloc(struct gil_vm *vm, void *ptr);
+void gil_vm_get_arena_stats(struct gil_vm *vm, struct gil_arena_stats *stats);
+
+// Going over the memory limit is fatal to the program: Gilia code can't
+// catch it. The VM halts with 'error' set to a "Memory limit exceeded" error.
+// It only halts between instructions though, so the embedder may raise
+// the limit, clear 'halted' and 'error', and call gil_vm_run again to resume.
+void gil_vm_set_memory_limit(struct gil_vm *vm, size_t bytes);
+void gil_vm_get_memory_usage(struct gil_vm *vm, struct gil_vm_memory_usage *usage);
 gil_word gil_vm_alloc(struct gil_vm *vm, enum gil_value_type typ, enum gil_value_flags flags);
-gil_word gil_vm_alloc_ctype(struct gil_vm *vm);
+gil_word gil_vm_register_ctype(struct gil_vm *vm, gil_vm_ctype_finalizer finalize);
 gil_word gil_vm_error(struct gil_vm *vm, const char *fmt, ...);
 gil_word gil_vm_type_error(struct gil_vm *vm, struct gil_vm_value *val);
 void gil_vm_free(struct gil_vm *vm);
 void gil_vm_step(struct gil_vm *vm);
 void gil_vm_run(struct gil_vm *vm);
 size_t gil_vm_gc(struct gil_vm *vm);
+size_t gil_vm_gc_sweep_step(struct gil_vm *vm, size_t ntables);
+
+// Run a full GC, then move every live value into a dense prefix of the heap
+// and shrink it. Values marked by a marker without a relocator stay where
+// they are. Any other ids held outside of the VM's roots and relocators
+// are invalid afterwards. Returns the number of values moved.
+size_t gil_vm_compact(struct gil_vm *vm);
+
+// Save an image of a halted VM, which gil_vm_snapshot_load can turn back
+// into a VM in the same state without running any code.
+// 'atoms' should be the generator's atom set, so that more code can be
+// generated for the loaded VM; it can be NULL. The heap is compacted first.
+// Fails if the VM holds C values or continuations, or C functions which
+// aren't in their module's function list.
+int gil_vm_snapshot_save(
+		struct gil_vm *vm, struct gil_strset *atoms, struct gil_io_writer *w);
+
+// Initialize a VM from an image. 'builtins' and 'mods' have to be the same
+// modules, registered in the same order, as the saved VM's.
+// The bytecode and the payloads are used in place, without copying them,
+// so the image has to be writable (a private mapping of a file will do),
+// aligned to 8 bytes, and outlive the VM. The VM changes it, so it can
+// only be loaded once. Payloads in the image don't count towards
+// the memory limit until they're reallocated.
+// If 'atoms' isn't NULL, the saved generator atoms are put into it,
+// which must give them the same ids.
+// Every id and bytecode position in the values, stacks and module tables
+// is checked, but the bytecode itself isn't.
+// On failure, an error is printed and 'vm' is left uninitialized.
+int gil_vm_snapshot_load(
+		struct gil_vm *vm, void *image, size_t len, struct gil_module *builtins,
+		struct gil_module **mods, size_t modslen, struct gil_strset *atoms);
+// The allocator has to outlive the VM.
+int gil_vm_snapshot_load_with_allocator(
+		struct gil_vm *vm, void *image, size_t len, struct gil_module *builtins,
+		struct gil_module **mods, size_t modslen, struct gil_strset *atoms,
+		struct gil_allocator *alloc);
+
 int gil_vm_val_is_true(struct gil_vm *vm, struct gil_vm_value *val);
 
 gil_word gil_vm_make_atom(struct gil_vm *vm, gil_word val);
+
+// Add the atoms the bytecode uses, usually the generator's atom set, to the VM's
+// atoms with the same ids. That has to be done again whenever more bytecode
+// with new atoms is added. Returns -1 if the names don't match the VM's atoms.
+int gil_vm_add_atoms(struct gil_vm *vm, struct gil_strset *atoms);
+
+// Get the id of the atom with the given name, creating it if it's new.
+// Until gil_vm_add_atoms has been called, the VM doesn't know which ids
+// the bytecode uses, so only atoms the VM already knows are found,
+// and 0 is returned for new names. 0 is also returned if memory runs out.
+gil_word gil_vm_intern_atom(struct gil_vm *vm, const char *name, size_t len);
 gil_word gil_vm_make_real(struct gil_vm *vm, double val);
-gil_word gil_vm_make_buffer(struct gil_vm *vm, char *data, size_t len);
+// Allocate a buffer payload with room for 'len' bytes and a NUL byte.
+// It can be grown with gil_vm_realloc, to sizeof(struct gil_vm_buffer) + len + 1 bytes.
+struct gil_vm_buffer *gil_vm_malloc_buffer(struct gil_vm *vm, size_t len);
+// 'buf' must have been allocated with gil_vm_malloc_buffer.
+// If the buffer is short, it's stored inline, and 'buf' is freed.
+gil_word gil_vm_make_buffer(struct gil_vm *vm, struct gil_vm_buffer *buf, size_t len);
 gil_word gil_vm_make_cfunction(struct gil_vm *vm, gil_vm_cfunction val, gil_word mod);
 gil_word gil_vm_make_cval(struct gil_vm *vm, gil_word ctype, gil_word ns, void *val);
 
+/*
+ * Defined in the header to let the compiler inline
+ */
+
+static inline gil_word gil_vm_buffer_length(struct gil_vm_value *val) {
+	if (val->flags & GIL_VAL_SBO) {
+		return val->shortbuffer.length;
+	}
+
+	return val->buffer.length;
+}
+
+static inline const char *gil_vm_buffer_data(struct gil_vm_value *val) {
+	if (val->flags & GIL_VAL_SBO) {
+		return val->shortbuffer.data;
+	} else if (val->buffer.buffer == NULL) {
+		return "";
+	}
+
+	return val->buffer.buffer->data;
+}
+
 #endif
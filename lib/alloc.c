@@ -0,0 +1,50 @@
+#include "alloc.h"
+
+#include <stdint.h>
+#include <string.h>
+
+static void *default_alloc(void *data, size_t size) {
+	return malloc(size);
+}
+
+static void *default_realloc(void *data, void *ptr, size_t size) {
+	return realloc(ptr, size);
+}
+
+static void default_free(void *data, void *ptr) {
+	free(ptr);
+}
+
+struct gil_allocator gil_default_allocator = {
+	.alloc = default_alloc,
+	.realloc = default_realloc,
+	.free = default_free,
+	.data = NULL,
+};
+
+void *gil_allocator_alloc(struct gil_allocator *alloc, size_t size) {
+	return alloc->alloc(alloc->data, size);
+}
+
+void *gil_allocator_calloc(struct gil_allocator *alloc, size_t count, size_t size) {
+	if (size != 0 && count > SIZE_MAX / size) {
+		return NULL;
+	}
+
+	void *ptr = alloc->alloc(alloc->data, count * size);
+	if (ptr != NULL) {
+		memset(ptr, 0, count * size);
+	}
+
+	return ptr;
+}
+
+void *gil_allocator_realloc(struct gil_allocator *alloc, void *ptr, size_t size) {
+	return alloc->realloc(alloc->data, ptr, size);
+}
+
+void gil_allocator_free(struct gil_allocator *alloc, void *ptr) {
+	if (ptr != NULL) {
+		alloc->free(alloc->data, ptr);
+	}
+}
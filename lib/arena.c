@@ -0,0 +1,410 @@
+// For mremap
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include "arena.h"
+
+#include <string.h>
+
+#if \
+		defined(__unix__) || defined(__unix) || \
+		(defined(__APPLE__) && defined(__MACH__))
+#define USE_MMAP_LARGE
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
+
+#define SLAB_SIZE (64 * 1024)
+
+// Keeps the blocks in a slab 8-byte aligned, even on 32-bit platforms
+#define SLAB_HEADER_SIZE 16
+
+#define LARGE_CLASS UINT32_MAX
+#define MAPPED_CLASS (UINT32_MAX - 1)
+#define ADOPTED_CLASS (UINT32_MAX - 2)
+
+// Every allocation is preceded by one of these (GIL_ARENA_HEADER_SIZE bytes)
+struct block_header {
+	uint32_t cls;
+	uint32_t size;
+};
+
+_Static_assert(
+		sizeof(struct block_header) == GIL_ARENA_HEADER_SIZE,
+		"The header size is part of the API");
+
+struct gil_arena_slab {
+	struct gil_arena_slab *next;
+};
+
+// Allocations which are too big for a slab are kept in a doubly linked list,
+// so that they can be removed when freed, and released by gil_arena_free.
+// Mapped allocations have a list of their own.
+// The block header has to be last, right in front of the allocation.
+struct gil_arena_large {
+	struct gil_arena_large *prev;
+	struct gil_arena_large *next;
+	size_t size;
+	size_t mapsize; // The length of the mapping, for mapped allocations
+	struct block_header header;
+};
+
+static unsigned int size_class(size_t size) {
+	if (size <= 256) {
+		return (unsigned int)((size + 15) / 16) - 1;
+	}
+
+	unsigned int cls = 16;
+	size_t clssize = 512;
+	while (clssize < size) {
+		clssize *= 2;
+		cls += 1;
+	}
+
+	return cls;
+}
+
+static size_t class_size(unsigned int cls) {
+	if (cls < 16) {
+		return (cls + 1) * 16;
+	}
+
+	return (size_t)512 << (cls - 16);
+}
+
+void gil_arena_init(struct gil_arena *arena) {
+	gil_arena_init_with_allocator(arena, &gil_default_allocator);
+}
+
+void gil_arena_init_with_allocator(struct gil_arena *arena, struct gil_allocator *alloc) {
+	arena->alloc = alloc;
+	arena->slabs = NULL;
+	arena->large = NULL;
+	arena->mapped = NULL;
+	arena->bump = NULL;
+	arena->bumpend = NULL;
+	memset(arena->freelists, 0, sizeof(arena->freelists));
+	memset(&arena->stats, 0, sizeof(arena->stats));
+}
+
+void gil_arena_free(struct gil_arena *arena) {
+	struct gil_arena_slab *slab = arena->slabs;
+	while (slab != NULL) {
+		struct gil_arena_slab *next = slab->next;
+		gil_allocator_free(arena->alloc, slab);
+		slab = next;
+	}
+
+	struct gil_arena_large *large = arena->large;
+	while (large != NULL) {
+		struct gil_arena_large *next = large->next;
+		gil_allocator_free(arena->alloc, large);
+		large = next;
+	}
+
+#ifdef USE_MMAP_LARGE
+	large = arena->mapped;
+	while (large != NULL) {
+		struct gil_arena_large *next = large->next;
+		munmap(large, large->mapsize);
+		large = next;
+	}
+#endif
+
+	gil_arena_init_with_allocator(arena, arena->alloc);
+}
+
+static void link_large(struct gil_arena_large **list, struct gil_arena_large *large) {
+	large->prev = NULL;
+	large->next = *list;
+	if (*list != NULL) {
+		(*list)->prev = large;
+	}
+	*list = large;
+}
+
+// Fix up the links to a list entry which has moved.
+static void relink_large(struct gil_arena_large **list, struct gil_arena_large *large) {
+	if (large->prev != NULL) {
+		large->prev->next = large;
+	} else {
+		*list = large;
+	}
+
+	if (large->next != NULL) {
+		large->next->prev = large;
+	}
+}
+
+static void unlink_large(struct gil_arena_large **list, struct gil_arena_large *large) {
+	if (large->prev != NULL) {
+		large->prev->next = large->next;
+	} else {
+		*list = large->next;
+	}
+
+	if (large->next != NULL) {
+		large->next->prev = large->prev;
+	}
+}
+
+static void *alloc_large(struct gil_arena *arena, size_t size) {
+	struct gil_arena_large *large = gil_allocator_alloc(arena->alloc, sizeof(*large) + size);
+	if (large == NULL) {
+		return NULL;
+	}
+
+	link_large(&arena->large, large);
+	large->size = size;
+	large->mapsize = 0;
+	large->header.cls = LARGE_CLASS;
+	large->header.size = 0;
+	arena->stats.large_bytes += size;
+	return large + 1;
+}
+
+static void free_large(struct gil_arena *arena, struct gil_arena_large *large) {
+	unlink_large(&arena->large, large);
+	arena->stats.large_bytes -= large->size;
+	gil_allocator_free(arena->alloc, large);
+}
+
+#ifdef USE_MMAP_LARGE
+
+// Huge allocations are mapped straight from the OS, so that their memory
+// goes back to the OS as soon as they're freed, instead of staying
+// in the allocator. That's only done with the default allocator;
+// a custom allocator gets to see every allocation.
+static int should_map(struct gil_arena *arena, size_t size) {
+	return arena->alloc == &gil_default_allocator && size >= GIL_ARENA_MAP_THRESHOLD;
+}
+
+static size_t mapping_size(size_t size) {
+	size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
+	size_t mapsize = sizeof(struct gil_arena_large) + size;
+	return (mapsize + pagesize - 1) / pagesize * pagesize;
+}
+
+static void *alloc_mapped(struct gil_arena *arena, size_t size) {
+	size_t mapsize = mapping_size(size);
+	struct gil_arena_large *large = mmap(
+			NULL, mapsize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (large == MAP_FAILED) {
+		return NULL;
+	}
+
+	link_large(&arena->mapped, large);
+	large->size = size;
+	large->mapsize = mapsize;
+	large->header.cls = MAPPED_CLASS;
+	large->header.size = 0;
+	arena->stats.mapped_bytes += mapsize;
+	return large + 1;
+}
+
+static void free_mapped(struct gil_arena *arena, struct gil_arena_large *large) {
+	unlink_large(&arena->mapped, large);
+	arena->stats.mapped_bytes -= large->mapsize;
+	munmap(large, large->mapsize);
+}
+
+// Grow or shrink a mapping without copying, where the OS supports it.
+static void *realloc_mapped(
+		struct gil_arena *arena, struct gil_arena_large *large, size_t size) {
+#ifdef MREMAP_MAYMOVE
+	size_t mapsize = mapping_size(size);
+	struct gil_arena_large *newlarge = mremap(
+			large, large->mapsize, mapsize, MREMAP_MAYMOVE);
+	if (newlarge == MAP_FAILED) {
+		return NULL;
+	}
+
+	relink_large(&arena->mapped, newlarge);
+	arena->stats.mapped_bytes += mapsize;
+	arena->stats.mapped_bytes -= newlarge->mapsize;
+	newlarge->mapsize = mapsize;
+	newlarge->size = size;
+	return newlarge + 1;
+#else
+	return NULL;
+#endif
+}
+
+#endif
+
+void *gil_arena_alloc(struct gil_arena *arena, size_t size) {
+	size_t total = size + sizeof(struct block_header);
+	if (total > GIL_ARENA_MAX_SMALL) {
+#ifdef USE_MMAP_LARGE
+		if (should_map(arena, size)) {
+			void *ptr = alloc_mapped(arena, size);
+			if (ptr != NULL) {
+				return ptr;
+			}
+		}
+#endif
+
+		return alloc_large(arena, size);
+	}
+
+	unsigned int cls = size_class(total);
+	size_t clssize = class_size(cls);
+
+	struct block_header *block = arena->freelists[cls];
+	if (block != NULL) {
+		arena->freelists[cls] = *(void **)(block + 1);
+		arena->stats.free_bytes -= clssize;
+	} else {
+		if ((size_t)(arena->bumpend - arena->bump) < clssize) {
+			struct gil_arena_slab *slab = gil_allocator_alloc(arena->alloc, SLAB_SIZE);
+			if (slab == NULL) {
+				return NULL;
+			}
+
+			slab->next = arena->slabs;
+			arena->slabs = slab;
+			arena->bump = (char *)slab + SLAB_HEADER_SIZE;
+			arena->bumpend = (char *)slab + SLAB_SIZE;
+			arena->stats.slab_bytes += SLAB_SIZE;
+		}
+
+		block = (struct block_header *)arena->bump;
+		arena->bump += clssize;
+	}
+
+	block->cls = cls;
+	block->size = (uint32_t)size;
+	arena->stats.used_bytes += clssize;
+	arena->stats.requested_bytes += size;
+	return block + 1;
+}
+
+void *gil_arena_realloc(struct gil_arena *arena, void *ptr, size_t size) {
+	if (ptr == NULL) {
+		return gil_arena_alloc(arena, size);
+	}
+
+	struct block_header *block = (struct block_header *)ptr - 1;
+	size_t total = size + sizeof(struct block_header);
+	size_t oldsize;
+	if (block->cls == LARGE_CLASS) {
+		struct gil_arena_large *large = (struct gil_arena_large *)ptr - 1;
+#ifdef USE_MMAP_LARGE
+		int remap = should_map(arena, size);
+#else
+		int remap = 0;
+#endif
+		if (total > GIL_ARENA_MAX_SMALL && !remap) {
+			struct gil_arena_large *newlarge = gil_allocator_realloc(
+					arena->alloc, large, sizeof(*large) + size);
+			if (newlarge == NULL) {
+				return NULL;
+			}
+
+			relink_large(&arena->large, newlarge);
+			arena->stats.large_bytes += size;
+			arena->stats.large_bytes -= newlarge->size;
+			newlarge->size = size;
+			return newlarge + 1;
+		}
+
+		oldsize = large->size;
+#ifdef USE_MMAP_LARGE
+	} else if (block->cls == MAPPED_CLASS) {
+		// Still fits in the same mapping
+		struct gil_arena_large *large = (struct gil_arena_large *)ptr - 1;
+		if (should_map(arena, size) && sizeof(*large) + size <= large->mapsize) {
+			large->size = size;
+			return ptr;
+		}
+
+		if (should_map(arena, size)) {
+			void *newptr = realloc_mapped(arena, large, size);
+			if (newptr != NULL) {
+				return newptr;
+			}
+		}
+
+		oldsize = large->size;
+#endif
+	} else {
+		// Still fits in the same size class
+		if (total <= GIL_ARENA_MAX_SMALL && size_class(total) == block->cls) {
+			arena->stats.requested_bytes += size;
+			arena->stats.requested_bytes -= block->size;
+			block->size = (uint32_t)size;
+			return ptr;
+		}
+
+		oldsize = block->size;
+	}
+
+	void *newptr = gil_arena_alloc(arena, size);
+	if (newptr == NULL) {
+		return NULL;
+	}
+
+	memcpy(newptr, ptr, oldsize < size ? oldsize : size);
+	gil_arena_dealloc(arena, ptr);
+	return newptr;
+}
+
+void gil_arena_dealloc(struct gil_arena *arena, void *ptr) {
+	if (ptr == NULL) {
+		return;
+	}
+
+	struct block_header *block = (struct block_header *)ptr - 1;
+	if (block->cls == LARGE_CLASS) {
+		free_large(arena, (struct gil_arena_large *)ptr - 1);
+		return;
+	}
+
+	// Its memory belongs to someone else
+	if (block->cls == ADOPTED_CLASS) {
+		return;
+	}
+
+#ifdef USE_MMAP_LARGE
+	if (block->cls == MAPPED_CLASS) {
+		free_mapped(arena, (struct gil_arena_large *)ptr - 1);
+		return;
+	}
+#endif
+
+	size_t clssize = class_size(block->cls);
+	arena->stats.used_bytes -= clssize;
+	arena->stats.requested_bytes -= block->size;
+	arena->stats.free_bytes += clssize;
+
+	*(void **)ptr = arena->freelists[block->cls];
+	arena->freelists[block->cls] = block;
+}
+
+size_t gil_arena_size(struct gil_arena *arena, void *ptr) {
+	struct block_header *block = (struct block_header *)ptr - 1;
+	if (block->cls == LARGE_CLASS || block->cls == MAPPED_CLASS) {
+		return ((struct gil_arena_large *)ptr - 1)->size;
+	}
+
+	return block->size;
+}
+
+void *gil_arena_adopt(void *mem, size_t size) {
+	struct block_header *block = mem;
+	block->cls = ADOPTED_CLASS;
+	block->size = (uint32_t)size;
+	return block + 1;
+}
+
+size_t gil_arena_wasted_bytes(struct gil_arena *arena) {
+	return
+		arena->stats.free_bytes +
+		(size_t)(arena->bumpend - arena->bump) +
+		(arena->stats.used_bytes - arena->stats.requested_bytes);
+}
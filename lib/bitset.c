@@ -35,26 +35,46 @@ static int first_set(gil_bitset_entry n) {
 }
 #endif
 
+#if defined(__GNUC__) || defined(__clang__)
+#define count_set __builtin_popcountll
+#else
+static int count_set(gil_bitset_entry n) {
+	int num = 0;
+	while (n != 0) {
+		n &= n - 1;
+		num += 1;
+	}
+
+	return num;
+}
+#endif
+
 static void expand_tables(struct gil_bitset *bs) {
 	while (bs->currtable >= bs->tableslen) {
-		bs->tables = realloc(bs->tables, bs->tableslen * 2 * sizeof(*bs->tables));
+		bs->tables = gil_allocator_realloc(
+				bs->alloc, bs->tables, bs->tableslen * 2 * sizeof(*bs->tables));
 		memset(bs->tables + bs->tableslen, 0, sizeof(*bs->tables) * bs->tableslen);
 		bs->tableslen *= 2;
 	}
 }
 
 void gil_bitset_init(struct gil_bitset *bs) {
+	gil_bitset_init_with_allocator(bs, &gil_default_allocator);
+}
+
+void gil_bitset_init_with_allocator(struct gil_bitset *bs, struct gil_allocator *alloc) {
+	bs->alloc = alloc;
 	bs->tableslen = 4;
-	bs->tables = calloc(bs->tableslen, sizeof(*bs->tables));
+	bs->tables = gil_allocator_calloc(alloc, bs->tableslen, sizeof(*bs->tables));
 	bs->currtable = 0;
 	bs->dirslen = 1;
-	bs->dirs = calloc(bs->dirslen, sizeof(*bs->dirs));
+	bs->dirs = gil_allocator_calloc(alloc, bs->dirslen, sizeof(*bs->dirs));
 	bs->currdir = 0;
 }
 
 void gil_bitset_free(struct gil_bitset *bs) {
-	free(bs->tables);
-	free(bs->dirs);
+	gil_allocator_free(bs->alloc, bs->tables);
+	gil_allocator_free(bs->alloc, bs->dirs);
 }
 
 int gil_bitset_get(struct gil_bitset *bs, size_t id) {
@@ -67,18 +87,8 @@ int gil_bitset_get(struct gil_bitset *bs, size_t id) {
 	return !!(bs->tables[tblidx] & (gil_bitset_entry)1 << tblbit);
 }
 
-size_t gil_bitset_set_next(struct gil_bitset *bs) {
-	gil_bitset_entry *table = &bs->tables[bs->currtable];
-	gil_bitset_entry bit = first_unset_bit(*table);
-	*table |= bit;
-	size_t ret = bs->currtable * ENTSIZ + first_set(bit) - 1;
-
-	// Still free space?
-	if (*table != ~(gil_bitset_entry)0) {
-		return ret;
-	}
-
-	// Ok, this table is full then...
+// Move on from the current table, which has just been filled up.
+static void next_table(struct gil_bitset *bs) {
 	gil_bitset_entry *dir = &bs->dirs[bs->currdir];
 	*dir |= (gil_bitset_entry)1 << (bs->currtable % ENTSIZ);
 
@@ -86,7 +96,7 @@ size_t gil_bitset_set_next(struct gil_bitset *bs) {
 	if (*dir != ~(gil_bitset_entry)0) {
 		bs->currtable = bs->currdir * ENTSIZ + first_set(first_unset_bit(*dir)) - 1;
 		expand_tables(bs);
-		return ret;
+		return;
 	}
 
 	// Is there a directory with free space?
@@ -99,20 +109,82 @@ size_t gil_bitset_set_next(struct gil_bitset *bs) {
 		bs->currdir = i;
 		bs->currtable = bs->currdir * ENTSIZ + first_set(first_unset_bit(*dir)) - 1;
 		expand_tables(bs);
-
-		return ret;
+		return;
 	}
 
 	// Ok, we gotta make a new dir then
 	bs->currdir = bs->dirslen;
 	bs->currtable = bs->currdir * ENTSIZ;
-	bs->dirs = realloc(bs->dirs, bs->dirslen * 2 * sizeof(*bs->dirs));
+	bs->dirs = gil_allocator_realloc(
+			bs->alloc, bs->dirs, bs->dirslen * 2 * sizeof(*bs->dirs));
 	memset(bs->dirs + bs->dirslen, 0, sizeof(*bs->dirs) * bs->dirslen);
 	bs->dirslen *= 2;
 	expand_tables(bs);
+}
+
+size_t gil_bitset_set_next(struct gil_bitset *bs) {
+	gil_bitset_entry *table = &bs->tables[bs->currtable];
+	gil_bitset_entry bit = first_unset_bit(*table);
+	*table |= bit;
+	size_t ret = bs->currtable * ENTSIZ + first_set(bit) - 1;
+
+	// Ok, this table is full then...
+	if (*table == ~(gil_bitset_entry)0) {
+		next_table(bs);
+	}
+
 	return ret;
 }
 
+size_t gil_bitset_set_run(struct gil_bitset *bs, size_t limit, size_t *start) {
+	gil_bitset_entry *table = &bs->tables[bs->currtable];
+	gil_bitset_entry bit = first_unset_bit(*table);
+	*start = bs->currtable * ENTSIZ + first_set(bit) - 1;
+
+	// The run ends at the first set bit above 'bit', or at the end of the table.
+	// If there is no such bit, 'above' is 0, and the subtraction wraps around
+	// to include all the bits from 'bit' and up.
+	gil_bitset_entry above = *table & ~(bit - 1);
+	above &= ~above + 1;
+	gil_bitset_entry run = above - bit;
+
+	size_t count = count_set(run);
+	if (*start + count > limit) {
+		count = limit > *start ? limit - *start : 1;
+		run = (((gil_bitset_entry)1 << count) - 1) * bit;
+	}
+
+	*table |= run;
+	if (*table == ~(gil_bitset_entry)0) {
+		next_table(bs);
+	}
+
+	return count;
+}
+
+void gil_bitset_seek(struct gil_bitset *bs, size_t id) {
+	size_t tblidx = id / ENTSIZ;
+	while (tblidx < bs->tableslen && bs->tables[tblidx] == ~(gil_bitset_entry)0) {
+		tblidx += 1;
+	}
+
+	size_t diridx = tblidx / ENTSIZ;
+	if (diridx >= bs->dirslen) {
+		size_t dirslen = bs->dirslen;
+		while (diridx >= dirslen) {
+			dirslen *= 2;
+		}
+
+		bs->dirs = gil_allocator_realloc(bs->alloc, bs->dirs, dirslen * sizeof(*bs->dirs));
+		memset(bs->dirs + bs->dirslen, 0, sizeof(*bs->dirs) * (dirslen - bs->dirslen));
+		bs->dirslen = dirslen;
+	}
+
+	bs->currtable = tblidx;
+	bs->currdir = diridx;
+	expand_tables(bs);
+}
+
 void gil_bitset_unset(struct gil_bitset *bs, size_t id) {
 	size_t tblidx = id / ENTSIZ;
 	size_t tblbit = id % ENTSIZ;
@@ -127,6 +199,84 @@ void gil_bitset_unset(struct gil_bitset *bs, size_t id) {
 	bs->dirs[diridx] &= ~((gil_bitset_entry)1 << dirbit);
 }
 
+void gil_bitset_set(struct gil_bitset *bs, size_t id) {
+	size_t tblidx = id / ENTSIZ;
+	size_t tblbit = id % ENTSIZ;
+	size_t diridx = id / (ENTSIZ * ENTSIZ);
+	size_t dirbit = (id / ENTSIZ) % ENTSIZ;
+
+	bs->tables[tblidx] |= (gil_bitset_entry)1 << tblbit;
+	if (bs->tables[tblidx] == ~(gil_bitset_entry)0 && diridx < bs->dirslen) {
+		bs->dirs[diridx] |= (gil_bitset_entry)1 << dirbit;
+	}
+}
+
+gil_bitset_entry gil_bitset_retain(
+		struct gil_bitset *bs, size_t tblidx, gil_bitset_entry mask) {
+	gil_bitset_entry removed = bs->tables[tblidx] & ~mask;
+	if (removed != 0) {
+		bs->tables[tblidx] &= mask;
+		bs->dirs[tblidx / ENTSIZ] &= ~((gil_bitset_entry)1 << (tblidx % ENTSIZ));
+	}
+
+	return removed;
+}
+
+size_t gil_bitset_count(struct gil_bitset *bs) {
+	size_t count = 0;
+	for (size_t i = 0; i < bs->tableslen; ++i) {
+		count += count_set(bs->tables[i]);
+	}
+
+	return count;
+}
+
+void gil_bitset_shrink(struct gil_bitset *bs) {
+	size_t used = bs->tableslen;
+	while (used > 0 && bs->tables[used - 1] == 0) {
+		used -= 1;
+	}
+
+	size_t tableslen = 4;
+	while (tableslen < used) {
+		tableslen *= 2;
+	}
+
+	if (tableslen < bs->tableslen) {
+		gil_bitset_entry *tables = gil_allocator_realloc(
+				bs->alloc, bs->tables, tableslen * sizeof(*tables));
+		if (tables != NULL) {
+			bs->tables = tables;
+			bs->tableslen = tableslen;
+		}
+	}
+
+	size_t dirslen = 1;
+	while (dirslen * ENTSIZ < bs->tableslen) {
+		dirslen *= 2;
+	}
+
+	if (dirslen != bs->dirslen) {
+		gil_bitset_entry *dirs = gil_allocator_realloc(
+				bs->alloc, bs->dirs, dirslen * sizeof(*dirs));
+		if (dirs != NULL) {
+			bs->dirs = dirs;
+			bs->dirslen = dirslen;
+		}
+	}
+
+	// Rebuild the directories, since tables may have been filled up
+	// without going through gil_bitset_set_next
+	memset(bs->dirs, 0, bs->dirslen * sizeof(*bs->dirs));
+	for (size_t i = 0; i < bs->tableslen && i / ENTSIZ < bs->dirslen; ++i) {
+		if (bs->tables[i] == ~(gil_bitset_entry)0) {
+			bs->dirs[i / ENTSIZ] |= (gil_bitset_entry)1 << (i % ENTSIZ);
+		}
+	}
+
+	gil_bitset_seek(bs, 0);
+}
+
 void gil_bitset_iterator_init(
 		struct gil_bitset_iterator *it, struct gil_bitset *bs) {
 	it->tableidx = 0;
@@ -271,16 +271,16 @@ int gil_gen_import_copy(
 
 void gil_gen_named_param(
 		struct gil_generator *gen, gil_word idx, char **ident) {
-	size_t atom_id = gil_strset_put(&gen->atomset, ident);
-	bctrace("NAMED_PARAM %u %u", atom_id, idx);
-	put(gen, GIL_OP_NAMED_PARAM);
-	put_uint(gen, atom_id);
-	put_uint(gen, idx);
+	gil_gen_named_param_id(gen, idx, gil_strset_put(&gen->atomset, ident));
 }
 
 void gil_gen_named_param_copy(
 		struct gil_generator *gen, gil_word idx, const char *ident) {
-	size_t atom_id = gil_strset_put_copy(&gen->atomset, ident);
+	gil_gen_named_param_id(gen, idx, gil_strset_put_copy(&gen->atomset, ident));
+}
+
+void gil_gen_named_param_id(
+		struct gil_generator *gen, gil_word idx, gil_word atom_id) {
 	bctrace("NAMED_PARAM %u %u", atom_id, idx);
 	put(gen, GIL_OP_NAMED_PARAM);
 	put_uint(gen, atom_id);
@@ -350,18 +350,18 @@ void gil_gen_number(struct gil_generator *gen, double num) {
 	put_d8le(gen, num);
 }
 
-void gil_gen_atom(struct gil_generator *gen, char **str) {
-	size_t id = gil_strset_put(&gen->atomset, str);
-	bctrace("ALLOC_ATOM %u", id);
-	put(gen, GIL_OP_ALLOC_ATOM);
-	put_uint(gen, id);
+void gil_gen_atom(struct gil_generator *gen, char **ident) {
+	gil_gen_atom_id(gen, gil_strset_put(&gen->atomset, ident));
+}
+
+void gil_gen_atom_copy(struct gil_generator *gen, const char *ident) {
+	gil_gen_atom_id(gen, gil_strset_put_copy(&gen->atomset, ident));
 }
 
-void gil_gen_atom_copy(struct gil_generator *gen, char *str) {
-	size_t id = gil_strset_put_copy(&gen->atomset, str);
-	bctrace("ALLOC_ATOM %u", id);
+void gil_gen_atom_id(struct gil_generator *gen, gil_word atom_id) {
+	bctrace("ALLOC_ATOM %u", atom_id);
 	put(gen, GIL_OP_ALLOC_ATOM);
-	put_uint(gen, id);
+	put_uint(gen, atom_id);
 }
 
 void gil_gen_string(struct gil_generator *gen, char **str) {
@@ -434,27 +434,28 @@ void gil_gen_namespace(struct gil_generator *gen) {
 }
 
 void gil_gen_namespace_set(struct gil_generator *gen, char **ident) {
-	size_t atom_id = gil_strset_put(&gen->atomset, ident);
-	bctrace("NAMESPACE_SET %u", atom_id);
-	put(gen, GIL_OP_NAMESPACE_SET);
-	put_uint(gen, atom_id);
+	gil_gen_namespace_set_id(gen, gil_strset_put(&gen->atomset, ident));
 }
 
-void gil_gen_namespace_set_copy(struct gil_generator *gen, char *ident) {
-	size_t atom_id = gil_strset_put_copy(&gen->atomset, ident);
+void gil_gen_namespace_set_copy(struct gil_generator *gen, const char *ident) {
+	gil_gen_namespace_set_id(gen, gil_strset_put_copy(&gen->atomset, ident));
+}
+
+void gil_gen_namespace_set_id(struct gil_generator *gen, gil_word atom_id) {
 	bctrace("NAMESPACE_SET %u", atom_id);
 	put(gen, GIL_OP_NAMESPACE_SET);
 	put_uint(gen, atom_id);
 }
 
 void gil_gen_namespace_lookup(struct gil_generator *gen, char **ident) {
-	size_t atom_id = gil_strset_put(&gen->atomset, ident);
-	put(gen, GIL_OP_NAMESPACE_LOOKUP);
-	put_uint(gen, atom_id);
+	gil_gen_namespace_lookup_id(gen, gil_strset_put(&gen->atomset, ident));
 }
 
-void gil_gen_namespace_lookup_copy(struct gil_generator *gen, char *ident) {
-	size_t atom_id = gil_strset_put_copy(&gen->atomset, ident);
+void gil_gen_namespace_lookup_copy(struct gil_generator *gen, const char *ident) {
+	gil_gen_namespace_lookup_id(gen, gil_strset_put_copy(&gen->atomset, ident));
+}
+
+void gil_gen_namespace_lookup_id(struct gil_generator *gen, gil_word atom_id) {
 	bctrace("NAMESPACE_LOOKUP %u", atom_id);
 	put(gen, GIL_OP_NAMESPACE_LOOKUP);
 	put_uint(gen, atom_id);
@@ -494,42 +495,42 @@ void gil_gen_stack_frame_get_arg(struct gil_generator *gen, gil_word idx) {
 }
 
 void gil_gen_stack_frame_lookup(struct gil_generator *gen, char **ident) {
-	size_t atom_id = gil_strset_put(&gen->atomset, ident);
-	bctrace("DYNAMIC_STACK_FRAME_LOOKUP %u", atom_id);
-	put(gen, GIL_OP_STACK_FRAME_LOOKUP);
-	put_uint(gen, atom_id);
+	gil_gen_stack_frame_lookup_id(gen, gil_strset_put(&gen->atomset, ident));
 }
 
-void gil_gen_stack_frame_lookup_copy(struct gil_generator *gen, char *ident) {
-	size_t atom_id = gil_strset_put_copy(&gen->atomset, ident);
+void gil_gen_stack_frame_lookup_copy(struct gil_generator *gen, const char *ident) {
+	gil_gen_stack_frame_lookup_id(gen, gil_strset_put_copy(&gen->atomset, ident));
+}
+
+void gil_gen_stack_frame_lookup_id(struct gil_generator *gen, gil_word atom_id) {
 	bctrace("DYNAMIC_STACK_FRAME_LOOKUP %u", atom_id);
 	put(gen, GIL_OP_STACK_FRAME_LOOKUP);
 	put_uint(gen, atom_id);
 }
 
 void gil_gen_stack_frame_set(struct gil_generator *gen, char **ident) {
-	size_t atom_id = gil_strset_put(&gen->atomset, ident);
-	bctrace("DYNAMIC_STACK_FRAME_SET %u", atom_id);
-	put(gen, GIL_OP_STACK_FRAME_SET);
-	put_uint(gen, atom_id);
+	gil_gen_stack_frame_set_id(gen, gil_strset_put(&gen->atomset, ident));
+}
+
+void gil_gen_stack_frame_set_copy(struct gil_generator *gen, const char *ident) {
+	gil_gen_stack_frame_set_id(gen, gil_strset_put_copy(&gen->atomset, ident));
 }
 
-void gil_gen_stack_frame_set_copy(struct gil_generator *gen, char *ident) {
-	size_t atom_id = gil_strset_put_copy(&gen->atomset, ident);
+void gil_gen_stack_frame_set_id(struct gil_generator *gen, gil_word atom_id) {
 	bctrace("DYNAMIC_STACK_FRAME_SET %u", atom_id);
 	put(gen, GIL_OP_STACK_FRAME_SET);
 	put_uint(gen, atom_id);
 }
 
 void gil_gen_stack_frame_replace(struct gil_generator *gen, char **ident) {
-	size_t atom_id = gil_strset_put(&gen->atomset, ident);
-	bctrace("DYNAMIC_STACK_FRAME_REPLACE %u", atom_id);
-	put(gen, GIL_OP_STACK_FRAME_REPLACE);
-	put_uint(gen, atom_id);
+	gil_gen_stack_frame_replace_id(gen, gil_strset_put(&gen->atomset, ident));
+}
+
+void gil_gen_stack_frame_replace_copy(struct gil_generator *gen, const char *ident) {
+	gil_gen_stack_frame_replace_id(gen, gil_strset_put_copy(&gen->atomset, ident));
 }
 
-void gil_gen_stack_frame_replace_copy(struct gil_generator *gen, char *ident) {
-	size_t atom_id = gil_strset_put_copy(&gen->atomset, ident);
+void gil_gen_stack_frame_replace_id(struct gil_generator *gen, gil_word atom_id) {
 	bctrace("DYNAMIC_STACK_FRAME_REPLACE %u", atom_id);
 	put(gen, GIL_OP_STACK_FRAME_REPLACE);
 	put_uint(gen, atom_id);
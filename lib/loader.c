@@ -1,15 +1,33 @@
 #include "loader.h"
 
 #include <stdint.h>
+#include <stdlib.h>
 #include "bytecode.h"
 
 #include "io.h"
+#include "strset.h"
 
 #if !defined(GIL_MAJOR) || !defined(GIL_MINOR)
 #error "Need to define GIL_MAJOR and GIL_MINOR macros"
 #endif
 
-int gil_bc_serialize(FILE *outf, unsigned char *data, size_t len) {
+static int write_u32(FILE *outf, uint32_t num) {
+	unsigned char buf[4] = {
+		(num >> 24) & 0xff,
+		(num >> 16) & 0xff,
+		(num >> 8) & 0xff,
+		(num >> 0) & 0xff,
+	};
+	if (fwrite(buf, 1, 4, outf) < 4) {
+		fprintf(stderr, "Write error\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+int gil_bc_serialize(
+		FILE *outf, unsigned char *data, size_t len, struct gil_strset *atoms) {
 	char header[4] = { 0x1b, 0x67, 0x6c, 0x63 };
 	if (fwrite(header, 1, 4, outf) < 4) {
 		fprintf(stderr, "Write error\n");
@@ -27,6 +45,21 @@ int gil_bc_serialize(FILE *outf, unsigned char *data, size_t len) {
 		return -1;
 	}
 
+	// The atom count, then the names as NUL-terminated strings in id order
+	uint32_t atomslen = (uint32_t)atoms->next - 1;
+	if (write_u32(outf, atomslen) < 0) {
+		return -1;
+	}
+
+	for (size_t id = 1; id <= atomslen; ++id) {
+		size_t namelen;
+		const char *name = gil_strset_name(atoms, id, &namelen);
+		if (fwrite(name, 1, namelen + 1, outf) < namelen + 1) {
+			fprintf(stderr, "Write error\n");
+			return -1;
+		}
+	}
+
 	if (fwrite(data, 1, len, outf) < len) {
 		fprintf(stderr, "Write error\n");
 		return -1;
@@ -35,7 +68,58 @@ int gil_bc_serialize(FILE *outf, unsigned char *data, size_t len) {
 	return 0;
 }
 
-int gil_bc_load(FILE *inf, struct gil_io_writer *w) {
+static int read_atoms(FILE *inf, struct gil_strset *atoms) {
+	unsigned char count_buf[4];
+	if (fread(count_buf, 1, 4, inf) < 4) {
+		fprintf(stderr, "Read error\n");
+		return -1;
+	}
+
+	uint32_t atomslen =
+		(uint32_t)count_buf[0] << 24 | (uint32_t)count_buf[1] << 16 |
+		(uint32_t)count_buf[2] << 8 | (uint32_t)count_buf[3];
+
+	char *name = NULL;
+	size_t size = 0;
+	int ret = 0;
+	for (size_t id = 1; id <= atomslen; ++id) {
+		size_t len = 0;
+		int ch;
+		while ((ch = fgetc(inf)) > 0) {
+			if (len >= size) {
+				size = size == 0 ? 64 : size * 2;
+				char *newname = realloc(name, size);
+				if (newname == NULL) {
+					fprintf(stderr, "Allocation failure\n");
+					ret = -1;
+					goto out;
+				}
+				name = newname;
+			}
+
+			name[len++] = (char)ch;
+		}
+
+		if (ch != 0) {
+			fprintf(stderr, "Bytecode has corrupt atoms\n");
+			ret = -1;
+			goto out;
+		}
+
+		// Names the set already has must have the same ids
+		if (gil_strset_put_copy_n(atoms, len == 0 ? "" : name, len) != id) {
+			fprintf(stderr, "Bytecode atoms don't match\n");
+			ret = -1;
+			goto out;
+		}
+	}
+
+out:
+	free(name);
+	return ret;
+}
+
+int gil_bc_load(FILE *inf, struct gil_io_writer *w, struct gil_strset *atoms) {
 	// Header is already read by main
 
 	unsigned char version_buf[4];
@@ -55,6 +139,10 @@ int gil_bc_load(FILE *inf, struct gil_io_writer *w) {
 		return -1;
 	}
 
+	if (read_atoms(inf, atoms) < 0) {
+		return -1;
+	}
+
 	unsigned char buffer[4096];
 
 	while (1) {
@@ -6,6 +6,7 @@
 
 #include "io.h"
 #include "module.h"
+#include "strset.h"
 #include "vm/vm.h"
 
 static void print_val(struct gil_vm *vm, struct gil_io_writer *out, struct gil_vm_value *val, int depth) {
@@ -25,7 +26,14 @@ static void print_val(struct gil_vm *vm, struct gil_io_writer *out, struct gil_v
 		} else if (val->atom.atom == vm->values[vm->kfalse].atom.atom) {
 			gil_io_printf(out, "(false)");
 		} else {
-			gil_io_printf(out, "(atom %u)", val->atom.atom);
+			// The VM only knows the names of the bytecode's atoms
+			// if it's been given the generator's atom set
+			const char *name = gil_strset_name(&vm->atomset, val->atom.atom, NULL);
+			if (name != NULL) {
+				gil_io_printf(out, "(atom %s)", name);
+			} else {
+				gil_io_printf(out, "(atom %u)", val->atom.atom);
+			}
 		}
 		break;
 
@@ -34,9 +42,7 @@ static void print_val(struct gil_vm *vm, struct gil_io_writer *out, struct gil_v
 		break;
 
 	case GIL_VAL_TYPE_BUFFER:
-		if (val->buffer.buffer != NULL) {
-			out->write(out, val->buffer.buffer, val->buffer.length);
-		}
+		out->write(out, gil_vm_buffer_data(val), gil_vm_buffer_length(val));
 		break;
 
 	case GIL_VAL_TYPE_ARRAY:
@@ -146,16 +152,7 @@ static gil_word builtin_eq(
 				return vm->kfalse;
 			}
 		} else if (typ == GIL_VAL_TYPE_BUFFER) {
-			if (a->buffer.buffer == NULL && b->buffer.buffer == NULL) continue;
-			if (a->buffer.buffer == NULL || b->buffer.buffer == NULL) {
-				return vm->kfalse;
-			}
-
-			if (a->buffer.length != b->buffer.length) {
-				return vm->kfalse;
-			}
-
-			if (memcmp(a->buffer.buffer, b->buffer.buffer, a->buffer.length) != 0) {
+			if (!gil_vm_buffer_equals(a, b)) {
 				return vm->kfalse;
 			}
 		} else {
@@ -306,7 +303,7 @@ gil_word builtin_len(
 		break;
 
 	case GIL_VAL_TYPE_BUFFER:
-		ret->real.real = val->buffer.length;
+		ret->real.real = gil_vm_buffer_length(val);
 		break;
 
 	case GIL_VAL_TYPE_ARRAY:
@@ -314,7 +311,9 @@ gil_word builtin_len(
 		break;
 
 	case GIL_VAL_TYPE_NAMESPACE:
-		if (val->ns.ns) {
+		if (val->flags & GIL_VAL_SBO) {
+			ret->real.real = 1;
+		} else if (val->ns.ns) {
 			ret->real.real = val->ns.ns->len;
 		}
 		break;
@@ -323,6 +322,50 @@ gil_word builtin_len(
 	return ret_id;
 }
 
+// Freeze a namespace, so that it can't be changed any more.
+// Lookups in frozen namespaces are cached.
+static gil_word builtin_freeze(
+		struct gil_vm *vm, gil_word mid, gil_word self,
+		gil_word argc, gil_word *argv) {
+	if (argc != 1) {
+		return gil_vm_error(vm, "Expected 1 argument");
+	}
+
+	struct gil_vm_value *val = &vm->values[argv[0]];
+	if (gil_value_get_type(val) != GIL_VAL_TYPE_NAMESPACE) {
+		return gil_vm_type_error(vm, val);
+	}
+
+	val->flags |= GIL_VAL_CONST;
+	return argv[0];
+}
+
+// Get the atom named by a buffer, so that namespaces can be keyed
+// by names which are only known at runtime. Atoms are returned as they are.
+static gil_word builtin_atom(
+		struct gil_vm *vm, gil_word mid, gil_word self,
+		gil_word argc, gil_word *argv) {
+	if (argc != 1) {
+		return gil_vm_error(vm, "Expected 1 argument");
+	}
+
+	struct gil_vm_value *val = &vm->values[argv[0]];
+	if (gil_value_get_type(val) == GIL_VAL_TYPE_ATOM) {
+		return argv[0];
+	} else if (gil_value_get_type(val) != GIL_VAL_TYPE_BUFFER) {
+		return gil_vm_type_error(vm, val);
+	}
+
+	gil_word atom = gil_vm_intern_atom(
+			vm, gil_vm_buffer_data(val), gil_vm_buffer_length(val));
+	if (atom == 0) {
+		// The VM doesn't know which atoms the bytecode uses, or is out of memory
+		return gil_vm_error(vm, "Can't make a new atom");
+	}
+
+	return gil_vm_make_atom(vm, atom);
+}
+
 static gil_word builtin_if(
 		struct gil_vm *vm, gil_word mid, gil_word self,
 		gil_word argc, gil_word *argv) {
@@ -371,6 +414,13 @@ static void loop_marker(
 	mark(vm, ctx->func, depth + 1);
 }
 
+static void loop_relocator(
+		struct gil_vm *vm, void *data,
+		void (*relocate)(struct gil_vm *vm, gil_word *id)) {
+	struct loop_context *ctx = data;
+	relocate(vm, &ctx->func);
+}
+
 static gil_word builtin_loop(
 		struct gil_vm *vm, gil_word mid, gil_word self,
 		gil_word argc, gil_word *argv) {
@@ -378,13 +428,14 @@ static gil_word builtin_loop(
 		return gil_vm_error(vm, "Expected 1 argument");
 	}
 
-	struct loop_context *ctx = malloc(sizeof(*ctx));
+	struct loop_context *ctx = gil_vm_malloc(vm, sizeof(*ctx));
 	if (ctx == NULL) {
 		return gil_vm_error(vm, "Allocation failure");
 	}
 
 	ctx->base.callback = loop_callback;
 	ctx->base.marker = loop_marker;
+	ctx->base.relocator = loop_relocator;
 	ctx->base.args = vm->knone;
 	ctx->func = argv[0];
 
@@ -435,6 +486,14 @@ static void while_marker(
 	mark(vm, ctx->body, depth + 1);
 }
 
+static void while_relocator(
+		struct gil_vm *vm, void *data,
+		void (*relocate)(struct gil_vm *vm, gil_word *id)) {
+	struct while_context *ctx = data;
+	relocate(vm, &ctx->cond);
+	relocate(vm, &ctx->body);
+}
+
 static gil_word builtin_while(
 		struct gil_vm *vm, gil_word mid, gil_word self,
 		gil_word argc, gil_word *argv) {
@@ -442,13 +501,14 @@ static gil_word builtin_while(
 		return gil_vm_error(vm, "Expected 2 arguments");
 	}
 
-	struct while_context *ctx = malloc(sizeof(*ctx));
+	struct while_context *ctx = gil_vm_malloc(vm, sizeof(*ctx));
 	if (ctx == NULL) {
 		return gil_vm_error(vm, "Allocation failure");
 	}
 
 	ctx->base.callback = while_callback;
 	ctx->base.marker = while_marker;
+	ctx->base.relocator = while_relocator;
 	ctx->base.args = vm->knone;
 	ctx->cond = argv[0];
 	ctx->body = argv[1];
@@ -503,6 +563,14 @@ static void for_marker(
 	mark(vm, ctx->func, depth + 1);
 }
 
+static void for_relocator(
+		struct gil_vm *vm, void *data,
+		void (*relocate)(struct gil_vm *vm, gil_word *id)) {
+	struct for_context *ctx = data;
+	relocate(vm, &ctx->iter);
+	relocate(vm, &ctx->func);
+}
+
 static gil_word builtin_for(
 		struct gil_vm *vm, gil_word mid, gil_word self,
 		gil_word argc, gil_word *argv) {
@@ -514,9 +582,14 @@ static gil_word builtin_for(
 	struct gil_vm_value *args = &vm->values[args_id];
 	args->array.length = 0;
 
-	struct for_context *ctx = malloc(sizeof(*ctx));
+	struct for_context *ctx = gil_vm_malloc(vm, sizeof(*ctx));
+	if (ctx == NULL) {
+		return gil_vm_error(vm, "Allocation failure");
+	}
+
 	ctx->base.callback = for_callback;
 	ctx->base.marker = for_marker;
+	ctx->base.relocator = for_relocator;
 	ctx->base.args = args_id;
 	ctx->iter = argv[0];
 	ctx->func = argv[1];
@@ -531,7 +604,7 @@ static gil_word builtin_for(
 static gil_word guard_callback(
 		struct gil_vm *vm, gil_word retval, gil_word cont_id) {
 	struct gil_vm_value *ret = &vm->values[cont_id];
-	free(ret->cont.cont);
+	gil_vm_dealloc(vm, ret->cont.cont);
 	ret->flags = GIL_VAL_TYPE_RETURN;
 	ret->ret.ret = retval;
 	return cont_id;
@@ -568,13 +641,14 @@ static gil_word builtin_guard(
 		return vm->knone;
 	}
 
-	struct gil_vm_contcontext *ctx = malloc(sizeof(*ctx));
+	struct gil_vm_contcontext *ctx = gil_vm_malloc(vm, sizeof(*ctx));
 	if (ctx == NULL) {
 		return gil_vm_error(vm, "Allocation failure");
 	}
 
 	ctx->callback = guard_callback;
 	ctx->marker = NULL;
+	ctx->relocator = NULL;
 	ctx->args = vm->knone;
 
 	gil_word cont_id = gil_vm_alloc(vm, GIL_VAL_TYPE_CONTINUATION, 0);
@@ -603,6 +677,7 @@ static gil_word match_callback(
 		cont->cont.call = ctx->pairs[ctx->index][1];
 		ctx->base.callback = NULL;
 		ctx->base.marker = NULL;
+		ctx->base.relocator = NULL;
 	} else {
 		// Otherwise, we have to execute the next predicate
 		ctx->index += 1;
@@ -627,6 +702,16 @@ static void match_marker(
 	}
 }
 
+static void match_relocator(
+		struct gil_vm *vm, void *data,
+		void (*relocate)(struct gil_vm *vm, gil_word *id)) {
+	struct match_context *ctx = data;
+	for (gil_word i = 0; i < ctx->pairs_len; ++i) {
+		relocate(vm, &ctx->pairs[i][0]);
+		relocate(vm, &ctx->pairs[i][1]);
+	}
+}
+
 static gil_word builtin_match(
 		struct gil_vm *vm, gil_word mid, gil_word self,
 		gil_word argc, gil_word *argv) {
@@ -641,8 +726,8 @@ static gil_word builtin_match(
 	gil_word *pairs = argv + 1;
 	gil_word pairs_len = (argc - 1) / 2; // This is okay, since argc is odd
 
-	struct match_context *ctx = malloc(
-			sizeof(*ctx) +
+	struct match_context *ctx = gil_vm_malloc(
+			vm, sizeof(*ctx) +
 			pairs_len * sizeof(*(ctx->pairs)));
 	if (ctx == NULL) {
 		return gil_vm_error(vm, "Allocation failure");
@@ -658,6 +743,7 @@ static gil_word builtin_match(
 
 	ctx->base.callback = match_callback;
 	ctx->base.marker = match_marker;
+	ctx->base.relocator = match_relocator;
 
 	gil_word cont_id = gil_vm_alloc(vm, GIL_VAL_TYPE_CONTINUATION, 0);
 	vm->values[cont_id].cont.cont = &ctx->base;
@@ -685,6 +771,8 @@ static void init(
 	mod->kprint = alloc(data, "print");
 	mod->kwrite = alloc(data, "write");
 	mod->klen = alloc(data, "len");
+	mod->kfreeze = alloc(data, "freeze");
+	mod->katom = alloc(data, "atom");
 	mod->kif = alloc(data, "if");
 	mod->kloop = alloc(data, "loop");
 	mod->kwhile = alloc(data, "while");
@@ -703,53 +791,59 @@ static gil_word create(struct gil_module *ptr, struct gil_vm *vm, gil_word mid)
 	ns->ns.parent = 0;
 	ns->ns.ns = NULL;
 
-	gil_vm_namespace_set(ns, mod->kadd,
+	gil_vm_namespace_set(vm, ns, mod->kadd,
 			gil_vm_make_cfunction(vm, builtin_add, mid));
-	gil_vm_namespace_set(ns, mod->ksub,
+	gil_vm_namespace_set(vm, ns, mod->ksub,
 			gil_vm_make_cfunction(vm, builtin_sub, mid));
-	gil_vm_namespace_set(ns, mod->kmul,
+	gil_vm_namespace_set(vm, ns, mod->kmul,
 			gil_vm_make_cfunction(vm, builtin_mul, mid));
-	gil_vm_namespace_set(ns, mod->kdiv,
+	gil_vm_namespace_set(vm, ns, mod->kdiv,
 			gil_vm_make_cfunction(vm, builtin_div, mid));
-	gil_vm_namespace_set(ns, mod->keq,
+	gil_vm_namespace_set(vm, ns, mod->keq,
 			gil_vm_make_cfunction(vm, builtin_eq, mid));
-	gil_vm_namespace_set(ns, mod->kneq,
+	gil_vm_namespace_set(vm, ns, mod->kneq,
 			gil_vm_make_cfunction(vm, builtin_neq, mid));
-	gil_vm_namespace_set(ns, mod->klt,
+	gil_vm_namespace_set(vm, ns, mod->klt,
 			gil_vm_make_cfunction(vm, builtin_lt, mid));
-	gil_vm_namespace_set(ns, mod->klteq,
+	gil_vm_namespace_set(vm, ns, mod->klteq,
 			gil_vm_make_cfunction(vm, builtin_lteq, mid));
-	gil_vm_namespace_set(ns, mod->kgt,
+	gil_vm_namespace_set(vm, ns, mod->kgt,
 			gil_vm_make_cfunction(vm, builtin_gt, mid));
-	gil_vm_namespace_set(ns, mod->kgteq,
+	gil_vm_namespace_set(vm, ns, mod->kgteq,
 			gil_vm_make_cfunction(vm, builtin_gteq, mid));
-	gil_vm_namespace_set(ns, mod->kland,
+	gil_vm_namespace_set(vm, ns, mod->kland,
 			gil_vm_make_cfunction(vm, builtin_land, mid));
-	gil_vm_namespace_set(ns, mod->klor,
+	gil_vm_namespace_set(vm, ns, mod->klor,
 			gil_vm_make_cfunction(vm, builtin_lor, mid));
-	gil_vm_namespace_set(ns, mod->kfirst,
+	gil_vm_namespace_set(vm, ns, mod->kfirst,
 			gil_vm_make_cfunction(vm, builtin_first, mid));
-	gil_vm_namespace_set(ns, mod->kprint,
+	gil_vm_namespace_set(vm, ns, mod->kprint,
 			gil_vm_make_cfunction(vm, builtin_print, mid));
-	gil_vm_namespace_set(ns, mod->kwrite,
+	gil_vm_namespace_set(vm, ns, mod->kwrite,
 			gil_vm_make_cfunction(vm, builtin_write, mid));
-	gil_vm_namespace_set(ns, mod->klen,
+	gil_vm_namespace_set(vm, ns, mod->klen,
 			gil_vm_make_cfunction(vm, builtin_len, mid));
-	gil_vm_namespace_set(ns, mod->kif,
+	gil_vm_namespace_set(vm, ns, mod->kfreeze,
+			gil_vm_make_cfunction(vm, builtin_freeze, mid));
+	gil_vm_namespace_set(vm, ns, mod->katom,
+			gil_vm_make_cfunction(vm, builtin_atom, mid));
+	gil_vm_namespace_set(vm, ns, mod->kif,
 			gil_vm_make_cfunction(vm, builtin_if, mid));
-	gil_vm_namespace_set(ns, mod->kloop,
+	gil_vm_namespace_set(vm, ns, mod->kloop,
 			gil_vm_make_cfunction(vm, builtin_loop, mid));
-	gil_vm_namespace_set(ns, mod->kwhile,
+	gil_vm_namespace_set(vm, ns, mod->kwhile,
 			gil_vm_make_cfunction(vm, builtin_while, mid));
-	gil_vm_namespace_set(ns, mod->kfor,
+	gil_vm_namespace_set(vm, ns, mod->kfor,
 			gil_vm_make_cfunction(vm, builtin_for, mid));
-	gil_vm_namespace_set(ns, mod->kguard,
+	gil_vm_namespace_set(vm, ns, mod->kguard,
 			gil_vm_make_cfunction(vm, builtin_guard, mid));
-	gil_vm_namespace_set(ns, mod->kmatch,
+	gil_vm_namespace_set(vm, ns, mod->kmatch,
 			gil_vm_make_cfunction(vm, builtin_match, mid));
 
-	gil_vm_namespace_set(ns, mod->knone, vm->knone);
+	gil_vm_namespace_set(vm, ns, mod->knone, vm->knone);
 
+	// Nothing is supposed to change the builtins
+	vm->values[id].flags |= GIL_VAL_CONST;
 	return id;
 }
 
@@ -758,9 +852,19 @@ static void marker(
 		void (*mark)(struct gil_vm *vm, gil_word id)) {
 }
 
+static const gil_vm_cfunction functions[] = {
+	builtin_add, builtin_sub, builtin_mul, builtin_div, builtin_eq, builtin_neq,
+	builtin_lt, builtin_lteq, builtin_gt, builtin_gteq, builtin_land, builtin_lor, builtin_first,
+	builtin_print, builtin_write, builtin_len, builtin_freeze, builtin_atom,
+	builtin_if, builtin_loop, builtin_while, builtin_for, builtin_guard, builtin_match,
+	NULL,
+};
+
 void gil_mod_builtins_init(struct gil_mod_builtins *mod) {
 	mod->base.name = "builtins";
+	mod->base.functions = functions;
 	mod->base.init = init;
 	mod->base.create = create;
 	mod->base.marker = marker;
+	mod->base.relocator = NULL;
 }
@@ -29,12 +29,12 @@ static gil_word fs_open(
 			return gil_vm_type_error(vm, mode);
 		}
 
-		modestr = mode->buffer.buffer;
+		modestr = gil_vm_buffer_data(mode);
 	}
 
-	FILE *f = fopen(path->buffer.buffer, modestr);
+	FILE *f = fopen(gil_vm_buffer_data(path), modestr);
 	if (f == NULL) {
-		return gil_vm_error(vm, "%s: %s", path->buffer.buffer, strerror(errno));
+		return gil_vm_error(vm, "%s: %s", gil_vm_buffer_data(path), strerror(errno));
 	}
 
 	return gil_vm_make_cval(vm, mod->tfile, mod->nsfile, f);
@@ -91,22 +91,38 @@ static gil_word fs_file_read_all(
 
 	size_t size = 32;
 	size_t len = 0;
-	char *data = malloc(size + 1);
+	struct gil_vm_buffer *buf = gil_vm_malloc_buffer(vm, size);
+	if (buf == NULL) {
+		return gil_vm_error(vm, "Allocation failure");
+	}
+
 	while (1) {
-		size_t n = fread(data + len, 1, size - len, (FILE *)val->cval.cval);
+		size_t n = fread(buf->data + len, 1, size - len, (FILE *)val->cval.cval);
 		if (n == 0) {
-			data[len] = '\0';
+			buf->data[len] = '\0';
 			break;
 		}
 
 		len += n;
 		if (len == size) {
 			size *= 2;
-			data = realloc(data, size + 1);
+			struct gil_vm_buffer *newbuf = gil_vm_realloc(
+					vm, buf, sizeof(*buf) + size + 1);
+			if (newbuf == NULL) {
+				gil_vm_dealloc(vm, buf);
+				return gil_vm_error(vm, "Allocation failure");
+			}
+
+			buf = newbuf;
 		}
 	}
 
-	return gil_vm_make_buffer(vm, data, len);
+	return gil_vm_make_buffer(vm, buf, len);
+}
+
+// Files which are never closed get closed once they're garbage
+static void fs_file_finalize(struct gil_vm *vm, void *cval) {
+	fclose(cval);
 }
 
 static void init(
@@ -120,7 +136,7 @@ static void init(
 
 static gil_word create(struct gil_module *ptr, struct gil_vm *vm, gil_word mid) {
 	struct gil_mod_fs *mod = (struct gil_mod_fs *)ptr;
-	mod->tfile = gil_vm_alloc_ctype(vm);
+	mod->tfile = gil_vm_register_ctype(vm, fs_file_finalize);
 
 	gil_word id = gil_vm_alloc(vm, GIL_VAL_TYPE_NAMESPACE, 0);
 	struct gil_vm_value *ns = &vm->values[id];
@@ -131,10 +147,10 @@ static gil_word create(struct gil_module *ptr, struct gil_vm *vm, gil_word mid)
 	struct gil_vm_value *nsfile = &vm->values[mod->nsfile];
 	nsfile->ns.parent = 0;
 	nsfile->ns.ns = NULL;
-	gil_vm_namespace_set(nsfile, mod->kclose, gil_vm_make_cfunction(vm, fs_file_close, mid));
-	gil_vm_namespace_set(nsfile, mod->kread, gil_vm_make_cfunction(vm, fs_file_read_all, mid));
+	gil_vm_namespace_set(vm, nsfile, mod->kclose, gil_vm_make_cfunction(vm, fs_file_close, mid));
+	gil_vm_namespace_set(vm, nsfile, mod->kread, gil_vm_make_cfunction(vm, fs_file_read_all, mid));
 
-	gil_vm_namespace_set(ns, mod->kopen, gil_vm_make_cfunction(vm, fs_open, mid));
+	gil_vm_namespace_set(vm, ns, mod->kopen, gil_vm_make_cfunction(vm, fs_open, mid));
 
 	return id;
 }
@@ -146,9 +162,22 @@ static void marker(
 	mark(vm, mod->nsfile);
 }
 
+static void relocator(
+		struct gil_module *ptr, struct gil_vm *vm,
+		void (*relocate)(struct gil_vm *vm, gil_word *id)) {
+	struct gil_mod_fs *mod = (struct gil_mod_fs *)ptr;
+	relocate(vm, &mod->nsfile);
+}
+
+static const gil_vm_cfunction functions[] = {
+	fs_open, fs_file_close, fs_file_read_all, NULL,
+};
+
 void gil_mod_fs_init(struct gil_mod_fs *mod) {
 	mod->base.name = "fs";
+	mod->base.functions = functions;
 	mod->base.init = init;
 	mod->base.create = create;
 	mod->base.marker = marker;
+	mod->base.relocator = relocator;
 }
@@ -6,6 +6,7 @@
 #include <sys/types.h>
 
 #include "io.h"
+#include "strset.h"
 
 #define GIL_TRACER_NAME "lexer"
 #include "trace.h"
@@ -96,7 +97,7 @@ void gil_token_free(struct gil_token *tok) {
 		kind == GIL_TOK_STRING || 
 		kind == GIL_TOK_IDENT ||
 		kind == GIL_TOK_IDENT_EQ;
-	if (large_tok && !gil_token_is_small(tok)) {
+	if (large_tok && !gil_token_is_small(tok) && !gil_token_is_atom(tok)) {
 		free(tok->v.str);
 	}
 }
@@ -116,12 +117,18 @@ const char *gil_token_get_str(struct gil_token_value *val) {
 }
 
 void gil_lexer_init(struct gil_lexer *lexer, struct gil_io_reader *r) {
+	gil_lexer_init_with_atoms(lexer, r, NULL);
+}
+
+void gil_lexer_init_with_atoms(
+		struct gil_lexer *lexer, struct gil_io_reader *r, struct gil_strset *atoms) {
 	lexer->toks[0].v.flags = GIL_TOK_EOF,
 	lexer->tokidx = 0;
 	lexer->line = 1;
 	lexer->ch = 1;
 	lexer->parens = 0;
 	lexer->prev_tok_is_expr = 0;
+	lexer->atoms = atoms;
 	gil_bufio_reader_init(&lexer->reader, r);
 }
 
@@ -536,6 +543,77 @@ static void read_ident(struct gil_lexer *lexer, struct gil_token *tok) {
 	}
 }
 
+static void set_atom(
+		struct gil_lexer *lexer, struct gil_token *tok,
+		enum gil_token_kind kind, size_t id) {
+	tok->v.flags = kind | GIL_TOK_ATOM;
+	tok->v.atom = (gil_word)id;
+	tok->v.str = (char *)gil_strset_name(lexer->atoms, id, NULL);
+}
+
+// Like read_ident, but interns the identifier in the lexer's atom set,
+// hashing it while it's being read. Only identifiers which don't fit
+// on the stack need any memory of their own, and only until they're interned.
+static void read_atom_ident(struct gil_lexer *lexer, struct gil_token *tok) {
+	char buf[64];
+	char *dest = buf;
+	size_t size = sizeof(buf);
+	size_t idx = 0;
+
+	struct gil_strset_hasher hasher;
+	gil_strset_hasher_init(&hasher);
+
+	while (1) {
+		int ch = peek_ch(lexer);
+		if (!is_ident(ch)) {
+			break;
+		}
+
+		dest[idx++] = (char)read_ch(lexer);
+		gil_strset_hasher_add(&hasher, (unsigned char)ch);
+
+		if (idx >= size) {
+			char *newbuf;
+			size *= 2;
+			if (dest == buf) {
+				newbuf = malloc(size);
+				if (newbuf != NULL) {
+					memcpy(newbuf, buf, idx);
+				}
+			} else {
+				newbuf = realloc(dest, size);
+			}
+
+			if (newbuf == NULL) {
+				if (dest != buf) {
+					free(dest);
+				}
+				tok->v.flags = GIL_TOK_ERROR;
+				tok->v.str = "Allocation failure";
+				return;
+			}
+
+			dest = newbuf;
+		}
+	}
+
+	if (idx == 1 && dest[0] == '=') {
+		tok->v.flags = GIL_TOK_EQUALS;
+	} else if (is_ident_eq(dest, idx)) {
+		// 'foo=' is a special IDENT_EQ token, named 'foo',
+		// so the hash doesn't apply
+		set_atom(lexer, tok, GIL_TOK_IDENT_EQ,
+				gil_strset_put_copy_n(lexer->atoms, dest, idx - 1));
+	} else {
+		set_atom(lexer, tok, GIL_TOK_IDENT, gil_strset_put_hashed(
+				lexer->atoms, dest, idx, gil_strset_hasher_finish(&hasher)));
+	}
+
+	if (dest != buf) {
+		free(dest);
+	}
+}
+
 static void read_tok(struct gil_lexer *lexer, struct gil_token *tok) {
 	tok->line = lexer->line;
 	tok->ch = lexer->ch;
@@ -648,8 +726,13 @@ static void read_tok(struct gil_lexer *lexer, struct gil_token *tok) {
 		// Treat '||' as an identifier
 		if (peek_ch(lexer) == '|') {
 			read_ch(lexer);
-			tok->v.flags = GIL_TOK_IDENT | GIL_TOK_SMALL;
-			strcpy(tok->v.strbuf, "||");
+			if (lexer->atoms) {
+				set_atom(lexer, tok, GIL_TOK_IDENT,
+						gil_strset_put_copy_n(lexer->atoms, "||", 2));
+			} else {
+				tok->v.flags = GIL_TOK_IDENT | GIL_TOK_SMALL;
+				strcpy(tok->v.strbuf, "||");
+			}
 			lexer->prev_tok_is_expr = 1;
 		} else {
 			tok->v.flags = GIL_TOK_PIPE;
@@ -677,9 +760,14 @@ static void read_tok(struct gil_lexer *lexer, struct gil_token *tok) {
 				break;
 			}
 
+			lexer->prev_tok_is_expr = 1;
+			if (lexer->atoms) {
+				read_atom_ident(lexer, tok);
+				break;
+			}
+
 			tok->v.flags = GIL_TOK_IDENT;
 			read_ident(lexer, tok);
-			lexer->prev_tok_is_expr = 1;
 
 			if (gil_token_is_small(tok) && strcmp(tok->v.strbuf, "=") == 0) {
 				tok->v.flags = GIL_TOK_EQUALS;
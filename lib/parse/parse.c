@@ -10,19 +10,30 @@
 #define GIL_TRACER_NAME "parser"
 #include "trace.h"
 
-// Convenience macro to automatically call _copy or non-_copy versions of
-// gil_gen_* functions, based on whether the token value is an SSO token or not.
+// Convenience macro to automatically call _id, _copy or non-_copy versions of
+// gil_gen_* functions, based on whether the token value is an interned atom,
+// an SSO token or neither.
 #define GIL_GEN(name, gen, val) \
-	((val).flags & GIL_TOK_SMALL \
+	((val).flags & GIL_TOK_ATOM \
+	? gil_gen_ ## name ## _id(gen, (val).atom) \
+	: (val).flags & GIL_TOK_SMALL \
 	? gil_gen_ ## name ## _copy(gen, (val).strbuf) \
 	: gil_gen_ ## name(gen, &(val).str))
 
 // Like GIL_GEN, but with another parameter.
 #define GIL_GEN2(name, gen, param, val) \
-	((val).flags & GIL_TOK_SMALL \
+	((val).flags & GIL_TOK_ATOM \
+	? gil_gen_ ## name ## _id(gen, (param), (val).atom) \
+	: (val).flags & GIL_TOK_SMALL \
 	? gil_gen_ ## name ## _copy(gen, (param), (val).strbuf) \
 	: gil_gen_ ## name(gen, (param), &(val).str))
 
+// Like GIL_GEN, but leaves the token value alone, so that it can be used again.
+#define GIL_GEN_KEEP(name, gen, val) \
+	((val).flags & GIL_TOK_ATOM \
+	? gil_gen_ ## name ## _id(gen, (val).atom) \
+	: gil_gen_ ## name ## _copy(gen, gil_token_value_str(val)))
+
 static int tok_is_end(struct gil_token *tok) {
 	enum gil_token_kind kind = gil_token_get_kind(tok);
 	return
@@ -68,7 +79,7 @@ static int import_callback(struct gil_io_reader *reader, void *ptr, int depth) {
 	struct gil_lexer *old_lexer = ctx->lexer;
 
 	struct gil_lexer lexer;
-	gil_lexer_init(&lexer, reader);
+	gil_lexer_init_with_atoms(&lexer, reader, &ctx->gen->atomset);
 	ctx->lexer = &lexer;
 
 	int ret = parse_program(ctx, depth + 1);
@@ -445,7 +456,11 @@ static int parse_arg_level_expression_base(struct gil_parse_context *ctx, int de
 		gil_trace("string '%s'", gil_token_get_str(&tok->v));
 		struct gil_token_value str = gil_token_extract_val(tok);
 		gil_lexer_consume(ctx->lexer); // string
-		GIL_GEN(string, ctx->gen, str);
+		if (str.flags & GIL_TOK_SMALL) {
+			gil_gen_string_copy(ctx->gen, str.strbuf);
+		} else {
+			gil_gen_string(ctx->gen, &str.str);
+		}
 	} else if (
 			gil_token_get_kind(tok) == GIL_TOK_QUOT &&
 			gil_token_get_kind(tok2) == GIL_TOK_IDENT) {
@@ -597,8 +612,7 @@ static int parse_arg_level_expression(struct gil_parse_context *ctx, int depth)
 
 			// Left-hand side
 			gil_gen_dup(ctx->gen); // Get namespace
-			gil_gen_namespace_lookup_copy(
-				ctx->gen, gil_token_value_str(ident));
+			GIL_GEN_KEEP(namespace_lookup, ctx->gen, ident);
 
 			// Function
 			GIL_GEN(stack_frame_lookup, ctx->gen, func);
@@ -799,8 +813,7 @@ static int parse_expression(struct gil_parse_context *ctx, int depth) {
 		gil_lexer_consume(ctx->lexer); // foo=
 
 		// Left-hand side
-		gil_gen_stack_frame_lookup_copy(
-			ctx->gen, gil_token_value_str(ident));
+		GIL_GEN_KEEP(stack_frame_lookup, ctx->gen, ident);
 
 		// Function
 		GIL_GEN(stack_frame_lookup, ctx->gen, func);
@@ -851,6 +864,12 @@ static int parse_program(struct gil_parse_context *ctx, int depth) {
 }
 
 int gil_parse_program(struct gil_parse_context *ctx) {
+	// Identifiers are interned straight into the generator's atom set,
+	// unless the lexer has been given a set of its own
+	if (ctx->lexer->atoms == NULL) {
+		ctx->lexer->atoms = &ctx->gen->atomset;
+	}
+
 	if (parse_program(ctx, 0) < 0) {
 		return -1;
 	}
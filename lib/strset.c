@@ -1,124 +1,201 @@
 #include "strset.h"
 
+#include <stdint.h>
 #include <string.h>
 
-// sdbm from http://www.cse.yorku.ca/~oz/hash.html;
-// there are probably better algorithms out there
-static size_t hash(const void *ptr) {
-	const unsigned char *str = ptr;
-	size_t h = 0;
-	int c;
+// Little-endian, so that whole blocks hash the same as a gil_strset_hasher
+// which sees the bytes one at a time
+static uint64_t read_u64(const unsigned char *ptr, size_t len) {
+	uint64_t v = 0;
+	for (size_t i = 0; i < len; ++i) {
+		v |= (uint64_t)ptr[i] << (i * 8);
+	}
+	return v;
+}
+
+// The final mix is from MurmurHash3, so that the low bits are usable
+// as an index
+static size_t finish(uint64_t h, uint64_t tail, size_t len) {
+	h = ((h ^ tail) * UINT64_C(0xe7037ed1a0b428db)) ^ len;
+	h ^= h >> 33;
+	h *= UINT64_C(0xff51afd7ed558ccd);
+	h ^= h >> 33;
+	h *= UINT64_C(0xc4ceb9fe1a85ec53);
+	h ^= h >> 33;
+	return (size_t)h;
+}
 
-	while ((c = *(str++)) != 0) {
-		h = c + (h << 6) + (h << 16) - h;
+// Multiply and fold, 8 bytes at a time, in the style of wyhash
+size_t gil_strset_hash(const char *str, size_t len) {
+	const unsigned char *ptr = (const unsigned char *)str;
+	uint64_t h = GIL_STRSET_HASH_SEED;
+	size_t left = len;
+	while (left >= 8) {
+		h = gil_strset_hash_fold(h, read_u64(ptr, 8));
+		ptr += 8;
+		left -= 8;
 	}
 
-	return h;
+	return finish(h, read_u64(ptr, left), len);
 }
 
-void grow(struct gil_strset *set) {
-	struct gil_strset old = *set;
-	set->len = 0;
-	set->size *= 2;
-	set->mask = (set->mask << 1) | set->mask;
+size_t gil_strset_hasher_finish(struct gil_strset_hasher *hasher) {
+	return finish(hasher->h, hasher->tail, hasher->len);
+}
+
+// Rehashing only needs the stored hashes, not the strings.
+// If the new table can't be allocated, the old one is left as it is.
+static int grow(struct gil_strset *set) {
+	struct gil_strset_slot *slots = gil_allocator_calloc(
+			set->alloc, set->size * 2, sizeof(*set->slots));
+	if (slots == NULL) {
+		return -1;
+	}
 
-	set->keys = calloc(set->size, sizeof(*set->keys));
-	set->vals = calloc(set->size, sizeof(*set->vals));
+	struct gil_strset_slot *oldslots = set->slots;
+	size_t oldsize = set->size;
+	set->size *= 2;
+	set->mask = set->size - 1;
+	set->slots = slots;
 
-	for (size_t i = 0; i < old.size; ++i) {
-		char *oldkey = old.keys[i];
-		if (oldkey == NULL) {
+	for (size_t i = 0; i < oldsize; ++i) {
+		if (oldslots[i].id == 0) {
 			continue;
 		}
 
-		size_t h = hash(old.keys[i]);
-		for (size_t j = 0; ; ++j) {
-			size_t index = (h + j) & set->mask;
-			char *k = set->keys[index];
-			if (k != NULL) {
-				continue;
-			}
-
-			set->keys[index] = oldkey;
-			set->vals[index] = old.vals[i];
-			break;
+		size_t index = oldslots[i].hash & set->mask;
+		while (set->slots[index].id != 0) {
+			index = (index + 1) & set->mask;
 		}
+
+		set->slots[index] = oldslots[i];
 	}
 
-	free(old.keys);
-	free(old.vals);
+	gil_allocator_free(set->alloc, oldslots);
+	return 0;
 }
 
 void gil_strset_init(struct gil_strset *set) {
+	gil_strset_init_with_allocator(set, &gil_default_allocator);
+}
+
+void gil_strset_init_with_allocator(struct gil_strset *set, struct gil_allocator *alloc) {
+	set->alloc = alloc;
 	set->next = 1;
 	set->len = 0;
 	set->size = 16;
 	set->mask = 0x0f;
-	set->keys = calloc(set->size, sizeof(*set->keys));
-	set->vals = calloc(set->size, sizeof(*set->vals));
+	set->slots = gil_allocator_calloc(alloc, set->size, sizeof(*set->slots));
+	set->namessize = 8;
+	set->names = gil_allocator_alloc(alloc, set->namessize * sizeof(*set->names));
+	gil_arena_init_with_allocator(&set->arena, alloc);
 }
 
 void gil_strset_free(struct gil_strset *set) {
-	for (size_t i = 0; i < set->size; ++i) {
-		free(set->keys[i]);
-	}
-
-	free(set->keys);
-	free(set->vals);
+	gil_allocator_free(set->alloc, set->slots);
+	gil_allocator_free(set->alloc, set->names);
+	gil_arena_free(&set->arena);
 }
 
-size_t gil_strset_put(struct gil_strset *set, char **str) {
-	if (set->len >= set->size / 2) {
-		grow(set);
-	}
+// Find the slot for a string: either the one which has it, or the empty slot
+// where it would go
+static struct gil_strset_slot *find(
+		struct gil_strset *set, const char *str, size_t len, size_t h) {
+	for (size_t index = h & set->mask; ; index = (index + 1) & set->mask) {
+		struct gil_strset_slot *slot = &set->slots[index];
+		if (slot->id == 0) {
+			return slot;
+		}
 
-	size_t h = hash(*str);
-	for (size_t i = 0; ; ++i) {
-		size_t index = (h + i) & set->mask;
-		char *k = set->keys[index];
-		if (k == NULL) {
-			set->keys[index] = *str;
-			set->vals[index] = set->next++;
-			set->len += 1;
-			*str = NULL;
-			return set->vals[index];
-		} else if (strcmp(*str, k) == 0) {
-			free(*str);
-			*str = NULL;
-			return set->vals[index];
+		if (slot->hash == h && slot->len == len && memcmp(slot->str, str, len) == 0) {
+			return slot;
 		}
 	}
 }
 
-size_t gil_strset_put_copy(struct gil_strset *set, const char *str) {
-	if (set->len >= set->size / 2) {
-		grow(set);
+size_t gil_strset_put_hashed(
+		struct gil_strset *set, const char *str, size_t len, size_t h) {
+	if (set->len >= set->size / 2 && grow(set) < 0) {
+		return 0;
+	}
+
+	struct gil_strset_slot *slot = find(set, str, len, h);
+	if (slot->id != 0) {
+		return slot->id;
 	}
 
-	size_t h = hash(str);
-	for (size_t i = 0; ; ++i) {
-		size_t index = (h + i) & set->mask;
-		char *k = set->keys[index];
-		if (k == NULL) {
-			set->keys[index] = strdup(str);
-			set->vals[index] = set->next++;
-			set->len += 1;
-			return set->vals[index];
-		} else if (strcmp(str, k) == 0) {
-			return set->vals[index];
+	if (set->next > set->namessize) {
+		struct gil_strset_name *names = gil_allocator_realloc(
+				set->alloc, set->names, set->namessize * 2 * sizeof(*set->names));
+		if (names == NULL) {
+			return 0;
 		}
+
+		set->names = names;
+		set->namessize *= 2;
 	}
+
+	char *copy = gil_arena_alloc(&set->arena, len + 1);
+	if (copy == NULL) {
+		return 0;
+	}
+
+	memcpy(copy, str, len);
+	copy[len] = '\0';
+	set->names[set->next - 1].str = copy;
+	set->names[set->next - 1].len = len;
+
+	slot->hash = h;
+	slot->str = copy;
+	slot->len = len;
+	slot->id = set->next++;
+	set->len += 1;
+	return slot->id;
+}
+
+size_t gil_strset_put_copy_n(struct gil_strset *set, const char *str, size_t len) {
+	return gil_strset_put_hashed(set, str, len, gil_strset_hash(str, len));
+}
+
+size_t gil_strset_put(struct gil_strset *set, char **str) {
+	size_t id = gil_strset_put_copy_n(set, *str, strlen(*str));
+	gil_allocator_free(set->alloc, *str);
+	*str = NULL;
+	return id;
+}
+
+size_t gil_strset_put_copy(struct gil_strset *set, const char *str) {
+	return gil_strset_put_copy_n(set, str, strlen(str));
+}
+
+size_t gil_strset_get_n(struct gil_strset *set, const char *str, size_t len) {
+	return find(set, str, len, gil_strset_hash(str, len))->id;
 }
 
 size_t gil_strset_get(struct gil_strset *set, const char *str) {
-	size_t h = hash(str);
-	for (size_t i = 0; ; ++i) {
-		size_t index = (h + i) & set->mask;
-		char *k = set->keys[index];
-		if (k == NULL) {
-			return 0;
-		} else if (strcmp(str, k) == 0) {
-			return set->vals[index];
+	return gil_strset_get_n(set, str, strlen(str));
+}
+
+int gil_strset_extend(struct gil_strset *set, struct gil_strset *from) {
+	for (size_t id = set->next; id < from->next; ++id) {
+		struct gil_strset_name *name = &from->names[id - 1];
+		if (gil_strset_put_copy_n(set, name->str, name->len) != id) {
+			return -1;
 		}
 	}
+
+	return 0;
+}
+
+const char *gil_strset_name(struct gil_strset *set, size_t id, size_t *len) {
+	if (id == 0 || id >= set->next) {
+		return NULL;
+	}
+
+	struct gil_strset_name *name = &set->names[id - 1];
+	if (len != NULL) {
+		*len = name->len;
+	}
+
+	return name->str;
 }
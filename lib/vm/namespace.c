@@ -1,88 +1,522 @@
 #include "vm/vm.h"
 
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "bytecode.h"
 
-static const gil_word tombstone = ~(gil_word)0;
+// Namespaces with more keys than this are always hash tables
+#ifndef GIL_VM_SHAPE_MAX_KEYS
+#define GIL_VM_SHAPE_MAX_KEYS 16
+#endif
 
-static struct gil_vm_namespace *set(struct gil_vm_namespace *ns, gil_word key, gil_word val);
+// A shape which has been extended in this many different ways
+// isn't extended any further; namespaces which would need
+// another transition become hash tables instead
+#ifndef GIL_VM_SHAPE_MAX_CHILDREN
+#define GIL_VM_SHAPE_MAX_CHILDREN 8
+#endif
 
-static struct gil_vm_namespace *alloc(size_t size, gil_word mask) {
-	struct gil_vm_namespace *ns = calloc(
-			1, sizeof(struct gil_vm_namespace) + sizeof(gil_word) * size * 2);
+static const gil_word notfound = ~(gil_word)0;
+
+// Shapes are allocated from the VM's arena, and live until the VM is freed.
+static struct gil_vm_shape *alloc_shape(
+		struct gil_vm *vm, struct gil_vm_shape *parent, gil_word key) {
+	gil_word len = parent == NULL ? 0 : parent->len + 1;
+	struct gil_vm_shape *shape = gil_vm_malloc(
+			vm, sizeof(struct gil_vm_shape) + len * sizeof(gil_word));
+	if (shape == NULL) {
+		return NULL;
+	}
+
+	shape->children = NULL;
+	shape->next = NULL;
+	shape->nchildren = 0;
+	shape->len = len;
+	if (parent != NULL) {
+		memcpy(shape->keys, parent->keys, parent->len * sizeof(gil_word));
+		shape->keys[parent->len] = key;
+		shape->next = parent->children;
+		parent->children = shape;
+		parent->nchildren += 1;
+	}
+
+	return shape;
+}
+
+// The shape with 'key' added to 'shape', or NULL if there shouldn't be one
+static struct gil_vm_shape *shape_add(
+		struct gil_vm *vm, struct gil_vm_shape *shape, gil_word key) {
+	if (shape->len >= GIL_VM_SHAPE_MAX_KEYS) {
+		return NULL;
+	}
+
+	for (struct gil_vm_shape *child = shape->children; child != NULL; child = child->next) {
+		if (child->keys[shape->len] == key) {
+			return child;
+		}
+	}
+
+	if (shape->nchildren >= GIL_VM_SHAPE_MAX_CHILDREN) {
+		return NULL;
+	}
+
+	return alloc_shape(vm, shape, key);
+}
+
+static gil_word shape_find(struct gil_vm_shape *shape, gil_word key) {
+	for (gil_word i = 0; i < shape->len; ++i) {
+		if (shape->keys[i] == key) {
+			return i;
+		}
+	}
+
+	return notfound;
+}
+
+static struct gil_vm_namespace *alloc_shaped(
+		struct gil_vm *vm, struct gil_vm_shape *shape, gil_word size) {
+	struct gil_vm_namespace *ns = gil_vm_malloc(
+			vm, sizeof(struct gil_vm_namespace) + sizeof(gil_word) * size);
+	if (ns == NULL) {
+		return NULL;
+	}
+
+	memset(ns, 0, sizeof(*ns));
+	ns->shape = shape;
 	ns->size = size;
-	ns->mask = mask;
 	return ns;
 }
 
-static struct gil_vm_namespace *grow(struct gil_vm_namespace *ns) {
-	struct gil_vm_namespace *newns = alloc(ns->size * 2, (ns->mask << 1) | ns->mask);
+// Hash tables are laid out like CPython's dicts: room for capacity(size)
+// entries, which are key/value pairs kept in insertion order, followed by
+// 'size' index slots of 1, 2 or 4 bytes, whichever is enough to hold
+// an entry's index. An index slot is EMPTY, DUMMY (its entry has been
+// deleted), or the index of an entry. A deleted entry leaves a hole
+// with a key of 0 until the table is rebuilt.
+#define EMPTY (-1)
+#define DUMMY (-2)
+
+// There's room for an entry per two index slots, which keeps probes short
+static gil_word capacity(gil_word size) {
+	return size / 2;
+}
+
+static size_t index_width(gil_word size) {
+	if (capacity(size) <= 128) {
+		return 1;
+	} else if (capacity(size) <= 32768) {
+		return 2;
+	} else {
+		return 4;
+	}
+}
+
+// The entries take up 'size' words, so the index starts right after them
+static void *index_ptr(struct gil_vm_namespace *ns) {
+	return ns->data + ns->size;
+}
+
+static int32_t index_at(const void *index, size_t width, gil_word slot) {
+	switch (width) {
+	case 1: return ((const int8_t *)index)[slot];
+	case 2: return ((const int16_t *)index)[slot];
+	default: return ((const int32_t *)index)[slot];
+	}
+}
+
+static int32_t index_get(struct gil_vm_namespace *ns, gil_word slot) {
+	return index_at(index_ptr(ns), index_width(ns->size), slot);
+}
+
+static void index_set(struct gil_vm_namespace *ns, gil_word slot, int32_t ix) {
+	void *index = index_ptr(ns);
+	switch (index_width(ns->size)) {
+	case 1: ((int8_t *)index)[slot] = (int8_t)ix; break;
+	case 2: ((int16_t *)index)[slot] = (int16_t)ix; break;
+	default: ((int32_t *)index)[slot] = ix; break;
+	}
+}
+
+static size_t table_bytes(gil_word size) {
+	return
+		sizeof(struct gil_vm_namespace) + capacity(size) * 2 * sizeof(gil_word) +
+		size * index_width(size);
+}
+
+size_t gil_vm_namespace_bytes(struct gil_vm_namespace *ns) {
+	if (ns->shape != NULL) {
+		return sizeof(struct gil_vm_namespace) + ns->size * sizeof(gil_word);
+	}
+
+	return table_bytes(ns->size);
+}
+
+// Atom IDs are handed out sequentially, so they're spread out over the table
+// (Fibonacci hashing) to keep them from forming long clusters
+// under linear probing
+static gil_word hash(struct gil_vm_namespace *ns, gil_word key) {
+	return (gil_word)(key * UINT32_C(0x9e3779b9)) >> ns->shift;
+}
+
+// Find the entry for a key, and the index slot pointing to it.
+// If there's no entry, -1 is returned, with the EMPTY slot
+// which ended the search in 'slot'.
+// The probe loop is written once per index width, so that the width
+// isn't looked at again for every slot.
+static inline int32_t find_width(
+		struct gil_vm_namespace *ns, size_t width, gil_word key, gil_word *slot) {
+	gil_word *entries = ns->data;
+	void *index = index_ptr(ns);
+	for (gil_word idx = hash(ns, key); ; idx = (idx + 1) & ns->mask) {
+		int32_t ix = index_at(index, width, idx);
+		if (ix == EMPTY) {
+			*slot = idx;
+			return -1;
+		} else if (ix >= 0 && entries[ix * 2] == key) {
+			*slot = idx;
+			return ix;
+		}
+	}
+}
+
+static inline int32_t find(struct gil_vm_namespace *ns, gil_word key, gil_word *slot) {
+	switch (index_width(ns->size)) {
+	case 1: return find_width(ns, 1, key, slot);
+	case 2: return find_width(ns, 2, key, slot);
+	default: return find_width(ns, 4, key, slot);
+	}
+}
+
+int gil_vm_namespace_check(struct gil_vm_namespace *ns, size_t bytes, size_t valueslen) {
+	if (bytes < sizeof(*ns) || ns->shape != NULL) {
+		return -1;
+	}
+
+	// The size has to be a power of two, with a mask and shift to match
+	gil_word size = ns->size;
+	if (size < 2 || (size & (size - 1)) != 0 || size > ((gil_word)1 << 30)) {
+		return -1;
+	}
+
+	gil_word shift = 32;
+	for (gil_word s = size; s > 1; s /= 2) {
+		shift -= 1;
+	}
+
+	if (ns->mask != size - 1 || ns->shift != shift || table_bytes(size) > bytes) {
+		return -1;
+	}
+
+	if (ns->len > capacity(size) || ns->tombs > capacity(size) - ns->len) {
+		return -1;
+	}
+
+	gil_word *entries = ns->data;
+	gil_word used = ns->len + ns->tombs;
+	gil_word holes = 0;
+	for (gil_word i = 0; i < used; ++i) {
+		if (entries[i * 2] == 0) {
+			holes += 1;
+		} else if (entries[i * 2 + 1] >= valueslen) {
+			return -1;
+		}
+	}
+
+	// Lookups stop at the first EMPTY slot, so there must be one
+	gil_word empty = 0, dummies = 0;
+	for (gil_word i = 0; i < size; ++i) {
+		int32_t ix = index_get(ns, i);
+		if (ix == EMPTY) {
+			empty += 1;
+		} else if (ix == DUMMY) {
+			dummies += 1;
+		} else if (ix < 0 || (gil_word)ix >= used) {
+			return -1;
+		}
+	}
 
-	for (size_t i = 0; i < ns->size; ++i) {
-		gil_word key = ns->data[i];
-		if (key == 0 || key == tombstone) {
+	if (holes != ns->tombs || dummies != ns->tombs || empty == 0) {
+		return -1;
+	}
+
+	// Every live entry has to be found through the one slot pointing to it
+	gil_word live = 0;
+	for (gil_word i = 0; i < size; ++i) {
+		int32_t ix = index_get(ns, i);
+		if (ix < 0) {
 			continue;
 		}
 
-		gil_word val = ns->data[ns->size + i];
-		for (gil_word i = 0; ; ++i) {
-			gil_word hash = (key + i) & newns->mask;
-			if (newns->data[hash] == 0) {
-				newns->data[hash] = key;
-				newns->data[newns->size + hash] = val;
-				newns->len += 1;
-				break;
-			}
+		gil_word key = entries[ix * 2];
+		gil_word slot;
+		if (key == 0 || find(ns, key, &slot) != ix || slot != i) {
+			return -1;
 		}
+
+		live += 1;
 	}
 
-	free(ns);
-	return newns;
+	return live == ns->len ? 0 : -1;
 }
 
-static void del(struct gil_vm_namespace *ns, gil_word key) {
+static struct gil_vm_namespace *alloc(struct gil_vm *vm, gil_word size) {
+	struct gil_vm_namespace *ns = gil_vm_malloc(vm, table_bytes(size));
 	if (ns == NULL) {
-		return;
+		return NULL;
 	}
 
-	for (gil_word i = 0; ; ++i) {
-		gil_word hash = (key + i) & ns->mask;
-		gil_word k = ns->data[hash];
-		if (k == 0) {
-			return;
-		} else if (k == key) {
-			ns->data[hash] = tombstone;
-			return;
+	memset(ns, 0, table_bytes(size));
+	ns->size = size;
+	memset(index_ptr(ns), 0xff, size * index_width(size)); // EMPTY in every width
+	ns->mask = size - 1;
+	ns->shift = 32;
+	while (size > 1) {
+		ns->shift -= 1;
+		size /= 2;
+	}
+	return ns;
+}
+
+// Append an entry for a key which isn't in the table yet,
+// with 'slot' the EMPTY slot its search ended at.
+// There has to be room for it.
+static void insert_at(
+		struct gil_vm_namespace *ns, gil_word slot, gil_word key, gil_word val) {
+	gil_word ix = ns->len + ns->tombs;
+	ns->data[ix * 2] = key;
+	ns->data[ix * 2 + 1] = val;
+	index_set(ns, slot, (int32_t)ix);
+	ns->len += 1;
+}
+
+// Find the first EMPTY slot for a key, without looking at the entries,
+// for when the table is being rebuilt and the key can't be in it yet
+static inline gil_word find_empty_width(
+		struct gil_vm_namespace *ns, size_t width, gil_word key) {
+	void *index = index_ptr(ns);
+	gil_word idx = hash(ns, key);
+	while (index_at(index, width, idx) != EMPTY) {
+		idx = (idx + 1) & ns->mask;
+	}
+
+	return idx;
+}
+
+static gil_word find_empty(struct gil_vm_namespace *ns, gil_word key) {
+	switch (index_width(ns->size)) {
+	case 1: return find_empty_width(ns, 1, key);
+	case 2: return find_empty_width(ns, 2, key);
+	default: return find_empty_width(ns, 4, key);
+	}
+}
+
+static void insert(struct gil_vm_namespace *ns, gil_word key, gil_word val) {
+	insert_at(ns, find_empty(ns, key), key, val);
+}
+
+// Squeeze the holes out of the entries and rebuild the index, in place.
+// Entries only ever move towards the start, so they can be
+// inserted again as they're walked.
+static void compact(struct gil_vm_namespace *ns) {
+	gil_word used = ns->len + ns->tombs;
+	ns->len = 0;
+	ns->tombs = 0;
+	memset(index_ptr(ns), 0xff, ns->size * index_width(ns->size));
+
+	for (gil_word i = 0; i < used; ++i) {
+		gil_word key = ns->data[i * 2];
+		if (key != 0) {
+			insert(ns, key, ns->data[i * 2 + 1]);
 		}
 	}
+
+	memset(&ns->data[ns->len * 2], 0, (used - ns->len) * 2 * sizeof(gil_word));
 }
 
-static struct gil_vm_namespace *set(struct gil_vm_namespace *ns, gil_word key, gil_word val) {
+// Move all the entries into a new table of 'size' slots, leaving the holes behind.
+// Returns NULL, and leaves 'ns' as it is, if the new table can't be allocated;
+// the same goes for the other functions which replace a namespace.
+static struct gil_vm_namespace *resize(
+		struct gil_vm *vm, struct gil_vm_namespace *ns, gil_word size) {
+	struct gil_vm_namespace *newns = alloc(vm, size);
+	if (newns == NULL) {
+		return NULL;
+	}
+
+	for (gil_word i = 0; i < ns->len + ns->tombs; ++i) {
+		gil_word key = ns->data[i * 2];
+		if (key != 0) {
+			insert(newns, key, ns->data[i * 2 + 1]);
+		}
+	}
+
+	gil_vm_dealloc(vm, ns);
+	return newns;
+}
+
+// Make room in a full table. It gets room for twice the entries it has left,
+// so that a table which keeps losing and gaining entries isn't rebuilt
+// too often. Tables never shrink, so if there's enough room once the holes
+// are gone, it's compacted in place.
+static struct gil_vm_namespace *rebuild(struct gil_vm *vm, struct gil_vm_namespace *ns) {
+	gil_word size = ns->size;
+	while (capacity(size) < ns->len * 2) {
+		size *= 2;
+	}
+
+	if (size == ns->size) {
+		compact(ns);
+		return ns;
+	}
+
+	return resize(vm, ns, size);
+}
+
+// Turn a shaped namespace into a hash table with room for one more entry
+static struct gil_vm_namespace *unshape(struct gil_vm *vm, struct gil_vm_namespace *ns) {
+	gil_word size = 16;
+	while (capacity(size) < ns->len + 1) {
+		size *= 2;
+	}
+
+	struct gil_vm_namespace *newns = alloc(vm, size);
+	if (newns == NULL) {
+		return NULL;
+	}
+
+	for (gil_word i = 0; i < ns->len; ++i) {
+		insert(newns, ns->shape->keys[i], ns->data[i]);
+	}
+
+	gil_vm_dealloc(vm, ns);
+	return newns;
+}
+
+static struct gil_vm_namespace *del(
+		struct gil_vm *vm, struct gil_vm_namespace *ns, gil_word key) {
+	// Shapes only ever grow, so deleting from a shaped namespace
+	// turns it into a hash table
+	if (ns->shape != NULL) {
+		if (shape_find(ns->shape, key) == notfound) {
+			return ns;
+		}
+
+		ns = unshape(vm, ns);
+		if (ns == NULL) {
+			return NULL;
+		}
+	}
+
+	gil_word slot;
+	int32_t ix = find(ns, key, &slot);
+	if (ix < 0) {
+		return ns;
+	}
+
+	ns->data[ix * 2] = 0;
+	ns->data[ix * 2 + 1] = 0;
+	index_set(ns, slot, DUMMY);
+	ns->len -= 1;
+	ns->tombs += 1;
+
+	// Once it's empty, it can start over without rebuilding anything
+	if (ns->len == 0) {
+		memset(ns->data, 0, ns->tombs * 2 * sizeof(gil_word));
+		memset(index_ptr(ns), 0xff, ns->size * index_width(ns->size));
+		ns->tombs = 0;
+	}
+
+	return ns;
+}
+
+// Add a key to a shaped namespace. Returns NULL if it has to become
+// a hash table instead, which is also the way out if the namespace
+// can't be allocated or grown: making the hash table will fail too.
+static struct gil_vm_namespace *set_shaped(
+		struct gil_vm *vm, struct gil_vm_namespace *ns, gil_word key, gil_word val) {
+	struct gil_vm_shape *shape;
 	if (ns == NULL) {
-		ns = alloc(16, 0x0f);
-	} else if (ns->len >= ns->size / 2) {
-		ns = grow(ns);
+		if (vm->shape_root == NULL) {
+			vm->shape_root = alloc_shape(vm, NULL, 0);
+			if (vm->shape_root == NULL) {
+				return NULL;
+			}
+		}
+
+		shape = shape_add(vm, vm->shape_root, key);
+		if (shape == NULL) {
+			return NULL;
+		}
+
+		ns = alloc_shaped(vm, shape, 4);
+		if (ns == NULL) {
+			return NULL;
+		}
+	} else {
+		shape = shape_add(vm, ns->shape, key);
+		if (shape == NULL) {
+			return NULL;
+		}
+
+		if (ns->len >= ns->size) {
+			struct gil_vm_namespace *newns = gil_vm_realloc(
+					vm, ns, sizeof(struct gil_vm_namespace) + sizeof(gil_word) * ns->size * 2);
+			if (newns == NULL) {
+				return NULL;
+			}
+
+			ns = newns;
+			ns->size *= 2;
+		}
 	}
 
-	for (gil_word i = 0; ; ++i) {
-		gil_word hash = (key + i) & ns->mask;
-		gil_word k = ns->data[hash];
-		if (k == tombstone) {
-			ns->data[hash] = key;
-			ns->data[ns->size + hash] = val;
-			break;
-		} else if (k == key) {
-			ns->data[ns->size + hash] = val;
-			break;
-		} else if (k == 0) {
-			ns->len += 1;
-			ns->data[hash] = key;
-			ns->data[ns->size + hash] = val;
-			break;
+	ns->shape = shape;
+	ns->data[ns->len++] = val;
+	return ns;
+}
+
+static struct gil_vm_namespace *set(
+		struct gil_vm *vm, struct gil_vm_namespace *ns, gil_word key, gil_word val) {
+	if (ns == NULL || ns->shape != NULL) {
+		if (ns != NULL) {
+			gil_word idx = shape_find(ns->shape, key);
+			if (idx != notfound) {
+				ns->data[idx] = val;
+				return ns;
+			}
+		}
+
+		struct gil_vm_namespace *newns = set_shaped(vm, ns, key, val);
+		if (newns != NULL) {
+			return newns;
+		}
+
+		ns = ns == NULL ? alloc(vm, 16) : unshape(vm, ns);
+		if (ns == NULL) {
+			return NULL;
 		}
+	} else {
+		gil_word slot;
+		int32_t ix = find(ns, key, &slot);
+		if (ix >= 0) {
+			ns->data[ix * 2 + 1] = val;
+			return ns;
+		} else if (ns->len + ns->tombs < capacity(ns->size)) {
+			insert_at(ns, slot, key, val);
+			return ns;
+		}
+
+		struct gil_vm_namespace *newns = rebuild(vm, ns);
+		if (newns == NULL) {
+			return NULL;
+		}
+
+		ns = newns;
 	}
 
+	insert(ns, key, val);
 	return ns;
 }
 
@@ -91,19 +525,120 @@ static gil_word get(struct gil_vm_namespace *ns, gil_word key) {
 		return 0;
 	}
 
-	for (gil_word i = 0; ; ++i) {
-		gil_word hash = (key + i) & ns->mask;
-		gil_word k = ns->data[hash];
-		if (k == 0 || k == tombstone) {
+	if (ns->shape != NULL) {
+		gil_word idx = shape_find(ns->shape, key);
+		return idx == notfound ? 0 : ns->data[idx];
+	}
+
+	gil_word slot;
+	int32_t ix = find(ns, key, &slot);
+	return ix < 0 ? 0 : ns->data[ix * 2 + 1];
+}
+
+void gil_vm_namespace_get_stats(
+		struct gil_vm_value *v, struct gil_vm_namespace_stats *stats) {
+	memset(stats, 0, sizeof(*stats));
+	if (v->flags & GIL_VAL_SBO) {
+		stats->len = 1;
+		stats->max_probes = 1;
+		stats->total_probes = 1;
+		return;
+	}
+
+	struct gil_vm_namespace *ns = v->ns.ns;
+	if (ns == NULL) {
+		return;
+	}
+
+	stats->len = ns->len;
+	stats->tombs = ns->tombs;
+	stats->size = ns->size;
+	stats->shaped = ns->shape != NULL;
+	if (ns->shape != NULL) {
+		stats->max_probes = ns->len;
+		stats->total_probes = (size_t)ns->len * (ns->len + 1) / 2;
+		return;
+	}
+
+	for (gil_word i = 0; i < ns->size; ++i) {
+		int32_t ix = index_get(ns, i);
+		if (ix < 0) {
+			continue;
+		}
+
+		gil_word key = ns->data[ix * 2];
+		size_t probes = ((i - hash(ns, key)) & ns->mask) + 1;
+		stats->total_probes += probes;
+		if (probes > stats->max_probes) {
+			stats->max_probes = probes;
+		}
+	}
+}
+
+int gil_vm_namespace_next(
+		struct gil_vm_value *v, gil_word *it, gil_word *key, gil_word *val) {
+	if (v->flags & GIL_VAL_SBO) {
+		if (*it > 0) {
 			return 0;
-		} else if (k == key) {
-			return ns->data[ns->size + hash];
 		}
+
+		*it = 1;
+		*key = v->ns.shortkey;
+		*val = v->ns.shortval;
+		return 1;
 	}
+
+	struct gil_vm_namespace *ns = v->ns.ns;
+	if (ns == NULL) {
+		return 0;
+	}
+
+	if (ns->shape != NULL) {
+		if (*it >= ns->len) {
+			return 0;
+		}
+
+		*key = ns->shape->keys[*it];
+		*val = ns->data[*it];
+		*it += 1;
+		return 1;
+	}
+
+	while (*it < ns->len + ns->tombs) {
+		gil_word i = (*it)++;
+		if (ns->data[i * 2] != 0) {
+			*key = ns->data[i * 2];
+			*val = ns->data[i * 2 + 1];
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+int gil_vm_namespace_unshape(struct gil_vm *vm, struct gil_vm_value *v) {
+	if (!(v->flags & GIL_VAL_SBO) && v->ns.ns != NULL && v->ns.ns->shape != NULL) {
+		struct gil_vm_namespace *ns = unshape(vm, v->ns.ns);
+		if (ns == NULL) {
+			return -1;
+		}
+
+		v->ns.ns = ns;
+	}
+
+	return 0;
+}
+
+gil_word gil_vm_namespace_get_own(struct gil_vm_value *v, gil_word key) {
+	if (v->flags & GIL_VAL_SBO) {
+		return v->ns.shortkey == key ? v->ns.shortval : 0;
+	}
+
+	return get(v->ns.ns, key);
 }
 
 gil_word gil_vm_namespace_get(struct gil_vm *vm, struct gil_vm_value *v, gil_word key) {
-	gil_word ret = get(v->ns.ns, key);
+	gil_word ret = gil_vm_namespace_get_own(v, key);
 	if (ret == 0 && v->ns.parent != 0) {
 		return gil_vm_namespace_get(vm, &vm->values[v->ns.parent], key);
 	}
@@ -121,23 +656,93 @@ gil_word gil_vm_namespace_get_or(
 	}
 }
 
-void gil_vm_namespace_set(struct gil_vm_value *v, gil_word key, gil_word val) {
-	if (val == 0) {
-		del(v->ns.ns, key);
+gil_word gil_vm_namespace_get_cached(
+		struct gil_vm *vm, struct gil_vm_value *v, gil_word key, gil_word site) {
+	if (!(v->flags & GIL_VAL_SBO) && v->ns.ns != NULL && v->ns.ns->shape != NULL) {
+		struct gil_vm_namespace *ns = v->ns.ns;
+		struct gil_vm_namespace_cache *cache =
+			&vm->nscache[site & (GIL_VM_NAMESPACE_CACHE_SIZE - 1)];
+		if (cache->shape == ns->shape && cache->key == key) {
+			return ns->data[cache->index];
+		}
+
+		gil_word idx = shape_find(ns->shape, key);
+		if (idx != notfound) {
+			cache->shape = ns->shape;
+			cache->key = key;
+			cache->index = idx;
+			return ns->data[idx];
+		}
 	} else {
-		v->ns.ns = set(v->ns.ns, key, val);
+		gil_word ret = gil_vm_namespace_get_own(v, key);
+		if (ret != 0) {
+			return ret;
+		}
 	}
+
+	if (v->ns.parent != 0) {
+		return gil_vm_namespace_get(vm, &vm->values[v->ns.parent], key);
+	}
+
+	return 0;
+}
+
+int gil_vm_namespace_set(
+		struct gil_vm *vm, struct gil_vm_value *v, gil_word key, gil_word val) {
+	struct gil_vm_namespace *ns;
+	if (v->flags & GIL_VAL_SBO) {
+		if (v->ns.shortkey == key && val == 0) {
+			v->flags &= ~GIL_VAL_SBO;
+			v->ns.ns = NULL;
+		} else if (v->ns.shortkey == key) {
+			v->ns.shortval = val;
+		} else if (val != 0) {
+			// A second key moves the entries out of line
+			ns = set(vm, NULL, v->ns.shortkey, v->ns.shortval);
+			if (ns == NULL) {
+				return -1;
+			}
+
+			v->flags &= ~GIL_VAL_SBO;
+			v->ns.ns = ns;
+			ns = set(vm, ns, key, val);
+			if (ns == NULL) {
+				return -1;
+			}
+
+			v->ns.ns = ns;
+		}
+	} else if (v->ns.ns == NULL) {
+		if (val != 0) {
+			v->flags |= GIL_VAL_SBO;
+			v->ns.shortkey = key;
+			v->ns.shortval = val;
+		}
+	} else {
+		ns = val == 0 ? del(vm, v->ns.ns, key) : set(vm, v->ns.ns, key, val);
+		if (ns == NULL) {
+			return -1;
+		}
+
+		v->ns.ns = ns;
+	}
+
+	return 0;
 }
 
 int gil_vm_namespace_replace(struct gil_vm *vm, struct gil_vm_value *v, gil_word key, gil_word val) {
 	if (val == 0) {
-		del(v->ns.ns, key);
-		return 0;
+		if (v->flags & GIL_VAL_CONST) {
+			return -2;
+		}
+
+		return gil_vm_namespace_set(vm, v, key, val) < 0 ? -3 : 0;
 	} else {
-		gil_word ret = get(v->ns.ns, key);
-		if (ret != 0) {
-			v->ns.ns = set(v->ns.ns, key, val);
-			return 0;
+		gil_word ret = gil_vm_namespace_get_own(v, key);
+		if (ret != 0 && (v->flags & GIL_VAL_CONST)) {
+			return -2;
+		} else if (ret != 0) {
+			return gil_vm_namespace_set(vm, v, key, val) < 0 ? -3 : 0;
 		}
 
 		if (v->ns.parent == 0) {
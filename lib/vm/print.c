@@ -79,29 +79,38 @@ void gil_vm_print_val(struct gil_io_writer *w, struct gil_vm_value *val) {
 		break;
 
 	case GIL_VAL_TYPE_BUFFER: {
-		if (val->buffer.buffer == NULL) {
+		gil_word len = gil_vm_buffer_length(val);
+		if (len == 0) {
 			gil_io_printf(w, "BUFFER, empty");
 			return;
 		}
 
-		gil_io_printf(w, "BUFFER, len %u", val->buffer.length);
-		for (size_t i = 0; i < val->buffer.length; ++i) {
-			gil_io_printf(w, "\n    %zu: %c", i, val->buffer.buffer[i]);
+		const char *data = gil_vm_buffer_data(val);
+		if (val->flags & GIL_VAL_SBO) {
+			gil_io_printf(w, "BUFFER, short, len %u", len);
+		} else {
+			gil_io_printf(w, "BUFFER, len %u", len);
+		}
+		for (size_t i = 0; i < len; ++i) {
+			gil_io_printf(w, "\n    %zu: %c", i, data[i]);
 		}
 	}
 		break;
 
 	case GIL_VAL_TYPE_NAMESPACE: {
-		if (val->ns.ns == NULL) {
+		if (val->flags & GIL_VAL_SBO) {
+			gil_io_printf(w, "NAMESPACE, len 1, parent %u", val->ns.parent);
+			gil_io_printf(w, "\n    %u: %u", val->ns.shortkey, val->ns.shortval);
+			break;
+		} else if (val->ns.ns == NULL) {
 			gil_io_printf(w, "NAMESPACE, empty, parent %u", val->ns.parent);
 			return;
 		}
 
-		gil_io_printf(w, "NAMESPACE, len %zu, parent %u", val->ns.ns->len, val->ns.parent);
-		for (size_t i = 0; i < val->ns.ns->size; ++i) {
-			gil_word key = val->ns.ns->data[i];
-			gil_word v = val->ns.ns->data[val->ns.ns->size + i];
-			if (key == 0 || key == ~(gil_word)0) continue;
+		gil_io_printf(w, "NAMESPACE, len %u, parent %u", val->ns.ns->len, val->ns.parent);
+		gil_word it = 0;
+		gil_word key, v;
+		while (gil_vm_namespace_next(val, &it, &key, &v)) {
 			gil_io_printf(w, "\n    %u: %u", key, v);
 		}
 	}
@@ -154,6 +163,11 @@ void gil_vm_print_state(struct gil_io_writer *w, struct gil_vm *vm) {
 
 void gil_vm_print_heap(struct gil_io_writer *w, struct gil_vm *vm) {
 	for (gil_word i = 0; i < vm->valuessize; ++i) {
+		// Ids in the allocation run are claimed, but not values yet
+		if (i >= vm->alloc_next && i < vm->alloc_end) {
+			continue;
+		}
+
 		if (gil_bitset_get(&vm->valueset, i)) {
 			gil_io_printf(w, "  %u: ", i);
 			gil_vm_print_val(w, &vm->values[i]);
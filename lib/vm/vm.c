@@ -5,6 +5,22 @@
 #include <string.h>
 #include <assert.h>
 
+#if ( \
+		defined(__unix__) || defined(__unix) || \
+		(defined(__APPLE__) && defined(__MACH__))) && \
+	defined(__GNUC__)
+#define USE_PARALLEL_GC
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#if \
+		defined(__unix__) || defined(__unix) || \
+		(defined(__APPLE__) && defined(__MACH__))
+#define USE_MMAP_HEAP
+#include <sys/mman.h>
+#endif
+
 #include "bitset.h"
 #include "bytecode.h"
 #include "io.h"
@@ -23,7 +39,311 @@ static int stdio_inited = 0;
 static struct gil_io_file_writer std_output;
 static struct gil_io_file_writer std_error;
 
-static gil_word alloc_val(struct gil_vm *vm) {
+static void gc_sweep_for_alloc(struct gil_vm *vm);
+
+#ifdef USE_MMAP_HEAP
+
+// The value heap is made usable (and given back) in chunks of this many
+// values. With 16 byte values, that's 2MiB, which is the usual huge page size.
+#ifndef GIL_VM_CHUNK_VALUES
+#define GIL_VM_CHUNK_VALUES ((size_t)1 << 17)
+#endif
+
+// By default, address space for this many values is reserved up front,
+// so that the heap doesn't have to move when it grows.
+// See gil_vm_gc_policy.reserve_values.
+#ifndef GIL_VM_RESERVE_VALUES
+#define GIL_VM_RESERVE_VALUES ((size_t)1 << 24)
+#endif
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+static size_t round_to_chunks(size_t count) {
+	size_t rem = count % GIL_VM_CHUNK_VALUES;
+	if (rem == 0) {
+		return count;
+	}
+
+	return count + (GIL_VM_CHUNK_VALUES - rem);
+}
+
+// Reserve address space for 'count' values, aligned to a chunk boundary.
+// 'count' must be a multiple of the chunk size.
+static struct gil_vm_value *reserve_values(size_t count) {
+	// Doesn't fit in the address space
+	if (count == 0 || SIZE_MAX / sizeof(struct gil_vm_value) / 2 < count) {
+		return NULL;
+	}
+
+	size_t chunkbytes = GIL_VM_CHUNK_VALUES * sizeof(struct gil_vm_value);
+	size_t bytes = count * sizeof(struct gil_vm_value);
+	char *mem = mmap(
+			NULL, bytes + chunkbytes, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (mem == MAP_FAILED) {
+		return NULL;
+	}
+
+	size_t head = chunkbytes - ((uintptr_t)mem % chunkbytes);
+	if (head == chunkbytes) {
+		head = 0;
+	}
+
+	if (head > 0) {
+		munmap(mem, head);
+	}
+	munmap(mem + head + bytes, chunkbytes - head);
+	return (struct gil_vm_value *)(mem + head);
+}
+
+#endif
+
+static void free_values(struct gil_vm *vm) {
+#ifdef USE_MMAP_HEAP
+	if (vm->valuesreserved != 0) {
+		munmap(vm->values, vm->valuesreserved * sizeof(*vm->values));
+		return;
+	}
+#endif
+
+	gil_allocator_free(vm->alloc, vm->values);
+}
+
+#ifdef USE_MMAP_HEAP
+
+// Move the heap into a new reservation for 'reserve' values (rounded up
+// to whole chunks), with room for at least 'valuessize' values committed.
+// If 'reserve' is 0, or the address space can't be reserved,
+// the heap is moved to memory from the allocator instead.
+static int move_values(struct gil_vm *vm, size_t reserve, size_t valuessize) {
+	if (reserve < valuessize) {
+		reserve = valuessize;
+	}
+	reserve = round_to_chunks(reserve);
+
+	struct gil_vm_value *values = NULL;
+	size_t committed = 0;
+	if (reserve != 0) {
+		values = reserve_values(reserve);
+	}
+
+	if (values != NULL) {
+		committed = round_to_chunks(valuessize);
+		if (
+				committed > 0 &&
+				mprotect(values, committed * sizeof(*values), PROT_READ | PROT_WRITE) < 0) {
+			munmap(values, reserve * sizeof(*values));
+			values = NULL;
+		}
+	}
+
+	if (values == NULL) {
+		reserve = 0;
+		committed = 0;
+		values = gil_allocator_alloc(vm->alloc, valuessize * sizeof(*values));
+		if (values == NULL && valuessize != 0) {
+			return -1;
+		}
+	}
+
+	size_t keep = vm->valuessize < valuessize ? vm->valuessize : valuessize;
+	if (keep > 0) {
+		memcpy(values, vm->values, keep * sizeof(*values));
+	}
+
+	free_values(vm);
+	vm->values = values;
+	vm->valuessize = valuessize;
+	vm->valuesreserved = reserve;
+	vm->valuescommitted = committed;
+
+#ifdef MADV_HUGEPAGE
+	if (vm->gc_policy.huge_pages && reserve != 0) {
+		madvise(values, reserve * sizeof(*values), MADV_HUGEPAGE);
+	}
+#endif
+
+	return 0;
+}
+
+// Give chunks which don't have a single value in them back to the OS.
+// They stay usable; the OS just hands out zeroed pages again
+// once they're written to.
+static void release_free_chunks(struct gil_vm *vm) {
+	if (vm->valuesreserved == 0) {
+		return;
+	}
+
+	// The last chunk is given back by resize_values when the heap shrinks
+	size_t tablesperchunk = GIL_VM_CHUNK_VALUES / (sizeof(gil_bitset_entry) * 8);
+	size_t nchunks = vm->valuessize / GIL_VM_CHUNK_VALUES;
+	for (size_t chunk = 0; chunk < nchunks; ++chunk) {
+		size_t first = chunk * tablesperchunk;
+		if (first >= vm->valueset.tableslen) {
+			break;
+		}
+
+		size_t last = first + tablesperchunk;
+		if (last > vm->valueset.tableslen) {
+			last = vm->valueset.tableslen;
+		}
+
+		size_t tbl = first;
+		while (tbl < last && vm->valueset.tables[tbl] == 0) {
+			tbl += 1;
+		}
+
+		if (tbl == last) {
+			madvise(
+					vm->values + chunk * GIL_VM_CHUNK_VALUES,
+					GIL_VM_CHUNK_VALUES * sizeof(*vm->values), MADV_DONTNEED);
+		}
+	}
+}
+
+#else
+
+static int move_values(struct gil_vm *vm, size_t reserve, size_t valuessize) {
+	(void)reserve;
+	struct gil_vm_value *newvalues = gil_allocator_realloc(
+			vm->alloc, vm->values, sizeof(*vm->values) * valuessize);
+	if (newvalues == NULL) {
+		return -1;
+	}
+
+	vm->values = newvalues;
+	vm->valuessize = valuessize;
+	return 0;
+}
+
+static void release_free_chunks(struct gil_vm *vm) {
+	(void)vm;
+}
+
+#endif
+
+static int resize_values(struct gil_vm *vm, size_t valuessize) {
+#ifdef USE_MMAP_HEAP
+	if (vm->valuesreserved != 0) {
+		// Outgrew the reservation, so move to one twice the size
+		if (valuessize > vm->valuesreserved) {
+			size_t reserve = vm->valuesreserved * 2;
+			return move_values(vm, reserve > valuessize ? reserve : valuessize, valuessize);
+		}
+
+		size_t committed = round_to_chunks(valuessize);
+		char *start = (char *)(vm->values + vm->valuescommitted);
+		if (committed > vm->valuescommitted) {
+			size_t len = (committed - vm->valuescommitted) * sizeof(*vm->values);
+			if (mprotect(start, len, PROT_READ | PROT_WRITE) < 0) {
+				return -1;
+			}
+		} else if (committed < vm->valuescommitted) {
+			// Give the chunks we don't need anymore back to the OS
+			start = (char *)(vm->values + committed);
+			size_t len = (vm->valuescommitted - committed) * sizeof(*vm->values);
+			madvise(start, len, MADV_DONTNEED);
+			mprotect(start, len, PROT_NONE);
+		}
+
+		vm->valuescommitted = committed;
+		vm->valuessize = valuessize;
+		return 0;
+	}
+#endif
+
+	struct gil_vm_value *newvalues = gil_allocator_realloc(
+			vm->alloc, vm->values, sizeof(*vm->values) * valuessize);
+	if (newvalues == NULL) {
+		return -1;
+	}
+
+	vm->values = newvalues;
+	vm->valuessize = valuessize;
+	return 0;
+}
+
+// The heap is reserved according to the default GC policy;
+// gil_vm_set_gc_policy moves it if the new policy wants another size.
+static int init_values(struct gil_vm *vm, size_t valuessize) {
+	vm->values = NULL;
+	vm->valuessize = 0;
+	vm->valuesreserved = 0;
+	vm->valuescommitted = 0;
+	return move_values(vm, vm->gc_policy.reserve_values, valuessize);
+}
+
+static size_t payload_bytes(struct gil_vm *vm) {
+	return
+		vm->arena.stats.used_bytes + vm->arena.stats.large_bytes +
+		vm->arena.stats.mapped_bytes;
+}
+
+static size_t memory_used(struct gil_vm *vm) {
+	return vm->valuessize * sizeof(*vm->values) + payload_bytes(vm);
+}
+
+// Clamp a new heap size to what the memory limit leaves room for,
+// but never below 'needed'. If that's over the limit,
+// the next safe point deals with it.
+static size_t limit_heap_size(struct gil_vm *vm, size_t size, size_t needed) {
+	if (vm->mem_limit == 0) {
+		return size;
+	}
+
+	size_t payload = payload_bytes(vm);
+	size_t room = payload < vm->mem_limit ?
+		(vm->mem_limit - payload) / sizeof(*vm->values) : 0;
+	if (size > room) {
+		size = room > needed ? room : needed;
+	}
+
+	return size;
+}
+
+// Find the size the value heap should grow to in order to fit 'needed' values,
+// according to the GC policy. Returns 0 if the heap isn't allowed to grow that big.
+static size_t grown_heap_size(struct gil_vm *vm, size_t needed) {
+	size_t size = vm->valuessize;
+	while (size < needed) {
+		size_t next = (size_t)(size * vm->gc_policy.growth_factor);
+		size = next > size ? next : size + 1;
+	}
+
+	if (vm->gc_policy.max_values != 0 && size > vm->gc_policy.max_values) {
+		size = vm->gc_policy.max_values;
+	}
+
+	return size >= needed ? limit_heap_size(vm, size, needed) : 0;
+}
+
+// Ids are handed out from a run of consecutive free ids,
+// which is claimed from the value set all at once.
+// The ids in the run which haven't been handed out yet are set in the value set,
+// but aren't values, so the run has to be given back before a GC.
+static void release_run(struct gil_vm *vm) {
+	if (vm->alloc_next >= vm->alloc_end) {
+		return;
+	}
+
+	// A run is never longer than one table, and its first id has been handed out
+	size_t bits = sizeof(gil_bitset_entry) * 8;
+	gil_bitset_entry mask =
+		(((gil_bitset_entry)1 << (vm->alloc_end - vm->alloc_next)) - 1) <<
+		(vm->alloc_next % bits);
+	gil_bitset_retain(&vm->valueset, vm->alloc_next / bits, ~mask);
+	gil_bitset_seek(&vm->valueset, vm->alloc_next);
+	vm->alloc_next = 0;
+	vm->alloc_end = 0;
+}
+
+static gil_word alloc_val_slow(struct gil_vm *vm) {
 	// The idea here is:
 	// * If there are less than 32 slots left, trigger a GC.
 	// * If there are less than 16 slots left, realloc.
@@ -32,19 +352,26 @@ static gil_word alloc_val(struct gil_vm *vm) {
 	//   after the alloc_val and before we get back to the main loop.
 	// When we move to a generational GC,
 	// all of this logic has to be rewritten.
-	size_t id = gil_bitset_set_next(&vm->valueset);
+	if (vm->gc_sweeping) {
+		gc_sweep_for_alloc(vm);
+	}
+
+	// The run stays clear of the last 32 slots, so that only the first
+	// id of a run has to be checked against the thresholds below
+	size_t id;
+	size_t limit = vm->valuessize > 32 ? vm->valuessize - 32 : 0;
+	size_t count = gil_bitset_set_run(&vm->valueset, limit, &id);
+	vm->alloc_next = (gil_word)id + 1;
+	vm->alloc_end = (gil_word)(id + count);
+
 	if (id + 32 >= vm->valuessize) {
 		if (id + 16 >= vm->valuessize) {
-			size_t valuessize = vm->valuessize;
-			while (id + 16 >= valuessize) {
-				valuessize *= 2;
-			}
-
-			struct gil_vm_value *newvalues = realloc(
-					vm->values, sizeof(*vm->values) * valuessize);
-			if (newvalues != NULL) {
-				vm->values = newvalues;
-				vm->valuessize = valuessize;
+			size_t valuessize = grown_heap_size(vm, id + 17);
+			if (valuessize != 0 && resize_values(vm, valuessize) >= 0) {
+				// The heap grew, but maybe past the memory limit
+				if (vm->mem_limit != 0 && memory_used(vm) > vm->mem_limit) {
+					vm->need_gc = 1;
+				}
 			} else if (!vm->halted) {
 				gil_io_printf(vm->std_error, "Allocation failure\n");
 				vm->halted = 1;
@@ -62,356 +389,2151 @@ static gil_word alloc_val(struct gil_vm *vm) {
 	return (gil_word)id;
 }
 
-static void gc_mark_array(struct gil_vm *vm, struct gil_vm_value *val, int depth);
-static void gc_mark_namespace(struct gil_vm *vm, struct gil_vm_value *val, int depth);
+static gil_word alloc_val(struct gil_vm *vm) {
+	if (vm->alloc_next < vm->alloc_end) {
+		return vm->alloc_next++;
+	}
+
+	return alloc_val_slow(vm);
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+#define gc_prefetch(ptr) __builtin_prefetch(ptr)
+#define gc_lowest_bit(n) __builtin_ctzll(n)
+#else
+#define gc_prefetch(ptr) ((void)(ptr))
+static int gc_lowest_bit(gil_bitset_entry n) {
+	int num = 0;
+	while ((n & 1) == 0) {
+		n >>= 1;
+		num += 1;
+	}
+
+	return num;
+}
+#endif
+
+// Mark bits are kept in vm->gc_marks, which has the same layout
+// as the tables of vm->valueset
+#define GC_BITS_PER_ENTRY (sizeof(gil_bitset_entry) * 8)
+#define gc_mark_entry(vm, id) (&(vm)->gc_marks[(id) / GC_BITS_PER_ENTRY])
+#define gc_mark_bit(id) ((gil_bitset_entry)1 << ((id) % GC_BITS_PER_ENTRY))
+
+#ifdef USE_PARALLEL_GC
+struct gc_worker;
+static _Thread_local struct gc_worker *gc_curr_worker = NULL;
+static void gc_worker_push(struct gc_worker *w, gil_word id);
+#endif
 
+// Marking uses an explicit gray stack rather than recursion,
+// so there's no limit to how deeply nested a structure can be.
+// Values which are already marked are never pushed. For the rest, we prefetch
+// their out-of-line data, so that it's hopefully in cache once they're popped.
+// The 'depth' argument only exists to satisfy gil_vm_gcmarker.
 static void gc_mark(struct gil_vm *vm, gil_word id, int depth) {
+#ifdef USE_PARALLEL_GC
+	if (gc_curr_worker != NULL) {
+		gc_worker_push(gc_curr_worker, id);
+		return;
+	}
+#endif
+
+	if (*gc_mark_entry(vm, id) & gc_mark_bit(id)) {
+		return;
+	}
+
+	if (vm->gc_stacklen >= vm->gc_stacksize) {
+		size_t size = vm->gc_stacksize == 0 ? 64 : vm->gc_stacksize * 2;
+		gil_word *stack = gil_allocator_realloc(vm->alloc, vm->gc_stack, size * sizeof(*stack));
+		if (stack == NULL) {
+			if (!vm->halted) {
+				gil_io_printf(vm->std_error, "Allocation failure\n");
+				vm->halted = 1;
+			}
+
+			vm->gc_failed = 1;
+			return;
+		}
+
+		vm->gc_stack = stack;
+		vm->gc_stacksize = size;
+	}
+
 	struct gil_vm_value *val = &vm->values[id];
-	if (val->flags & GIL_VAL_MARKED) {
+	int typ = gil_value_get_type(val);
+	if (typ == GIL_VAL_TYPE_ARRAY && !(val->flags & GIL_VAL_SBO)) {
+		gc_prefetch(val->array.array);
+	} else if (typ == GIL_VAL_TYPE_NAMESPACE && !(val->flags & GIL_VAL_SBO)) {
+		gc_prefetch(val->ns.ns);
+	}
+
+	vm->gc_stack[vm->gc_stacklen++] = id;
+}
+
+static void gc_mark_base(struct gil_vm *vm, gil_word *id) {
+	gc_mark(vm, *id, 0);
+}
+
+static void gc_scan_array(struct gil_vm *vm, struct gil_vm_value *val) {
+	gil_word *data;
+	if (val->flags & GIL_VAL_SBO) {
+		data = val->array.shortarray;
+	} else {
+		data = val->array.array->data;
+	}
+
+	for (size_t i = 0; i < val->array.length; ++i) {
+		gc_mark(vm, data[i], 0);
+	}
+}
+
+static void gc_scan_namespace(struct gil_vm *vm, struct gil_vm_value *val) {
+	if (val->ns.parent != 0) {
+		gc_mark(vm, val->ns.parent, 0);
+	}
+
+	if (val->flags & GIL_VAL_SBO) {
+		gc_mark(vm, val->ns.shortval, 0);
 		return;
 	}
 
-	if (depth > GIL_MAX_STACK_DEPTH) {
-		if (!vm->halted) {
-			gil_io_printf(vm->std_error, "GC recursion limit reached\n");
-			vm->halted = 1;
+	struct gil_vm_namespace *ns = val->ns.ns;
+	if (ns == NULL) {
+		return;
+	}
+
+	if (ns->shape != NULL) {
+		for (gil_word i = 0; i < ns->len; ++i) {
+			gc_mark(vm, ns->data[i], 0);
 		}
 
 		return;
 	}
 
-	val->flags |= GIL_VAL_MARKED;
+	// Hash tables keep their entries together, with key 0 for a deleted one
+	for (gil_word i = 0; i < ns->len + ns->tombs; ++i) {
+		if (ns->data[i * 2] != 0) {
+			gc_mark(vm, ns->data[i * 2 + 1], 0);
+		}
+	}
+}
 
+static void gc_scan(struct gil_vm *vm, struct gil_vm_value *val) {
 	int typ = gil_value_get_type(val);
 	if (typ == GIL_VAL_TYPE_ARRAY) {
-		gc_mark_array(vm, val, depth + 1);
+		gc_scan_array(vm, val);
 	} else if (typ == GIL_VAL_TYPE_NAMESPACE) {
-		gc_mark_namespace(vm, val, depth + 1);
+		gc_scan_namespace(vm, val);
 	} else if (typ == GIL_VAL_TYPE_FUNCTION) {
-		gc_mark(vm, val->func.ns, depth + 1);
-		gc_mark(vm, val->func.self, depth + 1);
+		gc_mark(vm, val->func.ns, 0);
+		gc_mark(vm, val->func.self, 0);
 	} else if (typ == GIL_VAL_TYPE_CFUNCTION) {
-		gc_mark(vm, val->cfunc.self, depth + 1);
+		gc_mark(vm, val->cfunc.self, 0);
+	} else if (typ == GIL_VAL_TYPE_CVAL) {
+		gc_mark(vm, val->cval.ns, 0);
 	} else if (typ == GIL_VAL_TYPE_CONTINUATION) {
-		gc_mark(vm, val->cont.call, depth + 1);
+		gc_mark(vm, val->cont.call, 0);
 		if (val->cont.cont != NULL) {
 			if (val->cont.cont->marker) {
-				val->cont.cont->marker(vm, val->cont.cont, depth + 1, gc_mark);
+				val->cont.cont->marker(vm, val->cont.cont, 0, gc_mark);
 			}
 			if (val->cont.cont->args != 0) {
-				gc_mark(vm, val->cont.cont->args, depth + 1);
+				gc_mark(vm, val->cont.cont->args, 0);
 			}
 		}
 	}
 }
 
-static void gc_mark_array(struct gil_vm *vm, struct gil_vm_value *val, int depth) {
-	gil_word *data;
-	if (val->flags & GIL_VAL_SBO) {
-		data = val->array.shortarray;
-	} else {
-		data = val->array.array->data;
-	}
+// Pop values off the gray stack until it's empty,
+// marking each one and pushing its children.
+static void gc_drain(struct gil_vm *vm) {
+	while (vm->gc_stacklen > 0 && !vm->gc_failed) {
+		gil_word id = vm->gc_stack[--vm->gc_stacklen];
+		gil_bitset_entry *marks = gc_mark_entry(vm, id);
+		if (*marks & gc_mark_bit(id)) {
+			continue;
+		}
 
-	for (size_t i = 0; i < val->array.length; ++i) {
-		gc_mark(vm, data[i], depth + 1);
+		*marks |= gc_mark_bit(id);
+		vm->gc_marked += 1;
+		gc_scan(vm, &vm->values[id]);
 	}
 }
 
-static void gc_mark_namespace(struct gil_vm *vm, struct gil_vm_value *val, int depth) {
-	if (val->ns.parent != 0) {
-		gc_mark(vm, val->ns.parent, depth + 1);
+// Queue up the finalizer of a C value, if its type has one.
+static void queue_finalizer(struct gil_vm *vm, struct gil_vm_value *val) {
+	if (val->cval.cval == NULL || val->cval.ctype >= vm->ctypeslen) {
+		return;
 	}
 
-	if (val->ns.ns == NULL) {
+	gil_vm_ctype_finalizer finalize = vm->ctypes[val->cval.ctype].finalize;
+	if (finalize == NULL) {
 		return;
 	}
 
-	for (size_t i = 0; i < val->ns.ns->size; ++i) {
-		gil_word key = val->ns.ns->data[i];
-		if (key == 0 || key == ~(gil_word)0) {
-			continue;
+	if (vm->finalizequeuelen >= vm->finalizequeuesize) {
+		size_t newsize = vm->finalizequeuesize == 0 ? 16 : vm->finalizequeuesize * 2;
+		struct gil_vm_finalization *newqueue = gil_allocator_realloc(
+				vm->alloc, vm->finalizequeue, newsize * sizeof(*newqueue));
+
+		// Better to finalize it right away than to leak it
+		if (newqueue == NULL) {
+			finalize(vm, val->cval.cval);
+			return;
 		}
 
-		gc_mark(vm, val->ns.ns->data[val->ns.ns->size + i], depth + 1);
+		vm->finalizequeue = newqueue;
+		vm->finalizequeuesize = newsize;
 	}
-}
 
-static void gc_mark_base(struct gil_vm *vm, gil_word id) {
-	gc_mark(vm, id, 0);
+	vm->finalizequeue[vm->finalizequeuelen].finalize = finalize;
+	vm->finalizequeue[vm->finalizequeuelen].cval = val->cval.cval;
+	vm->finalizequeuelen += 1;
 }
 
-static void gc_free(struct gil_vm *vm, gil_word id) {
-	struct gil_vm_value *val = &vm->values[id];
-	gil_bitset_unset(&vm->valueset, id);
+// Finalizers can allocate, which can queue up more finalizers,
+// so the length is checked on every iteration.
+static void run_finalizers(struct gil_vm *vm) {
+	for (size_t i = 0; i < vm->finalizequeuelen; ++i) {
+		struct gil_vm_finalization fin = vm->finalizequeue[i];
+		fin.finalize(vm, fin.cval);
+	}
 
+	vm->finalizequeuelen = 0;
+}
+
+static void gc_free_payload(struct gil_vm *vm, struct gil_vm_value *val) {
 	// Don't need to do anything more; the next round of GC will free
 	// whichever values were only referenced by the array
 	int typ = gil_value_get_type(val);
 	if (typ == GIL_VAL_TYPE_ARRAY && !(val->flags & GIL_VAL_SBO)) {
-		free(val->array.array);
-	} else if (typ == GIL_VAL_TYPE_BUFFER) {
-		free(val->buffer.buffer);
-	} else if (typ == GIL_VAL_TYPE_NAMESPACE) {
-		free(val->ns.ns);
+		gil_vm_dealloc(vm, val->array.array);
+	} else if (typ == GIL_VAL_TYPE_BUFFER && !(val->flags & GIL_VAL_SBO)) {
+		gil_vm_dealloc(vm, val->buffer.buffer);
+	} else if (typ == GIL_VAL_TYPE_NAMESPACE && !(val->flags & GIL_VAL_SBO)) {
+		gil_vm_dealloc(vm, val->ns.ns);
 	} else if (typ == GIL_VAL_TYPE_ERROR) {
-		free(val->error.error);
+		gil_vm_dealloc(vm, val->error.error);
 	} else if (typ == GIL_VAL_TYPE_CONTINUATION && val->cont.cont) {
-		free(val->cont.cont);
+		gil_vm_dealloc(vm, val->cont.cont);
+	} else if (typ == GIL_VAL_TYPE_CVAL) {
+		queue_finalizer(vm, val);
 	}
 }
 
-static size_t gc_sweep(struct gil_vm *vm) {
+#ifdef USE_PARALLEL_GC
+static void gc_worker_defer_free(struct gc_worker *w, gil_word id);
+#endif
+
+static void gc_free(struct gil_vm *vm, gil_word id) {
+#ifdef USE_PARALLEL_GC
+	// Neither the arena nor the allocator has to be thread safe, so sweeping
+	// workers leave the payloads for the collecting thread to free
+	if (gc_curr_worker != NULL) {
+		gc_worker_defer_free(gc_curr_worker, id);
+		return;
+	}
+#endif
+
+	gc_free_payload(vm, &vm->values[id]);
+}
+
+// Make sure there's a mark bit for every id in the value set.
+static int gc_reserve_marks(struct gil_vm *vm) {
+	size_t len = vm->valueset.tableslen;
+	if (len <= vm->gc_markslen) {
+		return 0;
+	}
+
+	gil_bitset_entry *marks = gil_allocator_realloc(vm->alloc, vm->gc_marks, len * sizeof(*marks));
+	if (marks == NULL) {
+		return -1;
+	}
+
+	memset(marks + vm->gc_markslen, 0, (len - vm->gc_markslen) * sizeof(*marks));
+	vm->gc_marks = marks;
+	vm->gc_markslen = len;
+	return 0;
+}
+
+// Sweep the value set tables in [start, end), 64 values at a time:
+// the dead values are the allocated ones which aren't marked.
+// Live values are never touched; dead ones are only read to free
+// their payloads. A parallel sweep gives each thread its own range of tables.
+static size_t gc_sweep_tables(struct gil_vm *vm, size_t start, size_t end) {
+	// Tables past the end of the marks were created after marking,
+	// so they only contain new values
+	if (end > vm->gc_markslen) {
+		end = vm->gc_markslen;
+	}
+
 	size_t freed = 0;
-	struct gil_bitset_iterator it;
-	gil_bitset_iterator_init_from(&it, &vm->valueset, vm->gc_start);
-	size_t id;
-	while (gil_bitset_iterator_next(&it, &vm->valueset, &id)) {
-		struct gil_vm_value *val = &vm->values[id];
-		if (!(val->flags & GIL_VAL_MARKED)) {
-			gil_bitset_unset(&vm->valueset, id);
-			gc_free(vm, id);
+	for (size_t i = start; i < end; ++i) {
+		gil_bitset_entry keep = vm->gc_marks[i];
+
+		// The values before gc_start are never collected
+		size_t base = i * GC_BITS_PER_ENTRY;
+		if (base < vm->gc_start) {
+			size_t n = vm->gc_start - base;
+			keep |= n >= GC_BITS_PER_ENTRY ?
+				~(gil_bitset_entry)0 : ((gil_bitset_entry)1 << n) - 1;
+		}
+
+		gil_bitset_entry dead = gil_bitset_retain(&vm->valueset, i, keep);
+		while (dead != 0) {
+			gc_free(vm, (gil_word)(base + gc_lowest_bit(dead)));
+			dead &= dead - 1;
 			freed += 1;
-		} else {
-			val->flags &= ~GIL_VAL_MARKED;
 		}
 	}
 
+	if (end > start) {
+		memset(&vm->gc_marks[start], 0, (end - start) * sizeof(*vm->gc_marks));
+	}
+
 	return freed;
 }
 
-const char *gil_value_type_name(enum gil_value_type typ) {
-	switch (typ) {
-	case GIL_VAL_TYPE_NONE: return "NONE";
-	case GIL_VAL_TYPE_ATOM: return "ATOM";
-	case GIL_VAL_TYPE_REAL: return "REAL";
-	case GIL_VAL_TYPE_BUFFER: return "BUFFER";
-	case GIL_VAL_TYPE_ARRAY: return "ARRAY";
-	case GIL_VAL_TYPE_NAMESPACE: return "NAMESPACE";
-	case GIL_VAL_TYPE_FUNCTION: return "FUNCTION";
-	case GIL_VAL_TYPE_CFUNCTION: return "CFUNCTION";
-	case GIL_VAL_TYPE_CVAL: return "CVAL";
-	case GIL_VAL_TYPE_CONTINUATION: return "CONTINUATION";
-	case GIL_VAL_TYPE_RETURN: return "RETURN";
-	case GIL_VAL_TYPE_ERROR: return "ERROR";
+static size_t gc_sweep(struct gil_vm *vm) {
+	return gc_sweep_tables(vm, vm->gc_start / GC_BITS_PER_ENTRY, vm->valueset.tableslen);
+}
+
+size_t gil_vm_gc_sweep_step(struct gil_vm *vm, size_t ntables) {
+	size_t freed = 0;
+	while (vm->gc_sweeping && ntables > 0) {
+		freed += gc_sweep_tables(vm, vm->gc_sweep_table, vm->gc_sweep_table + 1);
+		vm->gc_sweep_table += 1;
+		ntables -= 1;
+
+		if (vm->gc_sweep_table >= vm->valueset.tableslen) {
+			vm->gc_sweeping = 0;
+			release_free_chunks(vm);
+		}
+	}
+
+	return freed;
+}
+
+// Values must only be allocated in tables which have already been swept,
+// since a new value in an unswept table isn't marked, and the sweep would
+// free it. Sweep one table at a time until the bitset's current table
+// is behind the sweep cursor.
+static void gc_sweep_for_alloc(struct gil_vm *vm) {
+	while (vm->gc_sweeping && vm->valueset.currtable >= vm->gc_sweep_table) {
+		size_t table = vm->gc_sweep_table;
+		gil_vm_gc_sweep_step(vm, 1);
+		gil_bitset_seek(&vm->valueset, table * GC_BITS_PER_ENTRY);
+	}
+}
+
+#ifdef USE_PARALLEL_GC
+
+// The parallel collector is only worth it when there's a lot of heap
+// to go through; below this many value slots, thread startup dominates.
+#ifndef GIL_GC_PARALLEL_MIN_VALUES
+#define GIL_GC_PARALLEL_MIN_VALUES (1 << 16)
+#endif
+
+// A worker shares half its gray stack once it holds more than this many ids.
+#define GC_SHARE_THRESHOLD 64
+
+// Worker stacks hold at least this many ids
+#define GC_WORKER_STACK_MIN 1024
+
+struct gc_parallel;
+
+// Each worker owns a private gray stack which it pushes to and pops from
+// without synchronization. When the private stack gets big, half of it
+// is moved to the 'shared' stack, from which idle workers can steal.
+// Both stacks are allocated up front by the collecting thread, so workers
+// never call the allocator; they have room for 'stacksize' ids each.
+struct gc_worker {
+	struct gil_vm *vm;
+	struct gc_parallel *par;
+
+	gil_word *stack;
+	size_t stacklen;
+	size_t stacksize;
+
+	pthread_mutex_t lock;
+	gil_word *shared;
+	size_t sharedlen; // Written with the lock held, may be peeked without
+
+	// Range of value set tables to sweep. If the stack fills up with
+	// payloads to free, the worker stops at 'sweep_next', and the collecting
+	// thread sweeps the rest.
+	size_t sweep_start;
+	size_t sweep_end;
+	size_t sweep_next;
+	size_t marked;
+	size_t freed;
+};
+
+struct gc_parallel {
+	struct gc_worker *workers;
+	int nworkers;
+	int idle;
+	int go;
+	int sweep;
+
+	// Set when a worker had to drop an id because its stack was full
+	int overflowed;
+};
+
+// The sweep made sure that there's room.
+static void gc_worker_defer_free(struct gc_worker *w, gil_word id) {
+	w->stack[w->stacklen++] = id;
+}
+
+// If the stack is full, the id is dropped. It always belongs to a value
+// which has been marked, so gc_rescan_marked finds it again later.
+static void gc_worker_push(struct gc_worker *w, gil_word id) {
+	if (w->stacklen >= w->stacksize) {
+		__atomic_store_n(&w->par->overflowed, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	gc_prefetch(&w->vm->values[id]);
+	w->stack[w->stacklen++] = id;
+}
+
+// Move the oldest half of the private stack to the shared stack,
+// if it has room.
+static void gc_worker_share(struct gc_worker *w) {
+	size_t half = w->stacklen / 2;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->sharedlen + half > w->stacksize) {
+		pthread_mutex_unlock(&w->lock);
+		return;
+	}
+
+	memcpy(w->shared + w->sharedlen, w->stack, half * sizeof(*w->stack));
+	__atomic_store_n(&w->sharedlen, w->sharedlen + half, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&w->lock);
+
+	memmove(w->stack, w->stack + half, (w->stacklen - half) * sizeof(*w->stack));
+	w->stacklen -= half;
+}
+
+// Take half of victim's shared stack (which may be our own),
+// or as much of it as fits.
+static int gc_worker_steal(struct gc_worker *w, struct gc_worker *victim) {
+	if (__atomic_load_n(&victim->sharedlen, __ATOMIC_ACQUIRE) == 0) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&victim->lock);
+	size_t count = (victim->sharedlen + 1) / 2;
+	if (count > w->stacksize - w->stacklen) {
+		count = w->stacksize - w->stacklen;
+	}
+
+	size_t start = victim->sharedlen - count;
+	memcpy(w->stack + w->stacklen, victim->shared + start, count * sizeof(*w->stack));
+	w->stacklen += count;
+	__atomic_store_n(&victim->sharedlen, start, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&victim->lock);
+	return count > 0;
+}
+
+// Look for work in other workers' shared stacks until either some is found
+// or every worker is idle. A worker is only ever counted as idle while both
+// its stacks are empty, so when all workers are idle, marking is done.
+static int gc_worker_find_work(struct gc_worker *w) {
+	struct gc_parallel *par = w->par;
+	__atomic_add_fetch(&par->idle, 1, __ATOMIC_SEQ_CST);
+
+	while (1) {
+		if (__atomic_load_n(&par->idle, __ATOMIC_SEQ_CST) == par->nworkers) {
+			return 0;
+		}
+
+		for (int i = 0; i < par->nworkers; ++i) {
+			struct gc_worker *victim = &par->workers[i];
+			if (
+					victim == w ||
+					__atomic_load_n(&victim->sharedlen, __ATOMIC_ACQUIRE) == 0) {
+				continue;
+			}
+
+			__atomic_sub_fetch(&par->idle, 1, __ATOMIC_SEQ_CST);
+			if (gc_worker_steal(w, victim)) {
+				return 1;
+			}
+			__atomic_add_fetch(&par->idle, 1, __ATOMIC_SEQ_CST);
+		}
+
+		sched_yield();
+	}
+}
+
+static void gc_worker_mark(struct gc_worker *w) {
+	struct gil_vm *vm = w->vm;
+
+	while (1) {
+		while (w->stacklen > 0) {
+			gil_word id = w->stack[--w->stacklen];
+			gil_bitset_entry old = __atomic_fetch_or(
+					gc_mark_entry(vm, id), gc_mark_bit(id), __ATOMIC_RELAXED);
+			if (old & gc_mark_bit(id)) {
+				continue;
+			}
+
+			w->marked += 1;
+			gc_scan(vm, &vm->values[id]);
+
+			if (
+					w->stacklen > GC_SHARE_THRESHOLD &&
+					__atomic_load_n(&w->sharedlen, __ATOMIC_RELAXED) == 0) {
+				gc_worker_share(w);
+			}
+		}
+
+		if (gc_worker_steal(w, w)) {
+			continue;
+		}
+
+		if (!gc_worker_find_work(w)) {
+			return;
+		}
+	}
+}
+
+// Sweep one table at a time, as long as the stack has room
+// for every payload a table could have.
+static void gc_worker_sweep(struct gc_worker *w) {
+	w->sweep_next = w->sweep_start;
+	while (
+			w->sweep_next < w->sweep_end &&
+			w->stacksize - w->stacklen >= GC_BITS_PER_ENTRY) {
+		w->freed += gc_sweep_tables(w->vm, w->sweep_next, w->sweep_next + 1);
+		w->sweep_next += 1;
+	}
+}
+
+static void *gc_worker_main(void *ptr) {
+	struct gc_worker *w = ptr;
+	while (!__atomic_load_n(&w->par->go, __ATOMIC_ACQUIRE)) {
+		sched_yield();
+	}
+
+	gc_curr_worker = w;
+	gc_worker_mark(w);
+
+	// Every worker has finished marking once gc_worker_mark returns,
+	// so the sweep can start right away. If ids were dropped,
+	// the marks aren't complete yet.
+	if (w->par->sweep && !__atomic_load_n(&w->par->overflowed, __ATOMIC_RELAXED)) {
+		gc_worker_sweep(w);
+	}
+
+	gc_curr_worker = NULL;
+
+	return NULL;
+}
+
+// Scan every marked value again, on the collecting thread,
+// to mark the children the workers had to drop.
+static void gc_rescan_marked(struct gil_vm *vm) {
+	for (size_t i = 0; i < vm->gc_markslen; ++i) {
+		gil_bitset_entry marks = vm->gc_marks[i];
+		while (marks != 0) {
+			gil_word id = (gil_word)(i * GC_BITS_PER_ENTRY + gc_lowest_bit(marks));
+			gc_scan(vm, &vm->values[id]);
+			gc_drain(vm);
+			marks &= marks - 1;
+		}
+	}
+}
+
+// Mark everything reachable from the gray stack and, if 'sweep' is set,
+// sweep, using vm->gc_threads threads. The calling thread is one of them.
+// Returns -1 if parallel collection couldn't be started,
+// in which case nothing has been changed.
+static int gc_parallel(struct gil_vm *vm, int sweep, size_t *freed) {
+	int nworkers = vm->gc_threads;
+	struct gc_worker *workers = gil_allocator_calloc(vm->alloc, nworkers, sizeof(*workers));
+	pthread_t *threads = gil_allocator_calloc(vm->alloc, nworkers, sizeof(*threads));
+	if (workers == NULL || threads == NULL) {
+		gil_allocator_free(vm->alloc, workers);
+		gil_allocator_free(vm->alloc, threads);
+		return -1;
+	}
+
+	// Enough room for a worker to sweep its share of the heap in one go
+	size_t stacksize = vm->valuessize / nworkers + GC_BITS_PER_ENTRY;
+	if (stacksize < GC_WORKER_STACK_MIN) {
+		stacksize = GC_WORKER_STACK_MIN;
+	}
+
+	int failed = 0;
+	for (int i = 0; i < nworkers; ++i) {
+		workers[i].stack = gil_allocator_alloc(vm->alloc, stacksize * sizeof(gil_word));
+		workers[i].shared = gil_allocator_alloc(vm->alloc, stacksize * sizeof(gil_word));
+		workers[i].stacksize = stacksize;
+		if (workers[i].stack == NULL || workers[i].shared == NULL) {
+			failed = 1;
+		}
+	}
+
+	if (failed) {
+		for (int i = 0; i < nworkers; ++i) {
+			gil_allocator_free(vm->alloc, workers[i].stack);
+			gil_allocator_free(vm->alloc, workers[i].shared);
+		}
+		gil_allocator_free(vm->alloc, workers);
+		gil_allocator_free(vm->alloc, threads);
+		return -1;
+	}
+
+	struct gc_parallel par = {
+		.workers = workers,
+		.nworkers = nworkers,
+		.sweep = sweep,
+	};
+
+	for (int i = 0; i < nworkers; ++i) {
+		workers[i].vm = vm;
+		workers[i].par = &par;
+		pthread_mutex_init(&workers[i].lock, NULL);
+	}
+
+	// Worker 0 runs on this thread
+	int started = 1;
+	for (int i = 1; i < nworkers; ++i) {
+		if (pthread_create(&threads[i], NULL, gc_worker_main, &workers[i]) != 0) {
+			break;
+		}
+		started += 1;
+	}
+
+	// Sweep ranges are split on directory boundaries,
+	// so that no two workers ever touch the same bitset directory entry
+	par.nworkers = started;
+	size_t ndirs =
+		(vm->valueset.tableslen + GC_BITS_PER_ENTRY - 1) / GC_BITS_PER_ENTRY;
+	for (int i = 0; i < started; ++i) {
+		size_t start = (ndirs * i / started) * GC_BITS_PER_ENTRY;
+		size_t end = (ndirs * (i + 1) / started) * GC_BITS_PER_ENTRY;
+		size_t first = vm->gc_start / GC_BITS_PER_ENTRY;
+		workers[i].sweep_start = start < first ? first : start;
+		workers[i].sweep_end = i == started - 1 ? vm->valueset.tableslen : end;
+		workers[i].sweep_next = workers[i].sweep_start;
+	}
+
+	// Roots which don't fit stay on the gray stack. They're marked below,
+	// and until then the workers mustn't sweep.
+	size_t pushed = 0;
+	while (pushed < vm->gc_stacklen) {
+		struct gc_worker *w = &workers[pushed % started];
+		if (w->stacklen >= w->stacksize) {
+			par.overflowed = 1;
+			break;
+		}
+
+		w->stack[w->stacklen++] = vm->gc_stack[pushed++];
+	}
+	vm->gc_stacklen -= pushed;
+	memmove(vm->gc_stack, vm->gc_stack + pushed, vm->gc_stacklen * sizeof(*vm->gc_stack));
+
+	__atomic_store_n(&par.go, 1, __ATOMIC_RELEASE);
+	gc_worker_main(&workers[0]);
+
+	*freed = workers[0].freed;
+	vm->gc_marked += workers[0].marked;
+	for (int i = 1; i < started; ++i) {
+		pthread_join(threads[i], NULL);
+		*freed += workers[i].freed;
+		vm->gc_marked += workers[i].marked;
+	}
+
+	if (par.overflowed) {
+		// Finish marking on this thread. Workers only sweep once marking
+		// is complete, so nothing has been swept yet.
+		gc_drain(vm);
+		gc_rescan_marked(vm);
+		if (sweep && !vm->gc_failed) {
+			*freed += gc_sweep(vm);
+		}
+	} else if (sweep) {
+		// The sweep left the ids whose payloads need freeing on the gray stacks,
+		// and whatever tables didn't fit for this thread to sweep
+		for (int i = 0; i < started; ++i) {
+			for (size_t j = 0; j < workers[i].stacklen; ++j) {
+				gc_free_payload(vm, &vm->values[workers[i].stack[j]]);
+			}
+
+			*freed += gc_sweep_tables(vm, workers[i].sweep_next, workers[i].sweep_end);
+		}
+	}
+
+	for (int i = 0; i < nworkers; ++i) {
+		pthread_mutex_destroy(&workers[i].lock);
+		gil_allocator_free(vm->alloc, workers[i].stack);
+		gil_allocator_free(vm->alloc, workers[i].shared);
+	}
+
+	gil_allocator_free(vm->alloc, workers);
+	gil_allocator_free(vm->alloc, threads);
+	return 0;
+}
+
+#endif
+
+const char *gil_value_type_name(enum gil_value_type typ) {
+	switch (typ) {
+	case GIL_VAL_TYPE_NONE: return "NONE";
+	case GIL_VAL_TYPE_ATOM: return "ATOM";
+	case GIL_VAL_TYPE_REAL: return "REAL";
+	case GIL_VAL_TYPE_BUFFER: return "BUFFER";
+	case GIL_VAL_TYPE_ARRAY: return "ARRAY";
+	case GIL_VAL_TYPE_NAMESPACE: return "NAMESPACE";
+	case GIL_VAL_TYPE_FUNCTION: return "FUNCTION";
+	case GIL_VAL_TYPE_CFUNCTION: return "CFUNCTION";
+	case GIL_VAL_TYPE_CVAL: return "CVAL";
+	case GIL_VAL_TYPE_CONTINUATION: return "CONTINUATION";
+	case GIL_VAL_TYPE_RETURN: return "RETURN";
+	case GIL_VAL_TYPE_ERROR: return "ERROR";
+	}
+
+	return "(unknown)";
+}
+
+gil_word *gil_vm_array_data(struct gil_vm *vm, struct gil_vm_value *val) {
+	if (val->flags & GIL_VAL_SBO) {
+		return val->array.shortarray;
+	} else if (val->array.array) {
+		return val->array.array->data;
+	} else {
+		return NULL;
+	}
+}
+
+size_t gil_vm_buffer_hash(struct gil_vm_value *val) {
+	if (val->flags & GIL_VAL_SBO) {
+		return gil_strset_hash(val->shortbuffer.data, val->shortbuffer.length);
+	} else if (val->buffer.buffer == NULL) {
+		return gil_strset_hash("", 0);
+	}
+
+	if (!(val->flags & GIL_VAL_HASHED)) {
+		val->buffer.buffer->hash = gil_strset_hash(
+				val->buffer.buffer->data, val->buffer.length);
+		val->flags |= GIL_VAL_HASHED;
+	}
+
+	return val->buffer.buffer->hash;
+}
+
+// Long buffers which differ usually differ in their hashes, and once
+// a buffer has been hashed, that's much faster than comparing its contents
+int gil_vm_buffer_equals(struct gil_vm_value *a, struct gil_vm_value *b) {
+	gil_word len = gil_vm_buffer_length(a);
+	if (len != gil_vm_buffer_length(b)) {
+		return 0;
+	}
+
+	if (
+			len >= GIL_VM_BUFFER_HASH_MIN &&
+			gil_vm_buffer_hash(a) != gil_vm_buffer_hash(b)) {
+		return 0;
+	}
+
+	return memcmp(gil_vm_buffer_data(a), gil_vm_buffer_data(b), len) == 0;
+}
+
+gil_word gil_vm_array_get(struct gil_vm *vm, struct gil_vm_value *val, gil_word k) {
+	if (k >= val->array.length) {
+		return vm->knone;
+	}
+
+	if (val->flags & GIL_VAL_SBO) {
+		return val->array.shortarray[k];
+	}
+
+	return val->array.array->data[k];
+}
+
+gil_word gil_vm_array_set(struct gil_vm *vm, struct gil_vm_value *val, gil_word k, gil_word v) {
+	if (k >= val->array.length) {
+		return gil_vm_error(vm, "Array index out of bounds");
+	}
+
+	if (val->flags & GIL_VAL_SBO) {
+		return val->array.shortarray[k] = v;
+	}
+
+	return val->array.array->data[k] = v;
+}
+
+static gil_word mod_init_alloc(void *ptr, const char *name) {
+	struct gil_vm *vm = ptr;
+	return gil_strset_put_copy(&vm->atomset, name);
+}
+
+void gil_vm_init(
+		struct gil_vm *vm, unsigned char *ops, size_t opslen, struct gil_module *builtins) {
+	gil_vm_init_with_allocator(vm, ops, opslen, builtins, &gil_default_allocator);
+}
+
+// Set up everything but the values, which is shared between
+// gil_vm_init_with_allocator and gil_vm_snapshot_load.
+static int init_empty(
+		struct gil_vm *vm, unsigned char *ops, size_t opslen, struct gil_allocator *alloc) {
+	if (!stdio_inited) {
+		std_output.w.write = gil_io_file_write;
+		std_output.f = stdout;
+		std_error.w.write = gil_io_file_write;
+		std_error.f = stderr;
+		stdio_inited = 1;
+	}
+
+	vm->std_output = &std_output.w;
+	vm->std_error = &std_error.w;
+
+	vm->alloc = alloc;
+	vm->halted = 0;
+	vm->error = 0;
+	vm->need_gc = 0;
+	vm->need_check_retval = 0;
+	vm->ops = ops;
+	vm->opslen = opslen;
+	vm->iptr = 0;
+	vm->sptr = 0;
+	vm->fsptr = 0;
+
+	vm->gc_stack = NULL;
+	vm->gc_stacklen = 0;
+	vm->gc_stacksize = 0;
+	vm->gc_failed = 0;
+	vm->gc_marks = NULL;
+	vm->gc_markslen = 0;
+	vm->gc_threads = 1;
+	vm->gc_sweeping = 0;
+	vm->gc_sweep_table = 0;
+
+	gil_vm_gc_policy_init(&vm->gc_policy);
+	vm->gc_bytes = 0;
+	vm->gc_marked = 0;
+	vm->gc_compact_top = 0;
+	vm->alloc_next = 0;
+	vm->alloc_end = 0;
+	vm->mem_limit = 0;
+
+	gil_bitset_init_with_allocator(&vm->valueset, alloc);
+	gil_arena_init_with_allocator(&vm->arena, alloc);
+	gil_strset_init_with_allocator(&vm->atomset, alloc);
+	vm->atoms_complete = 0;
+
+	vm->shape_root = NULL;
+	memset(vm->nscache, 0, sizeof(vm->nscache));
+	memset(vm->frozencache, 0, sizeof(vm->frozencache));
+
+	vm->ctypes = NULL;
+	vm->ctypeslen = 1;
+	vm->finalizequeue = NULL;
+	vm->finalizequeuelen = 0;
+	vm->finalizequeuesize = 0;
+
+	vm->builtins = NULL;
+	vm->cmodules = NULL;
+	vm->cmoduleslen = 0;
+
+	vm->modules = NULL;
+	vm->moduleslen = 0;
+
+	if (init_values(vm, vm->gc_policy.min_values) < 0) {
+		gil_io_printf(vm->std_error, "Allocation failure\n");
+		vm->halted = 1;
+		return -1;
+	}
+
+	return 0;
+}
+
+void gil_vm_init_with_allocator(
+		struct gil_vm *vm, unsigned char *ops, size_t opslen, struct gil_module *builtins,
+		struct gil_allocator *alloc) {
+	if (init_empty(vm, ops, opslen, alloc) < 0) {
+		return;
+	}
+
+	// Use ID 0 to represent an undeclared variable
+	gil_word undeclared_id = alloc_val(vm);
+	assert(undeclared_id == 0);
+	vm->values[undeclared_id].flags = GIL_VAL_TYPE_NONE | GIL_VAL_CONST;
+
+	// It's wasteful to allocate new 'none' variables all the time,
+	gil_word none_id = alloc_val(vm);
+	vm->values[none_id].flags = GIL_VAL_TYPE_NONE | GIL_VAL_CONST;
+	vm->knone = none_id;
+	vm->gc_start = none_id + 1;
+
+#define X(name, k) \
+		vm->k = alloc_val(vm); \
+		vm->values[vm->k].flags = GIL_VAL_TYPE_ATOM | GIL_VAL_CONST; \
+		vm->values[vm->k].atom.atom = gil_strset_put_copy(&vm->atomset, name); \
+		vm->gc_start += 1;
+	GIL_BYTECODE_ATOMS
+#undef X
+
+	vm->builtins = builtins;
+	builtins->init(builtins, mod_init_alloc, vm);
+	gil_word builtins_id = builtins->create(builtins, vm, 0);
+
+	// Need to allocate a frame stack for the builtins
+	vm->fstack[vm->fsptr].ns = builtins_id;
+	vm->fstack[vm->fsptr].retptr = 0;
+	vm->fstack[vm->fsptr].sptr = 0;
+	vm->fstack[vm->fsptr].args = 0;
+	vm->fsptr += 1;
+
+	// Need to allocate a root namespace
+	gil_word root = alloc_val(vm);
+	vm->values[root].ns.parent = builtins_id;
+	vm->values[root].ns.ns = NULL;
+	vm->values[root].flags = GIL_VAL_TYPE_NAMESPACE;
+	vm->fstack[vm->fsptr].ns = root;
+	vm->fstack[vm->fsptr].retptr = ~(gil_word)0;
+	vm->fstack[vm->fsptr].sptr = 0;
+	vm->fstack[vm->fsptr].args = 0;
+	vm->fsptr += 1;
+}
+
+void gil_vm_register_module(struct gil_vm *vm, struct gil_module *mod) {
+	gil_word id = gil_strset_put_copy(&vm->atomset, mod->name);
+	mod->init(mod, mod_init_alloc, vm);
+
+	vm->cmoduleslen += 1;
+	vm->cmodules = gil_allocator_realloc(
+			vm->alloc, vm->cmodules, vm->cmoduleslen * sizeof(*vm->cmodules));
+	struct gil_vm_cmodule *cmod = &vm->cmodules[vm->cmoduleslen - 1];
+	cmod->id = id;
+	cmod->ns = 0;
+	cmod->mod = mod;
+}
+
+void gil_vm_gc_policy_init(struct gil_vm_gc_policy *policy) {
+	policy->growth_factor = 2;
+	policy->min_values = 128;
+	policy->max_values = 0;
+	policy->trigger_bytes = 8 * 1024 * 1024;
+	policy->compact_ratio = 0.25;
+	policy->huge_pages = 0;
+#ifdef USE_MMAP_HEAP
+	policy->reserve_values = GIL_VM_RESERVE_VALUES;
+#else
+	policy->reserve_values = 0;
+#endif
+}
+
+void gil_vm_set_gc_policy(struct gil_vm *vm, const struct gil_vm_gc_policy *policy) {
+#ifdef USE_MMAP_HEAP
+	// The heap never needs more than max_values slots, so if there's
+	// a limit, that's exactly what's worth reserving
+	size_t oldreserve = vm->gc_policy.max_values != 0 ?
+		vm->gc_policy.max_values : vm->gc_policy.reserve_values;
+	size_t reserve = policy->max_values != 0 ?
+		policy->max_values : policy->reserve_values;
+	vm->gc_policy = *policy;
+	if (reserve != oldreserve) {
+		// If this fails, the heap just stays where it is
+		move_values(vm, reserve, vm->valuessize);
+	}
+
+#ifdef MADV_HUGEPAGE
+	if (policy->huge_pages && vm->valuesreserved != 0) {
+		madvise(vm->values, vm->valuesreserved * sizeof(*vm->values), MADV_HUGEPAGE);
+	}
+#endif
+#else
+	vm->gc_policy = *policy;
+#endif
+
+	if (vm->valuessize < policy->min_values) {
+		if (resize_values(vm, policy->min_values) < 0) {
+			gil_io_printf(vm->std_error, "Allocation failure\n");
+			vm->halted = 1;
+		}
+	}
+}
+
+void gil_vm_account_bytes(struct gil_vm *vm, size_t bytes) {
+	vm->gc_bytes += bytes;
+	if (
+			vm->gc_policy.trigger_bytes != 0 &&
+			vm->gc_bytes >= vm->gc_policy.trigger_bytes) {
+		vm->need_gc = 1;
+	}
+
+	// Going over the memory limit is allowed until the next safe point,
+	// where a GC gets a chance to bring the VM back under it
+	if (vm->mem_limit != 0 && memory_used(vm) + bytes > vm->mem_limit) {
+		vm->need_gc = 1;
+	}
+}
+
+void gil_vm_set_memory_limit(struct gil_vm *vm, size_t bytes) {
+	vm->mem_limit = bytes;
+	if (bytes != 0 && memory_used(vm) > bytes) {
+		vm->need_gc = 1;
+	}
+}
+
+void gil_vm_get_memory_usage(struct gil_vm *vm, struct gil_vm_memory_usage *usage) {
+	usage->value_bytes = vm->valuessize * sizeof(*vm->values);
+	usage->payload_bytes = payload_bytes(vm);
+	usage->limit = vm->mem_limit;
+}
+
+void *gil_vm_malloc(struct gil_vm *vm, size_t size) {
+	gil_vm_account_bytes(vm, size);
+	return gil_arena_alloc(&vm->arena, size);
+}
+
+// Only growth counts, so that a payload which grows a step at a time
+// isn't counted again with every step
+void *gil_vm_realloc(struct gil_vm *vm, void *ptr, size_t size) {
+	size_t oldsize = ptr == NULL ? 0 : gil_arena_size(&vm->arena, ptr);
+	if (size > oldsize) {
+		gil_vm_account_bytes(vm, size - oldsize);
+	}
+
+	return gil_arena_realloc(&vm->arena, ptr, size);
+}
+
+void gil_vm_dealloc(struct gil_vm *vm, void *ptr) {
+	gil_arena_dealloc(&vm->arena, ptr);
+}
+
+void gil_vm_get_arena_stats(struct gil_vm *vm, struct gil_arena_stats *stats) {
+	*stats = vm->arena.stats;
+}
+
+gil_word gil_vm_alloc(struct gil_vm *vm, enum gil_value_type typ, enum gil_value_flags flags) {
+	gil_word id = alloc_val(vm);
+	memset(&vm->values[id], 0, sizeof(vm->values[id]));
+	vm->values[id].flags = typ | flags;
+	return id;
+}
+
+gil_word gil_vm_register_ctype(struct gil_vm *vm, gil_vm_ctype_finalizer finalize) {
+	struct gil_vm_ctype *ctypes = gil_allocator_realloc(
+			vm->alloc, vm->ctypes, (vm->ctypeslen + 1) * sizeof(*ctypes));
+	if (ctypes == NULL) {
+		gil_io_printf(vm->std_error, "Allocation failure\n");
+		vm->halted = 1;
+		return 0;
+	}
+
+	vm->ctypes = ctypes;
+	vm->ctypes[0].finalize = NULL;
+	vm->ctypes[vm->ctypeslen].finalize = finalize;
+	return vm->ctypeslen++;
+}
+
+gil_word gil_vm_error(struct gil_vm *vm, const char *fmt, ...) {
+	gil_word id = alloc_val(vm);
+	struct gil_vm_value *val = &vm->values[id];
+	val->flags = GIL_VAL_CONST | GIL_VAL_TYPE_ERROR;
+
+	va_list va;
+	va_start(va, fmt);
+	int len = vsnprintf(NULL, 0, fmt, va);
+	va_end(va);
+
+	val->error.error = len < 0 ? NULL : gil_vm_malloc(vm, len + 1);
+	if (val->error.error == NULL) {
+		gil_io_printf(vm->std_error, "Failed to create error message\n");
+		vm->halted = 1;
+		return vm->knone;
+	}
+
+	va_start(va, fmt);
+	vsnprintf(val->error.error, len + 1, fmt, va);
+	va_end(va);
+
+	return id;
+}
+
+gil_word gil_vm_type_error(struct gil_vm *vm, struct gil_vm_value *val) {
+	enum gil_value_type typ = gil_value_get_type(val);
+	if (typ == GIL_VAL_TYPE_ERROR) {
+		return val - vm->values;
+	}
+
+	return gil_vm_error(vm, "Unexpected type %s", gil_value_type_name(gil_value_get_type(val)));
+}
+
+void gil_vm_free(struct gil_vm *vm) {
+	// C values which are still around are finalized too,
+	// so that whatever they hold isn't leaked
+	if (vm->ctypeslen > 1) {
+		release_run(vm);
+		struct gil_bitset_iterator it;
+		gil_bitset_iterator_init(&it, &vm->valueset);
+		size_t id;
+		while (gil_bitset_iterator_next(&it, &vm->valueset, &id)) {
+			struct gil_vm_value *val = &vm->values[id];
+			if (gil_value_get_type(val) == GIL_VAL_TYPE_CVAL) {
+				queue_finalizer(vm, val);
+			}
+		}
+	}
+
+	run_finalizers(vm);
+
+	// All payloads live in the arena, so there's no need to go through
+	// the values one by one
+	gil_arena_free(&vm->arena);
+	free_values(vm);
+	gil_allocator_free(vm->alloc, vm->gc_stack);
+	gil_allocator_free(vm->alloc, vm->gc_marks);
+	gil_bitset_free(&vm->valueset);
+	gil_strset_free(&vm->atomset);
+	gil_allocator_free(vm->alloc, vm->cmodules);
+	gil_allocator_free(vm->alloc, vm->modules);
+	gil_allocator_free(vm->alloc, vm->ctypes);
+	gil_allocator_free(vm->alloc, vm->finalizequeue);
+}
+
+// Call 'visit' with every root id the VM itself holds, so that it can either
+// be marked or rewritten after compaction. The ids C modules hold
+// are visited by gc_mark_modules, gc_pin_modules and gc_relocate_modules.
+static void gc_visit_roots(
+		struct gil_vm *vm, void (*visit)(struct gil_vm *vm, gil_word *id)) {
+	for (gil_word sptr = 0; sptr < vm->sptr; ++sptr) {
+		visit(vm, &vm->stack[sptr]);
+	}
+
+	for (gil_word fsptr = 0; fsptr < vm->fsptr; ++fsptr) {
+		visit(vm, &vm->fstack[fsptr].ns);
+		visit(vm, &vm->fstack[fsptr].args);
+	}
+
+	// The error the VM halted with is often no longer on the stack
+	if (vm->error) {
+		visit(vm, &vm->error);
+	}
+
+	// Visit for all loaded C modules
+	for (size_t i = 0; i < vm->cmoduleslen; ++i) {
+		if (vm->cmodules[i].ns) {
+			visit(vm, &vm->cmodules[i].ns);
+		}
+	}
+
+	// Visit for all loaded Gilia modules
+	for (size_t i = 0; i < vm->moduleslen; ++i) {
+		if (vm->modules[i].ns) {
+			visit(vm, &vm->modules[i].ns);
+		}
+	}
+}
+
+static void gc_mark_module_id(struct gil_vm *vm, gil_word id) {
+	gc_mark(vm, id, 0);
+}
+
+// A module's marker is only called once the module has been created,
+// since the ids it holds aren't valid before that
+static void gc_mark_modules(struct gil_vm *vm) {
+	for (size_t i = 0; i < vm->cmoduleslen; ++i) {
+		struct gil_module *mod = vm->cmodules[i].mod;
+		if (vm->cmodules[i].ns && mod->marker) {
+			mod->marker(mod, vm, gc_mark_module_id);
+		}
+	}
+}
+
+// Values which are marked by a marker without a relocator can't move.
+// While compacting, their mark bits are set, for the values above
+// gc_compact_top; those are the only ones which would be moved.
+static void gc_pin(struct gil_vm *vm, gil_word id, int depth) {
+	if (id >= vm->gc_compact_top && id < vm->gc_markslen * GC_BITS_PER_ENTRY) {
+		*gc_mark_entry(vm, id) |= gc_mark_bit(id);
+	}
+}
+
+static void gc_pin_module_id(struct gil_vm *vm, gil_word id) {
+	gc_pin(vm, id, 0);
+}
+
+#define gc_is_pinned(vm, id) (*gc_mark_entry(vm, id) & gc_mark_bit(id))
+
+static void gc_pin_modules(struct gil_vm *vm) {
+	for (size_t i = 0; i < vm->cmoduleslen; ++i) {
+		struct gil_module *mod = vm->cmodules[i].mod;
+		if (vm->cmodules[i].ns && mod->marker && !mod->relocator) {
+			mod->marker(mod, vm, gc_pin_module_id);
+		}
+	}
+}
+
+static void gc_pin_continuations(struct gil_vm *vm) {
+	struct gil_bitset_iterator it;
+	gil_bitset_iterator_init(&it, &vm->valueset);
+	size_t id;
+	while (gil_bitset_iterator_next(&it, &vm->valueset, &id)) {
+		struct gil_vm_value *val = &vm->values[id];
+		if (gil_value_get_type(val) != GIL_VAL_TYPE_CONTINUATION) {
+			continue;
+		}
+
+		struct gil_vm_contcontext *ctx = val->cont.cont;
+		if (ctx != NULL && ctx->marker && !ctx->relocator) {
+			ctx->marker(vm, ctx, 0, gc_pin);
+		}
+	}
+}
+
+static void gc_relocate(struct gil_vm *vm, gil_word *id) {
+	if (*id >= vm->gc_compact_top && !gc_is_pinned(vm, *id)) {
+		*id = vm->values[*id].ret.ret;
+	}
+}
+
+static void gc_relocate_modules(struct gil_vm *vm) {
+	for (size_t i = 0; i < vm->cmoduleslen; ++i) {
+		struct gil_module *mod = vm->cmodules[i].mod;
+		if (vm->cmodules[i].ns && mod->relocator) {
+			mod->relocator(mod, vm, gc_relocate);
+		}
+	}
+}
+
+// Rewrite every id held by 'val' to where its value was moved.
+// This has to cover everything gc_scan marks.
+static void gc_relocate_value(struct gil_vm *vm, struct gil_vm_value *val) {
+	int typ = gil_value_get_type(val);
+	if (typ == GIL_VAL_TYPE_ARRAY) {
+		gil_word *data = gil_vm_array_data(vm, val);
+		for (size_t i = 0; i < val->array.length; ++i) {
+			gc_relocate(vm, &data[i]);
+		}
+	} else if (typ == GIL_VAL_TYPE_NAMESPACE) {
+		gc_relocate(vm, &val->ns.parent);
+		if (val->flags & GIL_VAL_SBO) {
+			gc_relocate(vm, &val->ns.shortval);
+			return;
+		}
+
+		struct gil_vm_namespace *ns = val->ns.ns;
+		if (ns == NULL) {
+			return;
+		}
+
+		if (ns->shape != NULL) {
+			for (gil_word i = 0; i < ns->len; ++i) {
+				gc_relocate(vm, &ns->data[i]);
+			}
+
+			return;
+		}
+
+		for (gil_word i = 0; i < ns->len + ns->tombs; ++i) {
+			if (ns->data[i * 2] != 0) {
+				gc_relocate(vm, &ns->data[i * 2 + 1]);
+			}
+		}
+	} else if (typ == GIL_VAL_TYPE_FUNCTION) {
+		gc_relocate(vm, &val->func.ns);
+		gc_relocate(vm, &val->func.self);
+	} else if (typ == GIL_VAL_TYPE_CFUNCTION) {
+		gc_relocate(vm, &val->cfunc.self);
+	} else if (typ == GIL_VAL_TYPE_CVAL) {
+		gc_relocate(vm, &val->cval.ns);
+	} else if (typ == GIL_VAL_TYPE_CONTINUATION) {
+		gc_relocate(vm, &val->cont.call);
+		if (val->cont.cont != NULL) {
+			if (val->cont.cont->relocator) {
+				val->cont.cont->relocator(vm, val->cont.cont, gc_relocate);
+			}
+			gc_relocate(vm, &val->cont.cont->args);
+		}
+	}
+}
+
+// Move live values from the end of the heap into the holes at the start,
+// until every live value is below 'top' (the number of live values),
+// except for pinned ones.
+// A moved value's old slot stores its new id, and once everything is moved,
+// every reference to an unpinned value at or above 'top' is rewritten
+// through that. This expects the heap to be fully swept.
+static size_t gc_compact(struct gil_vm *vm) {
+	struct gil_bitset *valueset = &vm->valueset;
+	size_t top = gil_bitset_count(valueset);
+	if (gc_reserve_marks(vm) < 0) {
+		return 0;
+	}
+
+	vm->gc_compact_top = top;
+	gc_pin_modules(vm);
+	gc_pin_continuations(vm);
+
+	size_t lo = vm->gc_start;
+	size_t hi = vm->valuessize;
+	size_t moved = 0;
+	while (1) {
+		while (lo < top && gil_bitset_get(valueset, lo)) {
+			lo += 1;
+		}
+		if (lo >= top) {
+			break;
+		}
+
+		do {
+			hi -= 1;
+		} while (hi >= top && (!gil_bitset_get(valueset, hi) || gc_is_pinned(vm, hi)));
+		if (hi < top) {
+			break;
+		}
+
+		vm->values[lo] = vm->values[hi];
+		vm->values[hi].ret.ret = (gil_word)lo;
+		gil_bitset_set(valueset, lo);
+		gil_bitset_unset(valueset, hi);
+		moved += 1;
+	}
+
+	// Pinned values are left behind above 'top'
+	size_t end = vm->valuessize;
+	while (end > top && !gil_bitset_get(valueset, end - 1)) {
+		end -= 1;
+	}
+
+	if (moved > 0) {
+		for (size_t id = 0; id < end; ++id) {
+			if (id < top || gc_is_pinned(vm, id)) {
+				gc_relocate_value(vm, &vm->values[id]);
+			}
+		}
+		gc_visit_roots(vm, gc_relocate);
+		gc_relocate_modules(vm);
+	}
+
+	size_t first = top / GC_BITS_PER_ENTRY;
+	if (first < vm->gc_markslen) {
+		memset(&vm->gc_marks[first], 0, (vm->gc_markslen - first) * sizeof(*vm->gc_marks));
+	}
+
+	gil_bitset_shrink(valueset);
+	top = end;
+
+	// Leave some room, so that we don't immediately collect again
+	size_t size = (size_t)(top * vm->gc_policy.growth_factor);
+	if (size < top + 64) {
+		size = top + 64;
+	}
+	if (size < vm->gc_policy.min_values) {
+		size = vm->gc_policy.min_values;
+	}
+	size = limit_heap_size(vm, size, top + 64);
+	if (size < vm->valuessize) {
+		resize_values(vm, size);
+	}
+
+	return moved;
+}
+
+// Run a full mark. If 'lazy' is set, the sweep is left to
+// gil_vm_gc_sweep_step and alloc_val; otherwise, sweep everything now.
+static size_t gc_collect(struct gil_vm *vm, int lazy) {
+	// Whatever is left from the previous cycle must be swept first,
+	// so that no stale marks are left
+	release_run(vm);
+	size_t freed = gil_vm_gc_sweep_step(vm, ~(size_t)0);
+
+	// The cached values might be freed or moved
+	memset(vm->frozencache, 0, sizeof(vm->frozencache));
+
+	vm->gc_bytes = 0;
+	vm->gc_marked = 0;
+	if (gc_reserve_marks(vm) < 0) {
+		gil_io_printf(vm->std_error, "Allocation failure\n");
+		vm->halted = 1;
+		return freed;
+	}
+
+	gc_visit_roots(vm, gc_mark_base);
+	gc_mark_modules(vm);
+
+	int swept = 0;
+#ifdef USE_PARALLEL_GC
+	size_t parallel_freed;
+	if (
+			vm->gc_threads > 1 && !vm->gc_failed &&
+			vm->valuessize >= GIL_GC_PARALLEL_MIN_VALUES &&
+			gc_parallel(vm, !lazy, &parallel_freed) >= 0) {
+		freed += parallel_freed;
+		swept = !lazy;
+	}
+#endif
+
+	gc_drain(vm);
+
+	// If we failed to grow the gray stack, the marks are incomplete,
+	// so sweeping would free live values. Just undo the marking instead.
+	if (vm->gc_failed) {
+		memset(vm->gc_marks, 0, vm->gc_markslen * sizeof(*vm->gc_marks));
+		vm->gc_stacklen = 0;
+		vm->gc_failed = 0;
+		return freed;
+	}
+
+	// If most of the heap is garbage, sweep all of it now,
+	// then compact and shrink the heap
+	size_t live = vm->gc_start + vm->gc_marked;
+	if (
+			lazy && vm->gc_policy.compact_ratio > 0 &&
+			vm->valuessize > vm->gc_policy.min_values &&
+			live < vm->valuessize * vm->gc_policy.compact_ratio) {
+		freed += gc_sweep(vm);
+		gc_compact(vm);
+		return freed;
+	}
+
+	// If most of the heap is still live, grow it right away,
+	// so that we don't end up collecting again after just a few allocations
+	size_t wanted = (size_t)(live * vm->gc_policy.growth_factor);
+	if (vm->gc_policy.max_values != 0 && wanted > vm->gc_policy.max_values) {
+		wanted = vm->gc_policy.max_values;
+	}
+	wanted = limit_heap_size(vm, wanted, vm->valuessize);
+	if (wanted > vm->valuessize) {
+		resize_values(vm, wanted);
+	}
+
+	if (lazy) {
+		vm->gc_sweeping = 1;
+		vm->gc_sweep_table = vm->gc_start / GC_BITS_PER_ENTRY;
+		return freed;
+	}
+
+	if (!swept) {
+		freed += gc_sweep(vm);
+	}
+
+	release_free_chunks(vm);
+	return freed;
+}
+
+size_t gil_vm_gc(struct gil_vm *vm) {
+	return gc_collect(vm, 0);
+}
+
+// Print an uncaught error and halt the VM.
+static void halt_with_error(struct gil_vm *vm, gil_word err) {
+	gil_io_printf(vm->std_error, "Error: %s\n", vm->values[err].error.error);
+	vm->error = err;
+	vm->halted = 1;
+}
+
+// The VM is over its memory limit. Collect everything that can be collected,
+// and compact the heap to give the value slots back.
+// If that's not enough, the VM is stopped with an error.
+static void gc_enforce_limit(struct gil_vm *vm) {
+	gc_collect(vm, 0);
+	if (memory_used(vm) > vm->mem_limit) {
+		gc_compact(vm);
+	}
+
+	if (memory_used(vm) > vm->mem_limit) {
+		halt_with_error(vm, gil_vm_error(vm, "Memory limit exceeded"));
+	}
+}
+
+// Called between instructions, where every live value is reachable from the roots.
+static void gc_safe_point(struct gil_vm *vm) {
+	gil_trace("GC");
+	vm->need_gc = 0;
+	if (vm->mem_limit != 0 && memory_used(vm) > vm->mem_limit) {
+		gc_enforce_limit(vm);
+	} else {
+		gc_collect(vm, 1);
+	}
+}
+
+size_t gil_vm_compact(struct gil_vm *vm) {
+	gc_collect(vm, 0);
+	return gc_compact(vm);
+}
+
+// A snapshot image is laid out like this, with every section padded
+// to a multiple of 8 bytes. Everything is in the host's byte order and layout,
+// so an image only works with the build which saved it.
+// * The header
+// * The bytecode
+// * The values, exactly like in the value heap, except that pointers
+//   are replaced: payload pointers by their offset into the payload section
+//   plus one, and C function pointers by their module and index
+// * The frame stack and the stack
+// * The C modules and the Gilia modules
+// * The names of the VM's atoms, then of the bytecode's atoms,
+//   as consecutive NUL-terminated strings in id order
+// * The payloads, each preceded by its size as a uint64_t,
+//   which is replaced by an arena header when the image is loaded
+struct snapshot_header {
+	unsigned char magic[4];
+	uint16_t major, minor;
+	uint32_t byteorder;
+	uint16_t valuesize;
+	uint16_t ptrsize;
+	uint32_t opslen;
+	uint32_t valueslen;
+	gil_word iptr, sptr, fsptr;
+	gil_word knone, ktrue, kfalse, kstop;
+	gil_word gc_start;
+	gil_word error;
+	uint32_t cmoduleslen;
+	uint32_t moduleslen;
+	uint32_t vmatomslen;
+	uint32_t atomslen;
+	uint32_t atomscomplete;
+	uint32_t reserved;
+	uint64_t vmatombytes;
+	uint64_t atombytes;
+	uint64_t payloadbytes;
+};
+
+static const unsigned char snapshot_magic[4] = { 0x1b, 0x67, 0x6c, 0x73 };
+
+struct snapshot_cmodule {
+	gil_word id;
+	gil_word created;
+};
+
+static size_t snapshot_padded(size_t len) {
+	return (len + 7) & ~(size_t)7;
+}
+
+static void snapshot_write(struct gil_io_writer *w, const void *buf, size_t len) {
+	static const char zeroes[8] = {0};
+	if (len == 0) {
+		return;
+	}
+
+	w->write(w, buf, len);
+	w->write(w, zeroes, snapshot_padded(len) - len);
+}
+
+// Find a C function in the function lists of the VM's modules.
+// Module 0 is the builtins, module n is C module n - 1.
+static int snapshot_find_cfunction(
+		struct gil_vm *vm, gil_vm_cfunction func, uintptr_t *code) {
+	for (size_t mod = 0; mod <= vm->cmoduleslen; ++mod) {
+		const gil_vm_cfunction *funcs = mod == 0 ?
+			vm->builtins->functions : vm->cmodules[mod - 1].mod->functions;
+		if (funcs == NULL) {
+			continue;
+		}
+
+		for (size_t i = 0; funcs[i] != NULL && i <= 0xffff; ++i) {
+			if (funcs[i] == func) {
+				*code = (uintptr_t)mod << 16 | i;
+				return 0;
+			}
+		}
+	}
+
+	return -1;
+}
+
+// Find where the pointer to a value's payload is stored.
+// Returns 0 for values without a payload.
+static int snapshot_payload_ptr(struct gil_vm_value *val, void ***ptr) {
+	switch (gil_value_get_type(val)) {
+	case GIL_VAL_TYPE_BUFFER:
+		*ptr = (void **)&val->buffer.buffer;
+		return !(val->flags & GIL_VAL_SBO);
+
+	case GIL_VAL_TYPE_ARRAY:
+		*ptr = (void **)&val->array.array;
+		return !(val->flags & GIL_VAL_SBO);
+
+	case GIL_VAL_TYPE_NAMESPACE:
+		*ptr = (void **)&val->ns.ns;
+		return !(val->flags & GIL_VAL_SBO) && val->ns.ns != NULL;
+
+	case GIL_VAL_TYPE_ERROR:
+		*ptr = (void **)&val->error.error;
+		return 1;
+
+	default:
+		return 0;
+	}
+}
+
+static size_t snapshot_payload_size(struct gil_vm_value *val) {
+	switch (gil_value_get_type(val)) {
+	case GIL_VAL_TYPE_BUFFER:
+		return sizeof(struct gil_vm_buffer) + val->buffer.length + 1;
+	case GIL_VAL_TYPE_ARRAY:
+		return sizeof(struct gil_vm_array) + val->array.array->size * sizeof(gil_word);
+	case GIL_VAL_TYPE_NAMESPACE:
+		return gil_vm_namespace_bytes(val->ns.ns);
+	default:
+		return strlen(val->error.error) + 1;
+	}
+}
+
+// Collect the names in a string set in id order, starting at id 1.
+static const char **snapshot_names(
+		struct gil_vm *vm, struct gil_strset *set, size_t *bytes) {
+	const char **names = gil_allocator_calloc(vm->alloc, set->next, sizeof(*names));
+	if (names == NULL) {
+		return NULL;
+	}
+
+	*bytes = 0;
+	for (size_t i = 0; i < set->next - 1; ++i) {
+		names[i] = set->names[i].str;
+		*bytes += set->names[i].len + 1;
+	}
+
+	return names;
+}
+
+static void snapshot_write_names(
+		struct gil_io_writer *w, const char **names, size_t count, size_t bytes) {
+	for (size_t i = 0; i < count; ++i) {
+		w->write(w, names[i], strlen(names[i]) + 1);
+	}
+
+	static const char zeroes[8] = {0};
+	w->write(w, zeroes, snapshot_padded(bytes) - bytes);
+}
+
+int gil_vm_snapshot_save(
+		struct gil_vm *vm, struct gil_strset *atoms, struct gil_io_writer *w) {
+	if (!vm->halted || vm->need_check_retval) {
+		gil_io_printf(vm->std_error, "Snapshot: The VM is still running\n");
+		return -1;
+	}
+
+	gil_vm_compact(vm);
+	size_t valueslen = gil_bitset_count(&vm->valueset);
+	for (size_t id = valueslen; id < vm->valuessize; ++id) {
+		if (gil_bitset_get(&vm->valueset, id)) {
+			gil_io_printf(vm->std_error, "Snapshot: A value is held by C code which can't relocate it\n");
+			return -1;
+		}
+	}
+
+	// Shapes aren't part of the image, so every namespace is saved as a hash table
+	for (size_t id = 0; id < valueslen; ++id) {
+		if (
+				gil_value_get_type(&vm->values[id]) == GIL_VAL_TYPE_NAMESPACE &&
+				gil_vm_namespace_unshape(vm, &vm->values[id]) < 0) {
+			gil_io_printf(vm->std_error, "Allocation failure\n");
+			return -1;
+		}
+	}
+
+	// Swap the pointers in a copy of the values for offsets and indexes,
+	// and find out how big the payload section is going to be
+	struct gil_vm_value *values = gil_allocator_alloc(
+			vm->alloc, valueslen * sizeof(*values));
+	if (values == NULL) {
+		gil_io_printf(vm->std_error, "Allocation failure\n");
+		return -1;
+	}
+
+	memcpy(values, vm->values, valueslen * sizeof(*values));
+	uint64_t payloadbytes = 0;
+	for (size_t id = 0; id < valueslen; ++id) {
+		struct gil_vm_value *val = &values[id];
+		int typ = gil_value_get_type(val);
+		void **ptr;
+		if (snapshot_payload_ptr(val, &ptr)) {
+			size_t size = snapshot_payload_size(val);
+			*ptr = (void *)(uintptr_t)(payloadbytes + 1);
+			payloadbytes += sizeof(uint64_t) + snapshot_padded(size);
+		} else if (typ == GIL_VAL_TYPE_CFUNCTION) {
+			uintptr_t code;
+			if (snapshot_find_cfunction(vm, val->cfunc.func, &code) < 0) {
+				gil_io_printf(vm->std_error, "Snapshot: Unknown C function\n");
+				gil_allocator_free(vm->alloc, values);
+				return -1;
+			}
+
+			val->cfunc.func = (gil_vm_cfunction)code;
+		} else if (typ == GIL_VAL_TYPE_CVAL && val->cval.cval != NULL) {
+			gil_io_printf(vm->std_error, "Snapshot: Can't save C values\n");
+			gil_allocator_free(vm->alloc, values);
+			return -1;
+		} else if (typ == GIL_VAL_TYPE_CONTINUATION) {
+			gil_io_printf(vm->std_error, "Snapshot: Can't save continuations\n");
+			gil_allocator_free(vm->alloc, values);
+			return -1;
+		}
+	}
+
+	size_t vmatombytes, atombytes = 0;
+	const char **vmatoms = snapshot_names(vm, &vm->atomset, &vmatombytes);
+	const char **names = atoms == NULL ? NULL : snapshot_names(vm, atoms, &atombytes);
+	if (vmatoms == NULL || (atoms != NULL && names == NULL)) {
+		gil_io_printf(vm->std_error, "Allocation failure\n");
+		gil_allocator_free(vm->alloc, values);
+		gil_allocator_free(vm->alloc, vmatoms);
+		gil_allocator_free(vm->alloc, names);
+		return -1;
 	}
 
-	return "(unknown)";
-}
+	struct snapshot_header header = {
+		.major = GIL_MAJOR,
+		.minor = GIL_MINOR,
+		.byteorder = 0x01020304,
+		.valuesize = sizeof(struct gil_vm_value),
+		.ptrsize = sizeof(void *),
+		.opslen = (uint32_t)vm->opslen,
+		.valueslen = (uint32_t)valueslen,
+		.iptr = vm->iptr,
+		.sptr = vm->sptr,
+		.fsptr = vm->fsptr,
+		.knone = vm->knone,
+		.ktrue = vm->ktrue,
+		.kfalse = vm->kfalse,
+		.kstop = vm->kstop,
+		.gc_start = vm->gc_start,
+		.error = vm->error,
+		.cmoduleslen = (uint32_t)vm->cmoduleslen,
+		.moduleslen = (uint32_t)vm->moduleslen,
+		.vmatomslen = (uint32_t)vm->atomset.next - 1,
+		.atomslen = atoms == NULL ? 0 : (uint32_t)atoms->next - 1,
+		.atomscomplete = (uint32_t)vm->atoms_complete,
+		.vmatombytes = vmatombytes,
+		.atombytes = atombytes,
+		.payloadbytes = payloadbytes,
+	};
+	memcpy(header.magic, snapshot_magic, sizeof(header.magic));
+
+	snapshot_write(w, &header, sizeof(header));
+	snapshot_write(w, vm->ops, vm->opslen);
+	snapshot_write(w, values, valueslen * sizeof(*values));
+	snapshot_write(w, vm->fstack, vm->fsptr * sizeof(*vm->fstack));
+	snapshot_write(w, vm->stack, vm->sptr * sizeof(*vm->stack));
 
-gil_word *gil_vm_array_data(struct gil_vm *vm, struct gil_vm_value *val) {
-	if (val->flags & GIL_VAL_SBO) {
-		return val->array.shortarray;
-	} else if (val->array.array) {
-		return val->array.array->data;
-	} else {
-		return NULL;
+	for (size_t i = 0; i < vm->cmoduleslen; ++i) {
+		struct snapshot_cmodule cmod = {vm->cmodules[i].id, vm->cmodules[i].ns != 0};
+		snapshot_write(w, &cmod, sizeof(cmod));
 	}
-}
+	snapshot_write(w, vm->modules, vm->moduleslen * sizeof(*vm->modules));
 
-gil_word gil_vm_array_get(struct gil_vm *vm, struct gil_vm_value *val, gil_word k) {
-	if (k >= val->array.length) {
-		return vm->knone;
+	snapshot_write_names(w, vmatoms, header.vmatomslen, vmatombytes);
+	if (names != NULL) {
+		snapshot_write_names(w, names, header.atomslen, atombytes);
 	}
 
-	if (val->flags & GIL_VAL_SBO) {
-		return val->array.shortarray[k];
+	for (size_t id = 0; id < valueslen; ++id) {
+		void **ptr;
+		if (snapshot_payload_ptr(&vm->values[id], &ptr)) {
+			uint64_t size = snapshot_payload_size(&vm->values[id]);
+			w->write(w, &size, sizeof(size));
+			snapshot_write(w, *ptr, size);
+		}
 	}
 
-	return val->array.array->data[k];
+	gil_allocator_free(vm->alloc, values);
+	gil_allocator_free(vm->alloc, vmatoms);
+	gil_allocator_free(vm->alloc, names);
+	return 0;
 }
 
-gil_word gil_vm_array_set(struct gil_vm *vm, struct gil_vm_value *val, gil_word k, gil_word v) {
-	if (k >= val->array.length) {
-		return gil_vm_error(vm, "Array index out of bounds");
+struct snapshot_reader {
+	unsigned char *image;
+	size_t len;
+	size_t pos;
+};
+
+// Get the next section, or NULL if the image is too short.
+static void *snapshot_take(struct snapshot_reader *r, uint64_t len) {
+	if (len > r->len - r->pos || snapshot_padded(len) > r->len - r->pos) {
+		return NULL;
 	}
 
-	if (val->flags & GIL_VAL_SBO) {
-		return val->array.shortarray[k] = v;
+	void *ptr = r->image + r->pos;
+	r->pos += snapshot_padded(len);
+	return ptr;
+}
+
+// Put 'count' NUL-terminated names into a string set,
+// which must give them the ids they had when they were saved.
+// Like in every string set, the first id is 1.
+static int snapshot_read_names(
+		struct gil_strset *set, const char *names, size_t bytes, size_t count) {
+	const char *end = names + bytes;
+	for (size_t i = 0; i < count; ++i) {
+		const char *nul = memchr(names, '\0', end - names);
+		if (nul == NULL || gil_strset_put_copy(set, names) != i + 1) {
+			return -1;
+		}
+
+		names = nul + 1;
 	}
 
-	return val->array.array->data[k] = v;
+	return 0;
 }
 
-static gil_word mod_init_alloc(void *ptr, const char *name) {
-	struct gil_vm *vm = ptr;
-	return gil_strset_put_copy(&vm->atomset, name);
+static int snapshot_check_id(struct snapshot_header *header, gil_word id) {
+	return id < header->valueslen ? 0 : -1;
 }
 
-void gil_vm_init(
-		struct gil_vm *vm, unsigned char *ops, size_t opslen, struct gil_module *builtins) {
-	if (!stdio_inited) {
-		std_output.w.write = gil_io_file_write;
-		std_output.f = stdout;
-		std_error.w.write = gil_io_file_write;
-		std_error.f = stderr;
-		stdio_inited = 1;
+// Bytecode positions may point right past the end, where the loaded VM
+// continues once more code has been added
+static int snapshot_check_pos(struct snapshot_header *header, gil_word pos) {
+	return pos <= header->opslen ? 0 : -1;
+}
+
+// Check that the ids and positions outside of the values are in range
+static int snapshot_check_state(
+		struct snapshot_header *header, struct gil_vm_stack_frame *fstack,
+		gil_word *stack, struct gil_vm_module *modules) {
+	if (
+			snapshot_check_id(header, header->knone) < 0 ||
+			snapshot_check_id(header, header->ktrue) < 0 ||
+			snapshot_check_id(header, header->kfalse) < 0 ||
+			snapshot_check_id(header, header->kstop) < 0 ||
+			(header->error != 0 && snapshot_check_id(header, header->error) < 0) ||
+			header->gc_start > header->valueslen ||
+			snapshot_check_pos(header, header->iptr) < 0) {
+		return -1;
 	}
 
-	vm->std_output = &std_output.w;
-	vm->std_error = &std_error.w;
+	for (size_t i = 0; i < header->fsptr; ++i) {
+		struct gil_vm_stack_frame *frame = &fstack[i];
+		if (
+				snapshot_check_id(header, frame->ns) < 0 ||
+				snapshot_check_id(header, frame->args) < 0 ||
+				frame->sptr > header->sptr ||
+				(frame->retptr != ~(gil_word)0 &&
+					snapshot_check_pos(header, frame->retptr) < 0)) {
+			return -1;
+		}
+	}
 
-	vm->halted = 0;
-	vm->need_gc = 0;
-	vm->need_check_retval = 0;
-	vm->ops = ops;
-	vm->opslen = opslen;
-	vm->iptr = 0;
-	vm->sptr = 0;
-	vm->fsptr = 0;
+	for (size_t i = 0; i < header->sptr; ++i) {
+		if (snapshot_check_id(header, stack[i]) < 0) {
+			return -1;
+		}
+	}
 
-	vm->valuessize = 128;
-	vm->values = malloc(sizeof(*vm->values) * vm->valuessize);
-	if (vm->values == NULL) {
-		gil_io_printf(vm->std_error, "Allocation failure\n");
-		vm->halted = 1;
-		return;
+	for (size_t i = 0; i < header->moduleslen; ++i) {
+		if (
+				snapshot_check_id(header, modules[i].ns) < 0 ||
+				snapshot_check_pos(header, modules[i].pos) < 0) {
+			return -1;
+		}
 	}
-	gil_bitset_init(&vm->valueset);
 
-	// Use ID 0 to represent an undeclared variable
-	gil_word undeclared_id = alloc_val(vm);
-	assert(undeclared_id == 0);
-	vm->values[undeclared_id].flags = GIL_VAL_TYPE_NONE | GIL_VAL_CONST;
+	return 0;
+}
 
-	// It's wasteful to allocate new 'none' variables all the time,
-	gil_word none_id = alloc_val(vm);
-	vm->values[none_id].flags = GIL_VAL_TYPE_NONE | GIL_VAL_CONST;
-	vm->knone = none_id;
-	vm->gc_start = none_id + 1;
+// Check that a value refers only to values in the image, and that
+// its payload of 'size' bytes (if it has one) is as big as it claims.
+static int snapshot_check_value(
+		struct gil_vm_value *val, size_t size, struct snapshot_header *header) {
+	switch (gil_value_get_type(val)) {
+	case GIL_VAL_TYPE_NONE:
+	case GIL_VAL_TYPE_ATOM:
+	case GIL_VAL_TYPE_REAL:
+		return 0;
+
+	case GIL_VAL_TYPE_BUFFER:
+		if (val->flags & GIL_VAL_SBO) {
+			return
+				val->shortbuffer.length <= GIL_VM_SHORT_BUFFER_MAX &&
+				val->shortbuffer.data[val->shortbuffer.length] == '\0' ? 0 : -1;
+		}
 
-	gil_strset_init(&vm->atomset);
+		return
+			size > sizeof(struct gil_vm_buffer) &&
+			val->buffer.length < size - sizeof(struct gil_vm_buffer) &&
+			val->buffer.buffer->data[val->buffer.length] == '\0' ? 0 : -1;
 
-	vm->next_ctype = 1;
-	vm->cmodules = NULL;
-	vm->cmoduleslen = 0;
+	case GIL_VAL_TYPE_ARRAY: {
+		gil_word *data = val->array.shortarray;
+		if (val->flags & GIL_VAL_SBO) {
+			if (val->array.length > 2) {
+				return -1;
+			}
+		} else {
+			struct gil_vm_array *arr = val->array.array;
+			if (
+					size < sizeof(*arr) ||
+					arr->size > (size - sizeof(*arr)) / sizeof(gil_word) ||
+					val->array.length > arr->size) {
+				return -1;
+			}
 
-	vm->modules = NULL;
-	vm->moduleslen = 0;
+			data = arr->data;
+		}
 
-#define X(name, k) \
-		vm->k = alloc_val(vm); \
-		vm->values[vm->k].flags = GIL_VAL_TYPE_ATOM | GIL_VAL_CONST; \
-		vm->values[vm->k].atom.atom = gil_strset_put_copy(&vm->atomset, name); \
-		vm->gc_start += 1;
-	GIL_BYTECODE_ATOMS
-#undef X
+		for (gil_word i = 0; i < val->array.length; ++i) {
+			if (snapshot_check_id(header, data[i]) < 0) {
+				return -1;
+			}
+		}
 
-	builtins->init(builtins, mod_init_alloc, vm);
-	gil_word builtins_id = builtins->create(builtins, vm, 0);
+		return 0;
+	}
 
-	// Need to allocate a frame stack for the builtins
-	vm->fstack[vm->fsptr].ns = builtins_id;
-	vm->fstack[vm->fsptr].retptr = 0;
-	vm->fstack[vm->fsptr].sptr = 0;
-	vm->fstack[vm->fsptr].args = 0;
-	vm->fsptr += 1;
+	case GIL_VAL_TYPE_NAMESPACE:
+		if (snapshot_check_id(header, val->ns.parent) < 0) {
+			return -1;
+		}
 
-	// Need to allocate a root namespace
-	gil_word root = alloc_val(vm);
-	vm->values[root].ns.parent = builtins_id;
-	vm->values[root].ns.ns = NULL;
-	vm->values[root].flags = GIL_VAL_TYPE_NAMESPACE;
-	vm->fstack[vm->fsptr].ns = root;
-	vm->fstack[vm->fsptr].retptr = ~(gil_word)0;
-	vm->fstack[vm->fsptr].sptr = 0;
-	vm->fstack[vm->fsptr].args = 0;
-	vm->fsptr += 1;
-}
+		if (val->flags & GIL_VAL_SBO) {
+			return snapshot_check_id(header, val->ns.shortval);
+		}
 
-void gil_vm_register_module(struct gil_vm *vm, struct gil_module *mod) {
-	gil_word id = gil_strset_put_copy(&vm->atomset, mod->name);
-	mod->init(mod, mod_init_alloc, vm);
+		if (val->ns.ns == NULL) {
+			return 0;
+		}
 
-	vm->cmoduleslen += 1;
-	vm->cmodules = realloc(vm->cmodules, vm->cmoduleslen * sizeof(*vm->cmodules));
-	struct gil_vm_cmodule *cmod = &vm->cmodules[vm->cmoduleslen - 1];
-	cmod->id = id;
-	cmod->ns = 0;
-	cmod->mod = mod;
-}
+		return gil_vm_namespace_check(val->ns.ns, size, header->valueslen);
 
-gil_word gil_vm_alloc(struct gil_vm *vm, enum gil_value_type typ, enum gil_value_flags flags) {
-	gil_word id = alloc_val(vm);
-	memset(&vm->values[id], 0, sizeof(vm->values[id]));
-	vm->values[id].flags = typ | flags;
-	return id;
-}
+	case GIL_VAL_TYPE_FUNCTION:
+		if (
+				snapshot_check_id(header, val->func.self) < 0 ||
+				snapshot_check_id(header, val->func.ns) < 0 ||
+				snapshot_check_pos(header, val->func.pos) < 0) {
+			return -1;
+		}
 
-gil_word gil_vm_alloc_ctype(struct gil_vm *vm) {
-	return vm->next_ctype++;
-}
+		return 0;
 
-gil_word gil_vm_error(struct gil_vm *vm, const char *fmt, ...) {
-	gil_word id = alloc_val(vm);
-	struct gil_vm_value *val = &vm->values[id];
-	val->flags = GIL_VAL_CONST | GIL_VAL_TYPE_ERROR;
+	case GIL_VAL_TYPE_CFUNCTION:
+		return snapshot_check_id(header, val->cfunc.self);
 
-	va_list va;
-	va_start(va, fmt);
-	val->error.error = gil_vstrf(fmt, va);
-	va_end(va);
+	// Only C values without a C value of their own are saved
+	case GIL_VAL_TYPE_CVAL:
+		if (val->cval.cval != NULL) {
+			return -1;
+		}
 
-	if (val->error.error == NULL) {
-		gil_io_printf(vm->std_error, "Failed to create error message\n");
-		vm->halted = 1;
-		return vm->knone;
-	}
+		return snapshot_check_id(header, val->cval.ns);
 
-	return id;
+	case GIL_VAL_TYPE_RETURN:
+		return snapshot_check_id(header, val->ret.ret);
+
+	case GIL_VAL_TYPE_ERROR:
+		return size > 0 && memchr(val->error.error, '\0', size) != NULL ? 0 : -1;
+
+	default:
+		return -1;
+	}
 }
 
-gil_word gil_vm_type_error(struct gil_vm *vm, struct gil_vm_value *val) {
-	enum gil_value_type typ = gil_value_get_type(val);
-	if (typ == GIL_VAL_TYPE_ERROR) {
-		return val - vm->values;
+static int snapshot_load(
+		struct gil_vm *vm, struct snapshot_reader *r, struct gil_module *builtins,
+		struct gil_module **mods, size_t modslen, struct gil_strset *atoms) {
+	struct snapshot_header *header = snapshot_take(r, sizeof(*header));
+	if (header == NULL || memcmp(header->magic, snapshot_magic, sizeof(header->magic)) != 0) {
+		gil_io_printf(vm->std_error, "Snapshot: Not a snapshot\n");
+		return -1;
 	}
 
-	return gil_vm_error(vm, "Unexpected type %s", gil_value_type_name(gil_value_get_type(val)));
-}
+	if (
+			header->major != GIL_MAJOR || header->minor != GIL_MINOR ||
+			header->byteorder != 0x01020304 ||
+			header->valuesize != sizeof(struct gil_vm_value) ||
+			header->ptrsize != sizeof(void *)) {
+		gil_io_printf(vm->std_error, "Snapshot: Made by an incompatible build\n");
+		return -1;
+	}
 
-void gil_vm_free(struct gil_vm *vm) {
-	struct gil_bitset_iterator it;
-	gil_bitset_iterator_init(&it, &vm->valueset);
-	size_t id;
-	while (gil_bitset_iterator_next(&it, &vm->valueset, &id)) {
-		gc_free(vm, id);
+	if (
+			header->fsptr > sizeof(vm->fstack) / sizeof(*vm->fstack) ||
+			header->sptr > sizeof(vm->stack) / sizeof(*vm->stack) ||
+			header->cmoduleslen != modslen ||
+			(atoms != NULL && header->atomslen == 0)) {
+		gil_io_printf(vm->std_error, "Snapshot: Doesn't match this VM\n");
+		return -1;
 	}
 
-	free(vm->values);
-	gil_bitset_free(&vm->valueset);
-	gil_strset_free(&vm->atomset);
-	free(vm->cmodules);
-}
+	unsigned char *ops = snapshot_take(r, header->opslen);
+	struct gil_vm_value *values = snapshot_take(
+			r, (uint64_t)header->valueslen * sizeof(*values));
+	struct gil_vm_stack_frame *fstack = snapshot_take(
+			r, header->fsptr * sizeof(*fstack));
+	gil_word *stack = snapshot_take(r, header->sptr * sizeof(*stack));
+	struct snapshot_cmodule *cmodules = snapshot_take(
+			r, header->cmoduleslen * sizeof(*cmodules));
+	struct gil_vm_module *modules = snapshot_take(
+			r, (uint64_t)header->moduleslen * sizeof(*modules));
+	const char *vmatoms = snapshot_take(r, header->vmatombytes);
+	const char *names = snapshot_take(r, header->atombytes);
+	unsigned char *payloads = snapshot_take(r, header->payloadbytes);
+	if (
+			ops == NULL || values == NULL || fstack == NULL || stack == NULL ||
+			cmodules == NULL || modules == NULL || vmatoms == NULL || names == NULL ||
+			payloads == NULL) {
+		gil_io_printf(vm->std_error, "Snapshot: Truncated image\n");
+		return -1;
+	}
 
-size_t gil_vm_gc(struct gil_vm *vm) {
-	for (gil_word sptr = 0; sptr < vm->sptr; ++sptr) {
-		gc_mark_base(vm, vm->stack[sptr]);
+	if (snapshot_check_state(header, fstack, stack, modules) < 0) {
+		gil_io_printf(vm->std_error, "Snapshot: Corrupt VM state\n");
+		return -1;
 	}
 
-	for (gil_word fsptr = 0; fsptr < vm->fsptr; ++fsptr) {
-		gc_mark_base(vm, vm->fstack[fsptr].ns);
-		gc_mark_base(vm, vm->fstack[fsptr].args);
+	vm->ops = ops;
+	vm->opslen = header->opslen;
+	vm->iptr = header->iptr;
+	vm->halted = 1;
+	vm->error = header->error;
+	vm->knone = header->knone;
+	vm->ktrue = header->ktrue;
+	vm->kfalse = header->kfalse;
+	vm->kstop = header->kstop;
+	vm->gc_start = header->gc_start;
+	vm->builtins = builtins;
+
+	if (header->valueslen > vm->valuessize && resize_values(vm, header->valueslen) < 0) {
+		gil_io_printf(vm->std_error, "Allocation failure\n");
+		return -1;
 	}
 
-	// Mark for all loaded C modules
-	for (size_t i = 0; i < vm->cmoduleslen; ++i) {
-		if (vm->cmodules[i].ns) {
-			gc_mark_base(vm, vm->cmodules[i].ns);
+	// The heap was compacted before it was saved, so every saved id is in use
+	memcpy(vm->values, values, header->valueslen * sizeof(*values));
+	for (size_t id = 0; id < header->valueslen; ++id) {
+		gil_bitset_set_next(&vm->valueset);
+	}
+
+	// The payloads are used right where they are in the image. Each one's
+	// size is replaced with an arena header, so that the VM can free and
+	// reallocate them like any other payload. They come in id order,
+	// one right after the other, so no two values can share one.
+	uint64_t next = 0;
+	for (size_t id = 0; id < header->valueslen; ++id) {
+		struct gil_vm_value *val = &vm->values[id];
+		void **ptr;
+		size_t size = 0;
+		if (snapshot_payload_ptr(val, &ptr)) {
+			uint64_t off = (uintptr_t)*ptr - 1;
+			uint64_t size64;
+			if (off != next || header->payloadbytes - off < sizeof(size64)) {
+				gil_io_printf(vm->std_error, "Snapshot: Corrupt payload\n");
+				return -1;
+			}
+
+			memcpy(&size64, payloads + off, sizeof(size64));
+			if (
+					size64 > UINT32_MAX ||
+					snapshot_padded(size64) > header->payloadbytes - off - sizeof(size64)) {
+				gil_io_printf(vm->std_error, "Snapshot: Corrupt payload\n");
+				return -1;
+			}
+
+			size = (size_t)size64;
+			*ptr = gil_arena_adopt(payloads + off, size);
+			next = off + sizeof(size64) + snapshot_padded(size);
+		} else if (gil_value_get_type(val) == GIL_VAL_TYPE_CFUNCTION) {
+			uintptr_t code = (uintptr_t)val->cfunc.func;
+			size_t mod = code >> 16;
+			size_t idx = code & 0xffff;
+			const gil_vm_cfunction *funcs = NULL;
+			if (mod <= modslen) {
+				funcs = mod == 0 ? builtins->functions : mods[mod - 1]->functions;
+			}
+
+			size_t count = 0;
+			while (funcs != NULL && funcs[count] != NULL) {
+				count += 1;
+			}
+
+			if (idx >= count) {
+				gil_io_printf(vm->std_error, "Snapshot: Unknown C function\n");
+				return -1;
+			}
+
+			val->cfunc.func = funcs[idx];
 		}
-		if (vm->cmodules[i].mod->marker) {
-			vm->cmodules[i].mod->marker(vm->cmodules[i].mod, vm, gc_mark_base);
+
+		if (snapshot_check_value(val, size, header) < 0) {
+			gil_io_printf(vm->std_error, "Snapshot: Corrupt value %zu\n", id);
+			return -1;
 		}
 	}
 
-	// Mark for all loaded Gilia modules
-	for (size_t i = 0; i < vm->moduleslen; ++i) {
-		if (vm->modules[i].ns) {
-			gc_mark_base(vm, vm->modules[i].ns);
+	if (snapshot_read_names(
+			&vm->atomset, vmatoms, header->vmatombytes, header->vmatomslen) < 0) {
+		gil_io_printf(vm->std_error, "Snapshot: Corrupt atoms\n");
+		return -1;
+	}
+	vm->atoms_complete = header->atomscomplete != 0;
+
+	if (atoms != NULL && snapshot_read_names(
+			atoms, names, header->atombytes, header->atomslen) < 0) {
+		gil_io_printf(vm->std_error, "Snapshot: Atoms don't match\n");
+		return -1;
+	}
+
+	builtins->init(builtins, mod_init_alloc, vm);
+	for (size_t i = 0; i < modslen; ++i) {
+		gil_vm_register_module(vm, mods[i]);
+		if (vm->cmodules[i].id != cmodules[i].id) {
+			gil_io_printf(vm->std_error, "Snapshot: Doesn't match this VM\n");
+			return -1;
+		}
+	}
+
+	vm->modules = gil_allocator_alloc(vm->alloc, header->moduleslen * sizeof(*modules));
+	if (header->moduleslen > 0 && vm->modules == NULL) {
+		gil_io_printf(vm->std_error, "Allocation failure\n");
+		return -1;
+	}
+	memcpy(vm->modules, modules, header->moduleslen * sizeof(*modules));
+	vm->moduleslen = header->moduleslen;
+
+	memcpy(vm->fstack, fstack, header->fsptr * sizeof(*fstack));
+	vm->fsptr = header->fsptr;
+	memcpy(vm->stack, stack, header->sptr * sizeof(*stack));
+	vm->sptr = header->sptr;
+
+	// The state of C modules isn't part of the image, so the ones
+	// which had been created are created again. Their old namespaces
+	// keep working, since their C functions are the same.
+	for (size_t i = 0; i < modslen; ++i) {
+		if (cmodules[i].created) {
+			vm->cmodules[i].ns = mods[i]->create(mods[i], vm, i);
 		}
 	}
 
-	return gc_sweep(vm);
+	vm->gc_bytes = 0;
+	return 0;
+}
+
+int gil_vm_snapshot_load(
+		struct gil_vm *vm, void *image, size_t len, struct gil_module *builtins,
+		struct gil_module **mods, size_t modslen, struct gil_strset *atoms) {
+	return gil_vm_snapshot_load_with_allocator(
+			vm, image, len, builtins, mods, modslen, atoms, &gil_default_allocator);
+}
+
+int gil_vm_snapshot_load_with_allocator(
+		struct gil_vm *vm, void *image, size_t len, struct gil_module *builtins,
+		struct gil_module **mods, size_t modslen, struct gil_strset *atoms,
+		struct gil_allocator *alloc) {
+	if (init_empty(vm, NULL, 0, alloc) < 0) {
+		return -1;
+	}
+
+	if ((uintptr_t)image % 8 != 0) {
+		gil_io_printf(vm->std_error, "Snapshot: The image isn't aligned to 8 bytes\n");
+		gil_vm_free(vm);
+		return -1;
+	}
+
+	struct snapshot_reader r = {image, len, 0};
+	if (snapshot_load(vm, &r, builtins, mods, modslen, atoms) < 0) {
+		gil_vm_free(vm);
+		return -1;
+	}
+
+	return 0;
 }
 
 void gil_vm_run(struct gil_vm *vm) {
@@ -564,8 +2686,8 @@ static void call_func(
 			memcpy(args->array.shortarray, argv, argc * sizeof(gil_word));
 		} else {
 			args->flags = GIL_VAL_TYPE_ARRAY;
-			args->array.array = malloc(
-					sizeof(struct gil_vm_array) + sizeof(gil_word) * argc);
+			args->array.array = gil_vm_malloc(
+					vm, sizeof(struct gil_vm_array) + sizeof(gil_word) * argc);
 			if (args->array.array == NULL) {
 				gil_io_printf(vm->std_error, "Allocation failure\n");
 				vm->stack[vm->sptr++] = vm->knone;
@@ -622,6 +2744,30 @@ static double read_d8le(struct gil_vm *vm) {
 	return num;
 }
 
+// Make 'val' a buffer with a copy of 'data'. Short buffers are stored inline,
+// so only longer ones can fail to allocate.
+static int set_buffer(
+		struct gil_vm *vm, struct gil_vm_value *val, const char *data, size_t len) {
+	if (len <= GIL_VM_SHORT_BUFFER_MAX) {
+		val->flags = GIL_VAL_TYPE_BUFFER | GIL_VAL_SBO;
+		val->shortbuffer.length = len;
+		memcpy(val->shortbuffer.data, data, len);
+		val->shortbuffer.data[len] = '\0';
+		return 0;
+	}
+
+	val->flags = GIL_VAL_TYPE_BUFFER;
+	val->buffer.length = len;
+	val->buffer.buffer = gil_vm_malloc_buffer(vm, len);
+	if (val->buffer.buffer == NULL) {
+		return -1;
+	}
+
+	memcpy(val->buffer.buffer->data, data, len);
+	val->buffer.buffer->data[len] = '\0';
+	return 0;
+}
+
 void gil_vm_step(struct gil_vm *vm) {
 	if (vm->need_check_retval) {
 		gil_trace("check retval");
@@ -629,9 +2775,11 @@ void gil_vm_step(struct gil_vm *vm) {
 		after_func_return(vm);
 
 		if (vm->need_gc) {
-			gil_trace("GC");
-			vm->need_gc = 0;
-			gil_vm_gc(vm);
+			gc_safe_point(vm);
+		}
+
+		if (vm->finalizequeuelen > 0) {
+			run_finalizers(vm);
 		}
 
 		return;
@@ -668,10 +2816,7 @@ void gil_vm_step(struct gil_vm *vm) {
 	case GIL_OP_DISCARD:
 		vm->sptr -= 1;
 		if (gil_value_get_type(&vm->values[vm->stack[vm->sptr]]) == GIL_VAL_TYPE_ERROR) {
-			gil_io_printf(
-					vm->std_error, "Error: %s\n",
-					vm->values[vm->stack[vm->sptr]].error.error);
-			vm->halted = 1;
+			halt_with_error(vm, vm->stack[vm->sptr]);
 		}
 		break;
 
@@ -689,10 +2834,7 @@ void gil_vm_step(struct gil_vm *vm) {
 		vm->stack[vm->sptr - 2] = vm->stack[vm->sptr - 1];
 		vm->sptr -= 1;
 		if (gil_value_get_type(&vm->values[vm->stack[vm->sptr]]) == GIL_VAL_TYPE_ERROR) {
-			gil_io_printf(
-					vm->std_error, "Error: %s\n",
-					vm->values[vm->stack[vm->sptr]].error.error);
-			vm->halted = 1;
+			halt_with_error(vm, vm->stack[vm->sptr]);
 		}
 		break;
 
@@ -737,7 +2879,7 @@ void gil_vm_step(struct gil_vm *vm) {
 	case GIL_OP_STACK_FRAME_LOOKUP: {
 		gil_word key = read_uint(vm);
 		struct gil_vm_value *ns = &vm->values[vm->fstack[vm->fsptr - 1].ns];
-		gil_word id = gil_vm_namespace_get(vm, ns, key);
+		gil_word id = gil_vm_namespace_get_cached(vm, ns, key, vm->iptr);
 		if (id == vm->kundeclared) {
 			vm->stack[vm->sptr++] = gil_vm_error(vm, "Variable not found");
 		} else {
@@ -750,7 +2892,10 @@ void gil_vm_step(struct gil_vm *vm) {
 		gil_word key = read_uint(vm); \
 		gil_word val = vm->stack[vm->sptr - 1]; \
 		struct gil_vm_value *ns = &vm->values[vm->fstack[vm->fsptr - 1].ns]; \
-		gil_vm_namespace_set(ns, key, val);
+		if (gil_vm_namespace_set(vm, ns, key, val) < 0) {
+			gil_io_printf(vm->std_error, "Allocation failure\n");
+			vm->halted = 1;
+		}
 	}
 		break;
 
@@ -758,7 +2903,13 @@ void gil_vm_step(struct gil_vm *vm) {
 		gil_word key = read_uint(vm);
 		gil_word val = vm->stack[vm->sptr - 1];
 		struct gil_vm_value *ns = &vm->values[vm->fstack[vm->fsptr - 1].ns];
-		if (gil_vm_namespace_replace(vm, ns, key, val) < 0) {
+		int ret = gil_vm_namespace_replace(vm, ns, key, val);
+		if (ret == -3) {
+			gil_io_printf(vm->std_error, "Allocation failure\n");
+			vm->halted = 1;
+		} else if (ret == -2) {
+			vm->stack[vm->sptr - 1] = gil_vm_error(vm, "Namespace is frozen");
+		} else if (ret < 0) {
 			vm->stack[vm->sptr - 1] = gil_vm_error(vm, "Variable not found");
 		}
 	}
@@ -792,7 +2943,10 @@ void gil_vm_step(struct gil_vm *vm) {
 		}
 
 		struct gil_vm_value *ns = &vm->values[frame->ns];
-		gil_vm_namespace_set(ns, key, val);
+		if (gil_vm_namespace_set(vm, ns, key, val) < 0) {
+			gil_io_printf(vm->std_error, "Allocation failure\n");
+			vm->halted = 1;
+		}
 	}
 		break;
 
@@ -844,17 +2998,12 @@ void gil_vm_step(struct gil_vm *vm) {
 		word = alloc_val(vm);
 		gil_word length = read_uint(vm);
 		gil_word offset = read_uint(vm);
-		vm->values[word].flags = GIL_VAL_TYPE_BUFFER;
-		vm->values[word].buffer.buffer = malloc(length + 1);
-		if (vm->values[word].buffer.buffer == NULL) {
+		if (set_buffer(vm, &vm->values[word], (const char *)vm->ops + offset, length) < 0) {
 			gil_io_printf(vm->std_error, "Allocation failure\n");
 			vm->halted = 1;
 			break;
 		}
 
-		vm->values[word].buffer.length = length;
-		memcpy(vm->values[word].buffer.buffer, vm->ops + offset, length);
-		vm->values[word].buffer.buffer[length] = '\0';
 		vm->stack[vm->sptr] = word;
 		vm->sptr += 1;
 	}
@@ -871,7 +3020,8 @@ void gil_vm_step(struct gil_vm *vm) {
 			data = arr->array.shortarray;
 		} else {
 			arr->flags = GIL_VAL_TYPE_ARRAY;
-			arr->array.array = malloc(sizeof(struct gil_vm_array) + count * sizeof(gil_word));
+			arr->array.array = gil_vm_malloc(
+					vm, sizeof(struct gil_vm_array) + count * sizeof(gil_word));
 			if (arr->array.array == NULL) {
 				gil_io_printf(vm->std_error, "Allocation failure\n");
 				vm->halted = 1;
@@ -912,8 +3062,13 @@ void gil_vm_step(struct gil_vm *vm) {
 		gil_word val = vm->stack[vm->sptr - 1];
 		gil_word ns_id = vm->stack[vm->sptr - 2];
 		struct gil_vm_value *ns = &vm->values[ns_id];
-		if (gil_value_get_type(ns) == GIL_VAL_TYPE_NAMESPACE) {
-			gil_vm_namespace_set(ns, key, val);
+		if (gil_value_get_type(ns) == GIL_VAL_TYPE_NAMESPACE && (ns->flags & GIL_VAL_CONST)) {
+			vm->stack[vm->sptr - 1] = gil_vm_error(vm, "Namespace is frozen");
+		} else if (gil_value_get_type(ns) == GIL_VAL_TYPE_NAMESPACE) {
+			if (gil_vm_namespace_set(vm, ns, key, val) < 0) {
+				gil_io_printf(vm->std_error, "Allocation failure\n");
+				vm->halted = 1;
+			}
 		} else {
 			vm->stack[vm->sptr - 1] = gil_vm_type_error(vm, ns);
 		}
@@ -924,8 +3079,21 @@ void gil_vm_step(struct gil_vm *vm) {
 		gil_word key = read_uint(vm);
 		gil_word ns_id = vm->stack[--vm->sptr];
 		struct gil_vm_value *ns = &vm->values[ns_id];
+
+		// What a frozen namespace has can't change, so the result
+		// (including the bound function) can be reused until the next GC
+		struct gil_vm_frozen_cache *frozen = NULL;
+		if (ns->flags & GIL_VAL_CONST) {
+			frozen = &vm->frozencache[vm->iptr & (GIL_VM_NAMESPACE_CACHE_SIZE - 1)];
+			if (frozen->ns == ns_id && frozen->key == key) {
+				vm->stack[vm->sptr++] = frozen->val;
+				break;
+			}
+		}
+
 		if (gil_value_get_type(ns) == GIL_VAL_TYPE_NAMESPACE) {
-			vm->stack[vm->sptr++] = gil_vm_namespace_get_or(vm, ns, key, vm->knone);
+			gil_word id = gil_vm_namespace_get_cached(vm, ns, key, vm->iptr);
+			vm->stack[vm->sptr++] = id == 0 ? vm->knone : id;
 		} else if (gil_value_get_type(ns) == GIL_VAL_TYPE_CVAL) {
 			ns = &vm->values[ns->cval.ns];
 			if (gil_value_get_type(ns) == GIL_VAL_TYPE_NAMESPACE) {
@@ -954,6 +3122,17 @@ void gil_vm_step(struct gil_vm *vm) {
 			}
 			vm->stack[vm->sptr - 1] = nval_id;
 		}
+
+		// Only keys the namespace has itself are fixed; its parents might not be frozen.
+		// The values might have moved when the function was bound.
+		ns = &vm->values[ns_id];
+		if (
+				frozen != NULL && gil_value_get_type(ns) == GIL_VAL_TYPE_NAMESPACE &&
+				gil_vm_namespace_get_own(ns, key) != 0) {
+			frozen->ns = ns_id;
+			frozen->key = key;
+			frozen->val = vm->stack[vm->sptr - 1];
+		}
 	}
 		break;
 
@@ -1038,8 +3217,11 @@ void gil_vm_step(struct gil_vm *vm) {
 		} else if (gil_value_get_type(container) == GIL_VAL_TYPE_NAMESPACE) {
 			if (gil_value_get_type(key) != GIL_VAL_TYPE_ATOM) {
 				vm->stack[vm->sptr - 1] = gil_vm_type_error(vm, key);
-			} else {
-				gil_vm_namespace_set(container, key->atom.atom, val);
+			} else if (container->flags & GIL_VAL_CONST) {
+				vm->stack[vm->sptr - 1] = gil_vm_error(vm, "Namespace is frozen");
+			} else if (gil_vm_namespace_set(vm, container, key->atom.atom, val) < 0) {
+				gil_io_printf(vm->std_error, "Allocation failure\n");
+				vm->halted = 1;
 			}
 		} else {
 			vm->stack[vm->sptr - 1] = gil_vm_type_error(vm, container);
@@ -1065,9 +3247,13 @@ void gil_vm_step(struct gil_vm *vm) {
 				continue;
 			}
 
+			// A C module's namespace is done once it's been created
 			if (!vm->cmodules[i].ns) {
-				vm->cmodules[i].ns = vm->cmodules[i].mod->create(
-					vm->cmodules[i].mod, vm, i);
+				gil_word ns = vm->cmodules[i].mod->create(vm->cmodules[i].mod, vm, i);
+				if (gil_value_get_type(&vm->values[ns]) == GIL_VAL_TYPE_NAMESPACE) {
+					vm->values[ns].flags |= GIL_VAL_CONST;
+				}
+				vm->cmodules[i].ns = ns;
 			}
 			vm->stack[vm->sptr++] = vm->cmodules[i].ns;
 			found = 1;
@@ -1110,7 +3296,8 @@ void gil_vm_step(struct gil_vm *vm) {
 
 		// Alloc a new module for it
 		vm->moduleslen += 1;
-		vm->modules = realloc(vm->modules, vm->moduleslen * sizeof(*vm->modules));
+		vm->modules = gil_allocator_realloc(
+				vm->alloc, vm->modules, vm->moduleslen * sizeof(*vm->modules));
 		vm->modules[vm->moduleslen - 1].pos = pos;
 		vm->modules[vm->moduleslen - 1].ns = ns_id;
 	}
@@ -1122,9 +3309,11 @@ void gil_vm_step(struct gil_vm *vm) {
 	}
 
 	if (vm->need_gc) {
-		gil_trace("GC");
-		vm->need_gc = 0;
-		gil_vm_gc(vm);
+		gc_safe_point(vm);
+	}
+
+	if (vm->finalizequeuelen > 0) {
+		run_finalizers(vm);
 	}
 }
 
@@ -1139,16 +3328,47 @@ gil_word gil_vm_make_atom(struct gil_vm *vm, gil_word val) {
 	return id;
 }
 
+int gil_vm_add_atoms(struct gil_vm *vm, struct gil_strset *atoms) {
+	if (gil_strset_extend(&vm->atomset, atoms) < 0) {
+		return -1;
+	}
+
+	vm->atoms_complete = 1;
+	return 0;
+}
+
+gil_word gil_vm_intern_atom(struct gil_vm *vm, const char *name, size_t len) {
+	// A new atom could get an id the bytecode uses for something else
+	if (!vm->atoms_complete) {
+		return (gil_word)gil_strset_get_n(&vm->atomset, name, len);
+	}
+
+	return (gil_word)gil_strset_put_copy_n(&vm->atomset, name, len);
+}
+
 gil_word gil_vm_make_real(struct gil_vm *vm, double val) {
 	gil_word id = gil_vm_alloc(vm, GIL_VAL_TYPE_REAL, 0);
 	vm->values[id].real.real = val;
 	return id;
 }
 
-gil_word gil_vm_make_buffer(struct gil_vm *vm, char *data, size_t len) {
+struct gil_vm_buffer *gil_vm_malloc_buffer(struct gil_vm *vm, size_t len) {
+	return gil_vm_malloc(vm, sizeof(struct gil_vm_buffer) + len + 1);
+}
+
+gil_word gil_vm_make_buffer(struct gil_vm *vm, struct gil_vm_buffer *buf, size_t len) {
+	if (len <= GIL_VM_SHORT_BUFFER_MAX) {
+		gil_word id = gil_vm_alloc(vm, GIL_VAL_TYPE_BUFFER, GIL_VAL_SBO);
+		vm->values[id].shortbuffer.length = len;
+		memcpy(vm->values[id].shortbuffer.data, buf->data, len);
+		vm->values[id].shortbuffer.data[len] = '\0';
+		gil_vm_dealloc(vm, buf);
+		return id;
+	}
+
 	gil_word id = gil_vm_alloc(vm, GIL_VAL_TYPE_BUFFER, 0);
 	vm->values[id].buffer.length = len;
-	vm->values[id].buffer.buffer = data;
+	vm->values[id].buffer.buffer = buf;
 	return id;
 }
 
@@ -67,6 +67,11 @@ print (== 10 20 30)
 # => (false)
 print (== 'a 'a 'a)
 # => (true)
+print "hi" == "hi" "hi" == "ho" "" == ""
+# => (true) (false) (true)
+long := "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxa"
+print long == "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxa" long == "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxb" long == long
+# => (true) (false) (true)
 
 print "!="
 # => !=
@@ -0,0 +1,22 @@
+# Values which survive a burst of garbage keep working after the heap
+# has been compacted and shrunk
+keep := {name: "keep"; nums: [1 2 3]}
+
+burst := none
+i := 0
+while {i < 3000} {
+	burst = [i burst]
+	i += 1
+}
+
+late := {double: {$.0 * 2}; parent: keep}
+burst = none
+
+i := 0
+while {i < 3000} {
+	tmp := [i i]
+	i += 1
+}
+
+print keep.name keep.nums.2 (late.double 21) late.parent.nums.0
+# => keep 3 42 1
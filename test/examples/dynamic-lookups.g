@@ -24,3 +24,11 @@ get-ident := {'foo}
 obj.(get-ident()) = 100
 print obj.foo
 # => 100
+
+# Lookup into a namespace by an atom made from a string at runtime
+key := "foo"
+print obj.(atom key)
+# => 100
+obj.(atom "new-key") = 20
+print obj.new-key (atom "new-key") ((atom "hello") == 'hello)
+# => 20 (atom new-key) (true)
@@ -0,0 +1,16 @@
+# Deeply nested structures shouldn't trip up the GC
+list := none
+i := 0
+while {i < 1000} {
+	list = {next: list; val: i}
+	i += 1
+}
+
+n := 0
+node := list
+while {node != none} {
+	n += 1
+	node = node.next
+}
+print n
+# => 1000
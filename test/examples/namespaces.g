@@ -17,3 +17,21 @@ print obj.bar.baz
 # Empty namespace literal (should parse to namespace, not function)
 print {}
 # => (namespace)
+
+# Frozen namespaces can't be changed any more
+frozen := freeze {
+	x: 10
+	add: |a b| {a + b}
+}
+print frozen.x (frozen.add 1 2)
+# => 10 3
+
+# Lookups in frozen namespaces are cached, which must survive GCs
+sum := 0
+i := 0
+while {i < 1000} {
+	sum = frozen.add sum frozen.x
+	i = i + 1
+}
+print sum
+# => 10000
@@ -0,0 +1,119 @@
+#include "arena.h"
+
+#include <string.h>
+#include <snow/snow.h>
+
+describe(gil_arena) {
+	struct gil_arena arena;
+
+	before_each() {
+		gil_arena_init(&arena);
+	}
+
+	after_each() {
+		gil_arena_free(&arena);
+	}
+
+	test("basic functionality") {
+		char *a = gil_arena_alloc(&arena, 10);
+		char *b = gil_arena_alloc(&arena, 10);
+		assert(a != b);
+		memcpy(a, "hello", 6);
+		memcpy(b, "world", 6);
+		asserteq(a, "hello");
+		asserteq(b, "world");
+		asserteq(arena.stats.requested_bytes, 20);
+		asserteq(arena.stats.used_bytes, 64);
+	}
+
+	it("reuses freed blocks of the same size class") {
+		void *a = gil_arena_alloc(&arena, 40);
+		gil_arena_dealloc(&arena, a);
+		asserteq(arena.stats.free_bytes, 48);
+		assert(gil_arena_alloc(&arena, 36) == a);
+		asserteq(arena.stats.free_bytes, 0);
+	}
+
+	it("handles large allocations") {
+		char *a = gil_arena_alloc(&arena, 100000);
+		memset(a, 'x', 100000);
+		asserteq(arena.stats.large_bytes, 100000);
+		gil_arena_dealloc(&arena, a);
+		asserteq(arena.stats.large_bytes, 0);
+	}
+
+	it("gives huge allocations back when they're freed") {
+		size_t size = GIL_ARENA_MAP_THRESHOLD * 2;
+		char *a = gil_arena_alloc(&arena, size);
+		memset(a, 'x', size);
+		assert(arena.stats.large_bytes + arena.stats.mapped_bytes >= size);
+		a = gil_arena_realloc(&arena, a, size + 1);
+		a = gil_arena_realloc(&arena, a, size * 2);
+		asserteq(a[size - 1], 'x');
+		gil_arena_dealloc(&arena, a);
+		asserteq(arena.stats.large_bytes, 0);
+		asserteq(arena.stats.mapped_bytes, 0);
+	}
+
+	it("keeps the contents when reallocating") {
+		char *a = gil_arena_alloc(&arena, 6);
+		memcpy(a, "hello", 6);
+		a = gil_arena_realloc(&arena, a, 1000);
+		asserteq(a, "hello");
+		a = gil_arena_realloc(&arena, a, 10000);
+		asserteq(a, "hello");
+		a = gil_arena_realloc(&arena, a, 6);
+		asserteq(a, "hello");
+		asserteq(arena.stats.large_bytes, 0);
+		asserteq(arena.stats.requested_bytes, 6);
+	}
+
+	it("knows the size of each allocation") {
+		void *a = gil_arena_alloc(&arena, 10);
+		asserteq(gil_arena_size(&arena, a), 10);
+		a = gil_arena_realloc(&arena, a, 12);
+		asserteq(gil_arena_size(&arena, a), 12);
+		a = gil_arena_realloc(&arena, a, 10000);
+		asserteq(gil_arena_size(&arena, a), 10000);
+		a = gil_arena_realloc(&arena, a, GIL_ARENA_MAP_THRESHOLD * 2);
+		asserteq(gil_arena_size(&arena, a), GIL_ARENA_MAP_THRESHOLD * 2);
+		gil_arena_dealloc(&arena, a);
+	}
+
+	it("adopts memory it doesn't own") {
+		uint64_t mem[4];
+		char *a = gil_arena_adopt(mem, 6);
+		asserteq((void *)a, (void *)&mem[1]);
+		memcpy(a, "hello", 6);
+		asserteq(gil_arena_size(&arena, a), 6);
+		asserteq(arena.stats.used_bytes, 0);
+
+		gil_arena_dealloc(&arena, gil_arena_adopt(mem + 2, 8));
+		asserteq(arena.stats.free_bytes, 0);
+
+		char *b = gil_arena_realloc(&arena, a, 100);
+		assert(b != a);
+		asserteq(b, "hello");
+		asserteq(a, "hello");
+		gil_arena_dealloc(&arena, b);
+	}
+
+	it("handles a whole bunch of allocations") {
+		void *ptrs[1000];
+		for (int i = 0; i < 1000; ++i) {
+			ptrs[i] = gil_arena_alloc(&arena, i * 8);
+			memset(ptrs[i], i & 0xff, i * 8);
+		}
+
+		for (int i = 0; i < 1000; i += 2) {
+			gil_arena_dealloc(&arena, ptrs[i]);
+		}
+
+		for (int i = 1; i < 1000; i += 2) {
+			unsigned char *ptr = ptrs[i];
+			for (int j = 0; j < i * 8; ++j) {
+				asserteq(ptr[j], i & 0xff);
+			}
+		}
+	}
+}
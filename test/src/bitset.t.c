@@ -88,4 +88,89 @@ describe(gil_bitset) {
 
 		asserteq(expected, 10000);
 	}
+
+	test("seek") {
+		for (int i = 0; i < 1000; ++i) {
+			asserteq(gil_bitset_set_next(&set), i);
+		}
+
+		gil_bitset_unset(&set, 10);
+		gil_bitset_unset(&set, 200);
+		gil_bitset_unset(&set, 201);
+
+		gil_bitset_seek(&set, 100);
+		asserteq(gil_bitset_set_next(&set), 200);
+		asserteq(gil_bitset_set_next(&set), 201);
+
+		gil_bitset_seek(&set, 0);
+		asserteq(gil_bitset_set_next(&set), 10);
+		asserteq(gil_bitset_set_next(&set), 1000);
+	}
+
+	test("seek past the end") {
+		gil_bitset_seek(&set, 100000);
+		asserteq(gil_bitset_set_next(&set), 99968);
+		asserteq(gil_bitset_get(&set, 99968), 1);
+	}
+
+	test("count and shrink") {
+		for (int i = 0; i < 10000; ++i) {
+			gil_bitset_set_next(&set);
+		}
+		for (int i = 100; i < 10000; ++i) {
+			gil_bitset_unset(&set, i);
+		}
+		gil_bitset_set(&set, 50000 / 64);
+		asserteq(gil_bitset_count(&set), 101);
+
+		gil_bitset_unset(&set, 50000 / 64);
+		gil_bitset_shrink(&set);
+		asserteq(gil_bitset_count(&set), 100);
+		asserteq(set.tableslen, 4);
+		asserteq(gil_bitset_set_next(&set), 100);
+		asserteq(gil_bitset_get(&set, 99), 1);
+	}
+
+	test("shrink with full tables") {
+		for (int i = 0; i < 64 * 5; ++i) {
+			gil_bitset_set_next(&set);
+		}
+		for (int i = 0; i < 64; ++i) {
+			gil_bitset_unset(&set, i);
+			gil_bitset_set(&set, i);
+		}
+		gil_bitset_shrink(&set);
+		asserteq(gil_bitset_set_next(&set), 64 * 5);
+	}
+
+	test("set run") {
+		gil_bitset_set(&set, 3);
+		gil_bitset_set(&set, 10);
+		size_t start;
+		asserteq(gil_bitset_set_run(&set, 1000, &start), 3);
+		asserteq(start, 0);
+		asserteq(gil_bitset_set_run(&set, 1000, &start), 6);
+		asserteq(start, 4);
+		asserteq(gil_bitset_set_run(&set, 20, &start), 9);
+		asserteq(start, 11);
+		asserteq(gil_bitset_set_run(&set, 20, &start), 1);
+		asserteq(start, 20);
+		asserteq(gil_bitset_set_run(&set, 1000, &start), 43);
+		asserteq(start, 21);
+		asserteq(gil_bitset_set_next(&set), 64);
+	}
+
+	test("retain") {
+		for (int i = 0; i < 128; ++i) {
+			gil_bitset_set_next(&set);
+		}
+		asserteq(gil_bitset_retain(&set, 1, ~(gil_bitset_entry)0), 0);
+		asserteq(gil_bitset_retain(&set, 1, ~(gil_bitset_entry)0x0f), 0x0f);
+		asserteq(gil_bitset_count(&set), 124);
+		asserteq(gil_bitset_get(&set, 64), 0);
+		asserteq(gil_bitset_get(&set, 68), 1);
+
+		gil_bitset_seek(&set, 0);
+		asserteq(gil_bitset_set_next(&set), 64);
+	}
 }
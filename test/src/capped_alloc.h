@@ -0,0 +1,36 @@
+#ifndef GIL_TEST_CAPPED_ALLOC_H
+#define GIL_TEST_CAPPED_ALLOC_H
+
+#include "alloc.h"
+
+#include <stdlib.h>
+
+// An allocator which refuses anything bigger than 'max' bytes
+struct capped_allocator {
+	struct gil_allocator base;
+	size_t max;
+};
+
+static void *capped_alloc(void *data, size_t size) {
+	struct capped_allocator *cap = data;
+	return size > cap->max ? NULL : malloc(size);
+}
+
+static void *capped_realloc(void *data, void *ptr, size_t size) {
+	struct capped_allocator *cap = data;
+	return size > cap->max ? NULL : realloc(ptr, size);
+}
+
+static void capped_free(void *data, void *ptr) {
+	free(ptr);
+}
+
+static void capped_allocator_init(struct capped_allocator *cap, size_t max) {
+	cap->base.alloc = capped_alloc;
+	cap->base.realloc = capped_realloc;
+	cap->base.free = capped_free;
+	cap->base.data = cap;
+	cap->max = max;
+}
+
+#endif
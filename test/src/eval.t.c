@@ -13,6 +13,79 @@ static struct gil_io_mem_reader r;
 static struct gil_generator gen;
 static struct gil_io_mem_writer w;
 static struct gil_vm vm;
+static size_t mem_limit = 0;
+static struct gil_vm_gc_policy *policy = NULL;
+static struct gil_allocator *allocator = &gil_default_allocator;
+
+struct counting_allocator {
+	struct gil_allocator base;
+	size_t calls;
+	size_t live;
+};
+
+static void *counting_alloc(void *data, size_t size) {
+	struct counting_allocator *ca = data;
+	ca->calls += 1;
+	ca->live += 1;
+	return malloc(size);
+}
+
+static void *counting_realloc(void *data, void *ptr, size_t size) {
+	struct counting_allocator *ca = data;
+	ca->calls += 1;
+	if (ptr == NULL) {
+		ca->live += 1;
+	}
+	return realloc(ptr, size);
+}
+
+static void counting_free(void *data, void *ptr) {
+	struct counting_allocator *ca = data;
+	ca->calls += 1;
+	ca->live -= 1;
+	free(ptr);
+}
+
+static int finalized = 0;
+
+static void count_finalize(struct gil_vm *vm, void *cval) {
+	finalized += *(int *)cval;
+}
+
+struct held_context {
+	struct gil_vm_contcontext base;
+	gil_word held;
+};
+
+static void held_marker(
+		struct gil_vm *vm, void *data, int depth,
+		void (*mark)(struct gil_vm *vm, gil_word id, int depth)) {
+	struct held_context *ctx = data;
+	mark(vm, ctx->held, depth + 1);
+}
+
+static void held_relocator(
+		struct gil_vm *vm, void *data,
+		void (*relocate)(struct gil_vm *vm, gil_word *id)) {
+	struct held_context *ctx = data;
+	relocate(vm, &ctx->held);
+}
+
+// Push a continuation which holds on to 'held'
+static struct held_context *hold(gil_word held, gil_vm_gcrelocator relocator) {
+	struct held_context *ctx = gil_vm_malloc(&vm, sizeof(*ctx));
+	ctx->base.callback = NULL;
+	ctx->base.marker = held_marker;
+	ctx->base.relocator = relocator;
+	ctx->base.args = 0;
+	ctx->held = held;
+
+	gil_word id = gil_vm_alloc(&vm, GIL_VAL_TYPE_CONTINUATION, 0);
+	vm.values[id].cont.call = vm.knone;
+	vm.values[id].cont.cont = &ctx->base;
+	vm.stack[vm.sptr++] = id;
+	return ctx;
+}
 
 static struct gil_vm_value *var_lookup(const char *name) {
 	gil_word atom_id = gil_strset_get(&gen.atomset, name);
@@ -27,9 +100,13 @@ static int eval_impl(const char *str, struct gil_parse_error *err) {
 	r.mem = str;
 	gil_lexer_init(&lex, &r.r);
 
-	struct gil_mod_builtins builtins;
+	// The VM holds on to its builtins module
+	static struct gil_mod_builtins builtins;
 	gil_mod_builtins_init(&builtins);
 
+	// The VM reads its bytecode from the writer's memory,
+	// so it's only freed once the next program is evaluated
+	free(w.mem);
 	w.w.write = gil_io_mem_write;
 	w.len = 0;
 	w.size = 0;
@@ -38,14 +115,26 @@ static int eval_impl(const char *str, struct gil_parse_error *err) {
 
 	struct gil_parse_context ctx = {&lex, &gen, err};
 	if (gil_parse_program(&ctx) < 0) {
-		free(w.mem);
 		return -1;
 	}
 
-	gil_vm_init(&vm, w.mem, w.len / sizeof(gil_word), &builtins.base);
-	gil_vm_run(&vm);
+	for (gil_word i = 0; i < gen.relocslen; ++i) {
+		gil_word pos = gen.relocs[i].pos;
+		gil_word rep = gen.relocs[i].replacement;
+		unsigned char *mem = &((unsigned char *)w.mem)[pos];
+		mem[0] = rep & 0xff;
+		mem[1] = (rep >> 8) & 0xff;
+		mem[2] = (rep >> 16) & 0xff;
+		mem[3] = (rep >> 24) & 0xff;
+	}
 
-	free(w.mem);
+	gil_vm_init_with_allocator(&vm, w.mem, w.len, &builtins.base, allocator);
+	gil_vm_add_atoms(&vm, &gen.atomset);
+	if (policy != NULL) {
+		gil_vm_set_gc_policy(&vm, policy);
+	}
+	gil_vm_set_memory_limit(&vm, mem_limit);
+	gil_vm_run(&vm);
 	return 0;
 }
 
@@ -85,7 +174,374 @@ describe(eval) {
 
 		asserteq(gil_value_get_type(var_lookup("foo")), GIL_VAL_TYPE_BUFFER);
 		struct gil_vm_value *buf = var_lookup("foo");
-		asserteq(buf->buffer.length, 11);
-		assert(strncmp(buf->buffer.buffer, "hello world", 11) == 0);
+		asserteq(gil_vm_buffer_length(buf), 11);
+		assert(strncmp(gil_vm_buffer_data(buf), "hello world", 11) == 0);
+	}
+
+	test("short strings are stored inline") {
+		eval("foo := \"hello\"\nbar := \"hello, this is a long string\"");
+		defer(gil_vm_free(&vm));
+		defer(gil_gen_free(&gen));
+
+		struct gil_vm_value *foo = var_lookup("foo");
+		asserteq(foo->flags & GIL_VAL_SBO, GIL_VAL_SBO);
+		asserteq(gil_vm_buffer_length(foo), 5);
+		asserteq(gil_vm_buffer_data(foo), "hello");
+
+		struct gil_vm_value *bar = var_lookup("bar");
+		asserteq(bar->flags & GIL_VAL_SBO, 0);
+		asserteq(gil_vm_buffer_length(bar), 28);
+		asserteq(gil_vm_buffer_data(bar), "hello, this is a long string");
+	}
+
+	test("memory limit") {
+		mem_limit = 100000;
+		eval("arr := [1 2 3]\nwhile {'true} {arr = [arr arr]}");
+		mem_limit = 0;
+		defer(gil_vm_free(&vm));
+		defer(gil_gen_free(&gen));
+
+		asserteq(vm.halted, 1);
+		asserteq(gil_value_get_type(&vm.values[vm.error]), GIL_VAL_TYPE_ERROR);
+		asserteq(vm.values[vm.error].error.error, "Memory limit exceeded");
+
+		struct gil_vm_memory_usage usage;
+		gil_vm_get_memory_usage(&vm, &usage);
+		asserteq(usage.limit, 100000);
+		assert(usage.value_bytes + usage.payload_bytes > 100000);
+	}
+
+	test("resume after the memory limit") {
+		mem_limit = 100000;
+		eval(
+			"arr := [1 2 3]\nn := 0\n"
+			"while {n < 20000} {arr = [arr n]; n += 1}\n"
+			"done := n\n");
+		mem_limit = 0;
+		defer(gil_vm_free(&vm));
+		defer(gil_gen_free(&gen));
+
+		asserteq(vm.halted, 1);
+		assert(vm.error != 0);
+
+		gil_vm_set_memory_limit(&vm, 0);
+		vm.halted = 0;
+		vm.error = 0;
+		gil_vm_run(&vm);
+		asserteq(vm.error, 0);
+		asserteq(var_lookup("done")->real.real, 20000);
+	}
+
+	test("the error survives gc and compaction") {
+		eval(
+			"n := 0\nwhile {n < 1000} {n += 1; [n n]}\n"
+			"1 + \"a\"\n");
+		defer(gil_vm_free(&vm));
+		defer(gil_gen_free(&gen));
+
+		// The error was discarded, so only 'error' still refers to it
+		asserteq(vm.halted, 1);
+		assert(vm.error != 0);
+
+		gil_vm_gc(&vm);
+		assert(gil_vm_compact(&vm) > 0);
+		asserteq(gil_value_get_type(&vm.values[vm.error]), GIL_VAL_TYPE_ERROR);
+		asserteq(vm.values[vm.error].error.error, "Unexpected type BUFFER");
+	}
+
+	test("payload growth is counted once") {
+		eval("x := 10");
+		defer(gil_vm_free(&vm));
+		defer(gil_gen_free(&gen));
+
+		size_t before = vm.gc_bytes;
+		void *ptr = gil_vm_malloc(&vm, 16);
+		for (size_t size = 32; size <= 1024; size += 16) {
+			ptr = gil_vm_realloc(&vm, ptr, size);
+		}
+		ptr = gil_vm_realloc(&vm, ptr, 100);
+		asserteq(vm.gc_bytes - before, 1024);
+		gil_vm_dealloc(&vm, ptr);
+	}
+
+	test("custom allocator") {
+		struct counting_allocator ca = {
+			.base = {counting_alloc, counting_realloc, counting_free, &ca},
+		};
+		allocator = &ca.base;
+		eval("arr := [1 2 3]\nns := {a: arr; b: \"hello\"}");
+		allocator = &gil_default_allocator;
+		defer(gil_gen_free(&gen));
+
+		asserteq(gil_value_get_type(var_lookup("ns")), GIL_VAL_TYPE_NAMESPACE);
+		assert(ca.calls > 0);
+		gil_vm_free(&vm);
+		asserteq(ca.live, 0);
+	}
+
+	test("finalizers") {
+		eval("x := 10");
+		defer(gil_gen_free(&gen));
+
+		static int one = 1;
+		finalized = 0;
+		gil_word ctype = gil_vm_register_ctype(&vm, count_finalize);
+		gil_vm_make_cval(&vm, ctype, vm.knone, &one);
+		gil_vm_make_cval(&vm, ctype, vm.knone, NULL);
+		vm.stack[vm.sptr++] = gil_vm_make_cval(&vm, ctype, vm.knone, &one);
+
+		// The collected value's finalizer is queued up, not run by the GC
+		gil_vm_gc(&vm);
+		asserteq(finalized, 0);
+		asserteq(vm.finalizequeuelen, 1);
+
+		// The live value gets finalized when the VM is freed
+		gil_vm_free(&vm);
+		asserteq(finalized, 2);
+	}
+
+	test("parallel gc") {
+		// Long enough to get a heap the parallel collector works on,
+		// with a cycle in every node
+		const char *prog =
+			"list := none\n"
+			"i := 0\n"
+			"while {i < 40000} {\n"
+			"	node := {next: list; val: i}\n"
+			"	node.self = node\n"
+			"	list = node\n"
+			"	garbage := [i [i] {i: i}]\n"
+			"	i += 1\n"
+			"}\n";
+
+		eval(prog);
+		size_t len = vm.valuessize;
+		gil_vm_gc(&vm);
+		char *live = malloc(len);
+		defer(free(live));
+		for (size_t id = 0; id < len; ++id) {
+			live[id] = gil_bitset_get(&vm.valueset, id);
+		}
+		gil_vm_free(&vm);
+		gil_gen_free(&gen);
+
+		eval(prog);
+		defer(gil_vm_free(&vm));
+		defer(gil_gen_free(&gen));
+		assert(vm.valuessize >= 1 << 16);
+		asserteq(vm.valuessize, len);
+
+		vm.gc_threads = 4;
+		gil_vm_gc(&vm);
+		for (size_t id = 0; id < len; ++id) {
+			asserteq(gil_bitset_get(&vm.valueset, id), live[id]);
+		}
+
+		struct gil_vm_value *node = var_lookup("list");
+		for (int i = 39999; i >= 0; --i) {
+			asserteq(gil_value_get_type(node), GIL_VAL_TYPE_NAMESPACE);
+			gil_word val = gil_vm_namespace_get(&vm, node, gil_strset_get(&gen.atomset, "val"));
+			asserteq(vm.values[val].real.real, i);
+			node = &vm.values[gil_vm_namespace_get(
+					&vm, node, gil_strset_get(&gen.atomset, "next"))];
+		}
+	}
+
+	test("compaction and values held by C code") {
+		eval("x := 10");
+		defer(gil_vm_free(&vm));
+		defer(gil_gen_free(&gen));
+
+		for (int i = 0; i < 1000; ++i) {
+			gil_vm_make_real(&vm, i);
+		}
+
+		gil_word pinned = gil_vm_make_real(&vm, 10);
+		gil_word moving = gil_vm_make_real(&vm, 20);
+		struct held_context *a = hold(pinned, NULL);
+		struct held_context *b = hold(moving, held_relocator);
+		assert(gil_vm_compact(&vm) > 0);
+
+		// Without a relocator, the value has to stay where it is
+		asserteq(a->held, pinned);
+		asserteq(vm.values[a->held].real.real, 10);
+		assert(b->held != moving);
+		asserteq(vm.values[b->held].real.real, 20);
+	}
+
+	test("heap grows and shrinks across chunks") {
+		// Room for all of it up front, so that the lists end up one after
+		// the other. Then the middle one is dropped.
+		struct gil_vm_gc_policy big;
+		gil_vm_gc_policy_init(&big);
+		big.min_values = (size_t)1 << 22;
+		big.trigger_bytes = 0;
+		policy = &big;
+		eval(
+			"a := none\nb := none\nc := none\n"
+			"i := 0\nwhile {i < 60000} {a = {next: a}; i += 1}\n"
+			"i = 0\nwhile {i < 60000} {b = {next: b}; i += 1}\n"
+			"i = 0\nwhile {i < 60000} {c = {next: c}; i += 1}\n"
+			"b = none\n");
+		policy = NULL;
+		defer(gil_vm_free(&vm));
+		defer(gil_gen_free(&gen));
+
+		size_t chunk = (size_t)1 << 17;
+		assert(vm.valuessize >= big.min_values);
+		if (vm.valuesreserved != 0) {
+			assert(vm.valuescommitted >= vm.valuessize);
+			asserteq(vm.valuescommitted % chunk, 0);
+		}
+
+		// The chunks left empty in the middle are given back,
+		// but stay usable
+		gil_vm_gc(&vm);
+		size_t empty = 0;
+		size_t middle = 0;
+		for (size_t start = 0; start + chunk <= vm.valuessize; start += chunk) {
+			size_t id = start;
+			while (id < start + chunk && !gil_bitset_get(&vm.valueset, id)) {
+				id += 1;
+			}
+
+			if (id < start + chunk) {
+				middle += empty;
+				empty = 0;
+			} else {
+				empty += 1;
+				vm.values[start].flags = GIL_VAL_TYPE_NONE;
+				asserteq(vm.values[start].flags, GIL_VAL_TYPE_NONE);
+			}
+		}
+		assert(middle > 0);
+
+		// Dropping the rest shrinks the heap back into one chunk
+		struct gil_vm_gc_policy small;
+		gil_vm_gc_policy_init(&small);
+		gil_vm_set_gc_policy(&vm, &small);
+		struct gil_vm_value *ns = &vm.values[vm.fstack[1].ns];
+		gil_vm_namespace_set(&vm, ns, gil_strset_get(&gen.atomset, "a"), vm.knone);
+		gil_vm_namespace_set(&vm, ns, gil_strset_get(&gen.atomset, "c"), vm.knone);
+		gil_vm_compact(&vm);
+		assert(vm.valuessize < chunk);
+		if (vm.valuesreserved != 0) {
+			asserteq(vm.valuescommitted, chunk);
+		}
+
+		// And it grows again
+		gil_word id = 0;
+		for (size_t i = 0; i < 2 * chunk; ++i) {
+			id = gil_vm_make_real(&vm, i);
+		}
+		assert(vm.valuessize > 2 * chunk);
+		asserteq(vm.values[id].real.real, 2 * chunk - 1);
+	}
+
+	test("snapshot") {
+		eval("foo := [1 2 3]\nbar := {x: \"hello\"}\nbaz := {10}");
+		defer(gil_gen_free(&gen));
+
+		struct gil_io_mem_writer image = {
+			.w.write = gil_io_mem_write,
+		};
+		defer(free(image.mem));
+		asserteq(gil_vm_snapshot_save(&vm, &gen.atomset, &image.w), 0);
+		gil_vm_free(&vm);
+
+		struct gil_mod_builtins builtins;
+		gil_mod_builtins_init(&builtins);
+		asserteq(gil_vm_snapshot_load(
+				&vm, image.mem, image.len, &builtins.base, NULL, 0, NULL), 0);
+		defer(gil_vm_free(&vm));
+
+		struct gil_vm_value *foo = var_lookup("foo");
+		asserteq(gil_value_get_type(foo), GIL_VAL_TYPE_ARRAY);
+		asserteq(foo->array.length, 3);
+		asserteq(vm.values[gil_vm_array_get(&vm, foo, 2)].real.real, 3);
+
+		gil_word x = gil_vm_namespace_get(
+				&vm, var_lookup("bar"), gil_strset_get(&gen.atomset, "x"));
+		asserteq(gil_value_get_type(&vm.values[x]), GIL_VAL_TYPE_BUFFER);
+		asserteq(gil_vm_buffer_data(&vm.values[x]), "hello");
+
+		asserteq(gil_value_get_type(var_lookup("baz")), GIL_VAL_TYPE_FUNCTION);
+
+		// The payloads are used right where they are in the image
+		char *payload = (char *)foo->array.array;
+		assert(payload > (char *)image.mem && payload < (char *)image.mem + image.len);
+		foo->array.array = gil_vm_realloc(
+				&vm, foo->array.array, sizeof(struct gil_vm_array) + 10 * sizeof(gil_word));
+		foo->array.array->size = 10;
+		assert((char *)foo->array.array != payload);
+		asserteq(vm.values[gil_vm_array_get(&vm, foo, 2)].real.real, 3);
+	}
+
+	test("snapshot with an allocator") {
+		eval("foo := [1 2 3]\nbar := {x: \"hello\"}");
+		defer(gil_gen_free(&gen));
+
+		struct gil_io_mem_writer image = {
+			.w.write = gil_io_mem_write,
+		};
+		defer(free(image.mem));
+		asserteq(gil_vm_snapshot_save(&vm, &gen.atomset, &image.w), 0);
+		gil_vm_free(&vm);
+
+		struct counting_allocator ca = {
+			.base = {counting_alloc, counting_realloc, counting_free, &ca},
+		};
+		struct gil_mod_builtins builtins;
+		gil_mod_builtins_init(&builtins);
+		asserteq(gil_vm_snapshot_load_with_allocator(
+				&vm, image.mem, image.len, &builtins.base, NULL, 0, NULL, &ca.base), 0);
+		asserteq(var_lookup("foo")->array.length, 3);
+		assert(ca.calls > 0);
+		gil_vm_free(&vm);
+		asserteq(ca.live, 0);
+	}
+
+	test("snapshot with an id out of range") {
+		eval("foo := [1 2]");
+		defer(gil_gen_free(&gen));
+
+		struct gil_io_mem_writer image = {
+			.w.write = gil_io_mem_write,
+		};
+		defer(free(image.mem));
+		asserteq(gil_vm_snapshot_save(&vm, &gen.atomset, &image.w), 0);
+		struct gil_vm_value foo = *var_lookup("foo");
+		gil_vm_free(&vm);
+
+		// A short array has no pointers, so it's saved exactly like it is in the heap
+		assert(foo.flags & GIL_VAL_SBO);
+		unsigned char *mem = image.mem;
+		size_t off = 0;
+		while (off + sizeof(foo) <= image.len && memcmp(mem + off, &foo, sizeof(foo)) != 0) {
+			off += 8;
+		}
+		assert(off + sizeof(foo) <= image.len);
+		((struct gil_vm_value *)(mem + off))->array.shortarray[1] = 1000000;
+
+		struct gil_mod_builtins builtins;
+		gil_mod_builtins_init(&builtins);
+		asserteq(gil_vm_snapshot_load(
+				&vm, image.mem, image.len, &builtins.base, NULL, 0, NULL), -1);
+	}
+
+	test("snapshot with C values") {
+		eval("foo := 10");
+		defer(gil_gen_free(&gen));
+		defer(gil_vm_free(&vm));
+
+		static int val;
+		gil_word ctype = gil_vm_register_ctype(&vm, NULL);
+		vm.stack[vm.sptr++] = gil_vm_make_cval(&vm, ctype, vm.knone, &val);
+
+		struct gil_io_mem_writer image = {
+			.w.write = gil_io_mem_write,
+		};
+		defer(free(image.mem));
+		asserteq(gil_vm_snapshot_save(&vm, &gen.atomset, &image.w), -1);
 	}
 }
@@ -7,13 +7,23 @@
 #include "modules/builtins.h"
 
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <libgen.h>
 #include <dirent.h>
+#include <signal.h>
 #include <string.h>
+#include <unistd.h>
 #include <errno.h>
 #include <stdio.h>
+#include <time.h>
 #include <snow/snow.h>
 
+// The test Makefile builds the gilia command along with the tests
+#ifndef GILIA_CMD
+#define GILIA_CMD "gilia"
+#endif
+
 static char example_path[512];
 static char *error_message = NULL;
 
@@ -129,7 +139,6 @@ static void check_impl(const char *name) {
 		mem[3] = (rep >> 24) & 0xff;
 	}
 
-	gil_gen_free(&gen);
 	fclose(inf);
 
 	struct gil_io_mem_writer actual_output = {
@@ -140,6 +149,10 @@ static void check_impl(const char *name) {
 	gil_vm_init(&vm, bytecode.mem, bytecode.len / sizeof(gil_word), &builtins.base);
 	vm.std_output = &actual_output.w;
 
+	// Let atoms made at runtime match the program's
+	gil_vm_add_atoms(&vm, &gen.atomset);
+	gil_gen_free(&gen);
+
 	// Run a GC after every instruction to uncover potential GC issues
 	while (!vm.halted) {
 		gil_vm_step(&vm);
@@ -155,6 +168,79 @@ static void check_impl(const char *name) {
 		actual_output.mem, actual_output.len);
 }
 
+static void write_file(const char *path, const char *str) {
+	FILE *f = fopen(path, "w");
+	if (f == NULL) {
+		snow_fail("%s: %s", path, strerror(errno));
+	}
+
+	fputs(str, f);
+	fclose(f);
+}
+
+// The output isn't NUL-terminated, so compare its length and its bytes
+static void check_output(struct gil_io_mem_writer *output, const char *expected) {
+	size_t len = strlen(expected);
+	if (output->len != len || memcmp(output->mem, expected, len) != 0) {
+		snow_fail(
+				"Expected output '%s', got '%.*s'",
+				expected, (int)output->len, (char *)output->mem);
+	}
+}
+
+// Run the gilia command with 'args', and return its exit status.
+// Its output is written to 'output'.
+static int run_gilia(const char *args, struct gil_io_mem_writer *output) {
+	char cmd[1024];
+	snprintf(cmd, sizeof(cmd), "%s %s", GILIA_CMD, args);
+	FILE *f = popen(cmd, "r");
+	if (f == NULL) {
+		snow_fail("%s: %s", cmd, strerror(errno));
+	}
+
+	char buf[256];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+		gil_io_mem_write(&output->w, buf, n);
+	}
+
+	int status = pclose(f);
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// Start a fork server, and wait until it's listening on 'sock'
+static pid_t start_fork_server(const char *image, const char *sock, const char *input) {
+	pid_t pid = fork();
+	if (pid < 0) {
+		snow_fail("fork: %s", strerror(errno));
+	} else if (pid == 0) {
+		execl(
+				GILIA_CMD, GILIA_CMD, "--snapshot", image,
+				"--fork-server", sock, input, (char *)NULL);
+		_exit(127);
+	}
+
+	struct timespec delay = {0, 10 * 1000 * 1000};
+	struct stat st;
+	for (int i = 0; i < 500; ++i) {
+		if (stat(sock, &st) == 0 && S_ISSOCK(st.st_mode)) {
+			return pid;
+		}
+
+		nanosleep(&delay, NULL);
+	}
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	snow_fail("The fork server never started listening on %s", sock);
+	return -1;
+}
+
+static void stop_fork_server(pid_t pid) {
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+}
+
 #define check(name) do { \
 	snow_fail_update(); \
 	test(name) { check_impl(name); } \
@@ -163,13 +249,92 @@ static void check_impl(const char *name) {
 describe(exaples) {
 	check("arrays.g");
 	check("builtins.g");
+	check("compact.g");
 	check("control-flow.g");
 	check("dynamic-lookups.g");
 	check("func-equals.g");
 	check("functions.g");
+	check("gc.g");
 	check("namespaces.g");
 	check("readme.g");
 
+	// Every client gets a fresh copy of the server's VM, so whatever
+	// one client's program does to the snapshot's state, the next one
+	// doesn't see it
+	test("fork server") {
+		char dir[] = "/tmp/gilia-fork-server-XXXXXX";
+		if (mkdtemp(dir) == NULL) {
+			fail("mkdtemp: %s", strerror(errno));
+		}
+		defer(rmdir(dir));
+
+		char state[64], image[64], client[64], sock[64];
+		snprintf(state, sizeof(state), "%s/state.g", dir);
+		snprintf(image, sizeof(image), "%s/state.img", dir);
+		snprintf(client, sizeof(client), "%s/client.g", dir);
+		snprintf(sock, sizeof(sock), "%s/sock", dir);
+
+		write_file(state, "visits := 0\n");
+		defer(unlink(state));
+		write_file(client, "visits += 1\nprint \"visit\" visits\n");
+		defer(unlink(client));
+
+		char args[256];
+		struct gil_io_mem_writer output = {
+			.w.write = gil_io_mem_write,
+		};
+		snprintf(args, sizeof(args), "--snapshot-save %s %s", image, state);
+		asserteq(run_gilia(args, &output), 0);
+		defer(unlink(image));
+		asserteq(output.len, 0);
+
+		pid_t server = start_fork_server(image, sock, client);
+		defer(unlink(sock));
+		defer(stop_fork_server(server));
+
+		snprintf(args, sizeof(args), "--fork-client %s", sock);
+		for (int i = 0; i < 2; ++i) {
+			output.len = 0;
+			asserteq(run_gilia(args, &output), 0);
+			check_output(&output, "visit 1\n");
+		}
+		free(output.mem);
+	}
+
+	// A bytecode file carries the names of its atoms, so atoms made
+	// at runtime don't get the ids of atoms the bytecode already uses
+	test("bytecode files keep their atoms") {
+		char dir[] = "/tmp/gilia-bytecode-XXXXXX";
+		if (mkdtemp(dir) == NULL) {
+			fail("mkdtemp: %s", strerror(errno));
+		}
+		defer(rmdir(dir));
+
+		char src[64], bc[64];
+		snprintf(src, sizeof(src), "%s/atoms.g", dir);
+		snprintf(bc, sizeof(bc), "%s/atoms.bc", dir);
+
+		write_file(src,
+				"bar := {}\n"
+				"bar.(atom \"zzz\") = 2\n"
+				"print bar.bar\n"
+				"print bar.zzz\n");
+		defer(unlink(src));
+
+		char args[256];
+		struct gil_io_mem_writer output = {
+			.w.write = gil_io_mem_write,
+		};
+		snprintf(args, sizeof(args), "-o %s %s", bc, src);
+		asserteq(run_gilia(args, &output), 0);
+		defer(unlink(bc));
+
+		snprintf(args, sizeof(args), "--bc %s", bc);
+		asserteq(run_gilia(args, &output), 0);
+		check_output(&output, "(none)\n2\n");
+		free(output.mem);
+	}
+
 	if (error_message != NULL) {
 		free(error_message);
 	}
@@ -1,4 +1,5 @@
 #include "parse/lex.h"
+#include "strset.h"
 
 #include <stdio.h>
 #include <snow/snow.h>
@@ -98,4 +99,52 @@ describe(lex) {
 
 		asserteq(gil_token_get_kind(gil_lexer_peek(&lexer, 1)), GIL_TOK_EOF);
 	}
+	test("lex identifiers into an atom set") {
+		struct gil_strset atoms;
+		gil_strset_init(&atoms);
+		size_t foo = gil_strset_put_copy(&atoms, "foo");
+
+		r.r.read = gil_io_mem_read;
+		r.idx = 0;
+		r.mem = "foo := a-rather-long-identifier-name || foo x+= 10";
+		r.len = strlen(r.mem);
+		gil_lexer_init_with_atoms(&lexer, &r.r, &atoms);
+
+		struct gil_token *tok = gil_lexer_peek(&lexer, 1);
+		asserteq(gil_token_get_kind(tok), GIL_TOK_IDENT);
+		asserteq(tok->v.atom, foo);
+		asserteq(tok->v.str, "foo");
+		gil_lexer_consume(&lexer);
+
+		asserteq(gil_token_get_kind(gil_lexer_peek(&lexer, 1)), GIL_TOK_COLON_EQ);
+		gil_lexer_consume(&lexer);
+
+		tok = gil_lexer_peek(&lexer, 1);
+		asserteq(gil_token_get_kind(tok), GIL_TOK_IDENT);
+		asserteq(tok->v.atom, gil_strset_get(&atoms, "a-rather-long-identifier-name"));
+		asserteq(tok->v.str, "a-rather-long-identifier-name");
+		gil_lexer_consume(&lexer);
+
+		tok = gil_lexer_peek(&lexer, 1);
+		asserteq(gil_token_get_kind(tok), GIL_TOK_IDENT);
+		asserteq(tok->v.atom, gil_strset_get(&atoms, "||"));
+		gil_lexer_consume(&lexer);
+
+		tok = gil_lexer_peek(&lexer, 1);
+		asserteq(gil_token_get_kind(tok), GIL_TOK_IDENT);
+		asserteq(tok->v.atom, foo);
+		gil_lexer_consume(&lexer);
+
+		tok = gil_lexer_peek(&lexer, 1);
+		asserteq(gil_token_get_kind(tok), GIL_TOK_IDENT_EQ);
+		asserteq(tok->v.atom, gil_strset_get(&atoms, "x+"));
+		asserteq(tok->v.str, "x+");
+		gil_lexer_consume(&lexer);
+
+		asserteq(gil_token_get_kind(gil_lexer_peek(&lexer, 1)), GIL_TOK_NUMBER);
+		gil_lexer_consume(&lexer);
+		asserteq(gil_token_get_kind(gil_lexer_peek(&lexer, 1)), GIL_TOK_EOF);
+
+		gil_strset_free(&atoms);
+	}
 }
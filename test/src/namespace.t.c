@@ -1,35 +1,49 @@
 #include "vm/vm.h"
 
+#include <stdlib.h>
+#include <string.h>
 #include <snow/snow.h>
 
+#include "capped_alloc.h"
+
+static struct capped_allocator capped;
 static struct gil_vm vm = {0};
 
 describe(gil_vm_namespace) {
 	struct gil_vm_value val = {0};
 
+	before_each() {
+		memset(&vm, 0, sizeof(vm));
+		gil_arena_init(&vm.arena);
+	}
+
 	after_each() {
-		free(val.ns.ns);
+		if (!(val.flags & GIL_VAL_SBO)) {
+			gil_vm_dealloc(&vm, val.ns.ns);
+		}
+		val.flags = 0;
 		val.ns.ns = NULL;
+		gil_arena_free(&vm.arena);
 	}
 
 	test("basic functionality") {
-		gil_vm_namespace_set(&val, 100, 50);
-		gil_vm_namespace_set(&val, 30, 600);
+		gil_vm_namespace_set(&vm, &val, 100, 50);
+		gil_vm_namespace_set(&vm, &val, 30, 600);
 		asserteq(gil_vm_namespace_get(&vm, &val, 100), 50);
 		asserteq(gil_vm_namespace_get(&vm, &val, 30), 600);
 	}
 
 	it("handles duplicates") {
-		gil_vm_namespace_set(&val, 536, 600);
-		gil_vm_namespace_set(&val, 100, 400);
-		gil_vm_namespace_set(&val, 536, 45);
+		gil_vm_namespace_set(&vm, &val, 536, 600);
+		gil_vm_namespace_set(&vm, &val, 100, 400);
+		gil_vm_namespace_set(&vm, &val, 536, 45);
 		asserteq(gil_vm_namespace_get(&vm, &val, 100), 400);
 		asserteq(gil_vm_namespace_get(&vm, &val, 536), 45);
 	}
 
 	it("handles a whole bunch of values") {
 		for (int i = 1; i < 500; ++i) {
-			gil_vm_namespace_set(&val, i, i + 50);
+			gil_vm_namespace_set(&vm, &val, i, i + 50);
 			asserteq(gil_vm_namespace_get(&vm, &val, i), i + 50);
 		}
 
@@ -37,4 +51,217 @@ describe(gil_vm_namespace) {
 			asserteq(gil_vm_namespace_get(&vm, &val, i), i + 50);
 		}
 	}
+
+	it("finds values past deleted entries") {
+		for (int i = 1; i < 10; ++i) {
+			gil_vm_namespace_set(&vm, &val, i, i + 50);
+		}
+
+		for (int i = 1; i < 10; i += 2) {
+			gil_vm_namespace_set(&vm, &val, i, 0);
+		}
+
+		for (int i = 1; i < 10; ++i) {
+			asserteq(gil_vm_namespace_get(&vm, &val, i), i % 2 == 0 ? i + 50 : 0);
+		}
+		asserteq(val.ns.ns->len, 4);
+	}
+
+	it("doesn't fill up with tombstones") {
+		for (int i = 1; i <= 20; ++i) {
+			gil_vm_namespace_set(&vm, &val, 100000 + i, i);
+		}
+
+		for (int i = 1; i < 10000; ++i) {
+			gil_vm_namespace_set(&vm, &val, i, i + 50);
+			gil_vm_namespace_set(&vm, &val, i, 0);
+			asserteq(gil_vm_namespace_get(&vm, &val, i), 0);
+		}
+
+		struct gil_vm_namespace_stats stats;
+		gil_vm_namespace_get_stats(&val, &stats);
+		asserteq(stats.len, 20);
+		assert(stats.size <= 128);
+		assert(stats.tombs < stats.size / 2);
+	}
+
+	it("keeps probes short for sequential keys") {
+		for (int i = 1; i < 1000; ++i) {
+			gil_vm_namespace_set(&vm, &val, i, i);
+		}
+
+		struct gil_vm_namespace_stats stats;
+		gil_vm_namespace_get_stats(&val, &stats);
+		asserteq(stats.len, 999);
+		assert(stats.max_probes < 32);
+	}
+
+	it("shares shapes between namespaces with the same keys") {
+		struct gil_vm_value other = {0};
+		gil_vm_namespace_set(&vm, &val, 10, 100);
+		gil_vm_namespace_set(&vm, &val, 20, 200);
+		gil_vm_namespace_set(&vm, &other, 10, 300);
+		gil_vm_namespace_set(&vm, &other, 20, 400);
+		assert(val.ns.ns->shape != NULL);
+		assert(val.ns.ns->shape == other.ns.ns->shape);
+		asserteq(gil_vm_namespace_get(&vm, &val, 20), 200);
+		asserteq(gil_vm_namespace_get(&vm, &other, 20), 400);
+
+		gil_vm_namespace_set(&vm, &other, 30, 500);
+		assert(val.ns.ns->shape != other.ns.ns->shape);
+		asserteq(gil_vm_namespace_get(&vm, &val, 30), 0);
+		asserteq(gil_vm_namespace_get(&vm, &other, 30), 500);
+		gil_vm_dealloc(&vm, other.ns.ns);
+	}
+
+	it("turns into a hash table when used as a dictionary") {
+		gil_vm_namespace_set(&vm, &val, 10, 100);
+		gil_vm_namespace_set(&vm, &val, 20, 200);
+		gil_vm_namespace_set(&vm, &val, 10, 0);
+		asserteq(val.ns.ns->shape, NULL);
+		asserteq(gil_vm_namespace_get(&vm, &val, 10), 0);
+		asserteq(gil_vm_namespace_get(&vm, &val, 20), 200);
+
+		for (int i = 1; i < 100; ++i) {
+			gil_vm_namespace_set(&vm, &val, i + 1000, i);
+		}
+		for (int i = 1; i < 100; ++i) {
+			asserteq(gil_vm_namespace_get(&vm, &val, i + 1000), i);
+		}
+		asserteq(val.ns.ns->shape, NULL);
+	}
+
+	it("stores a single entry inline") {
+		gil_vm_namespace_set(&vm, &val, 10, 100);
+		assert(val.flags & GIL_VAL_SBO);
+		asserteq(gil_vm_namespace_get(&vm, &val, 10), 100);
+		asserteq(gil_vm_namespace_get(&vm, &val, 20), 0);
+
+		gil_vm_namespace_set(&vm, &val, 10, 200);
+		assert(val.flags & GIL_VAL_SBO);
+		asserteq(gil_vm_namespace_get(&vm, &val, 10), 200);
+
+		gil_vm_namespace_set(&vm, &val, 20, 300);
+		assert(!(val.flags & GIL_VAL_SBO));
+		asserteq(gil_vm_namespace_get(&vm, &val, 10), 200);
+		asserteq(gil_vm_namespace_get(&vm, &val, 20), 300);
+	}
+
+	it("empties an inline namespace") {
+		gil_vm_namespace_set(&vm, &val, 10, 100);
+		gil_vm_namespace_set(&vm, &val, 10, 0);
+		assert(!(val.flags & GIL_VAL_SBO));
+		asserteq(val.ns.ns, NULL);
+		asserteq(gil_vm_namespace_get(&vm, &val, 10), 0);
+	}
+
+	it("iterates in insertion order while it's shaped") {
+		int keys[] = {50, 7, 300, 1, 99, 12, 8000, 42};
+		size_t nkeys = sizeof(keys) / sizeof(*keys);
+		gil_word it = 0, key, v;
+
+		gil_vm_namespace_set(&vm, &val, keys[0], 1);
+		assert(gil_vm_namespace_next(&val, &it, &key, &v));
+		asserteq(key, keys[0]);
+		assert(!gil_vm_namespace_next(&val, &it, &key, &v));
+
+		for (size_t i = 1; i < nkeys; ++i) {
+			gil_vm_namespace_set(&vm, &val, keys[i], i + 1);
+		}
+		assert(val.ns.ns->shape != NULL);
+
+		it = 0;
+		for (size_t i = 0; i < nkeys; ++i) {
+			assert(gil_vm_namespace_next(&val, &it, &key, &v));
+			asserteq(key, keys[i]);
+			asserteq(v, i + 1);
+		}
+		assert(!gil_vm_namespace_next(&val, &it, &key, &v));
+	}
+
+	it("iterates over a hash table in insertion order") {
+		int keys[] = {50, 7, 300, 1, 99, 12, 8000, 42, 3, 17, 600, 25, 2, 71, 1000, 5, 64, 30, 11};
+		size_t nkeys = sizeof(keys) / sizeof(*keys);
+		gil_word it = 0, key, v;
+
+		for (size_t i = 0; i < nkeys; ++i) {
+			gil_vm_namespace_set(&vm, &val, keys[i], i + 1);
+		}
+		asserteq(val.ns.ns->shape, NULL);
+
+		for (size_t i = 0; i < nkeys; ++i) {
+			assert(gil_vm_namespace_next(&val, &it, &key, &v));
+			asserteq(key, keys[i]);
+			asserteq(v, i + 1);
+		}
+		assert(!gil_vm_namespace_next(&val, &it, &key, &v));
+
+		// Deleted keys are skipped, and keys which come back go last
+		gil_vm_namespace_set(&vm, &val, keys[0], 0);
+		gil_vm_namespace_set(&vm, &val, keys[5], 0);
+		gil_vm_namespace_set(&vm, &val, keys[0], 100);
+		it = 0;
+		for (size_t i = 1; i < nkeys; ++i) {
+			if (i == 5) {
+				continue;
+			}
+			assert(gil_vm_namespace_next(&val, &it, &key, &v));
+			asserteq(key, keys[i]);
+		}
+		assert(gil_vm_namespace_next(&val, &it, &key, &v));
+		asserteq(key, keys[0]);
+		asserteq(v, 100);
+		assert(!gil_vm_namespace_next(&val, &it, &key, &v));
+	}
+
+	it("handles tables with wide indexes") {
+		for (int i = 1; i < 40000; ++i) {
+			gil_vm_namespace_set(&vm, &val, i * 7, i);
+		}
+		for (int i = 1; i < 40000; i += 3) {
+			gil_vm_namespace_set(&vm, &val, i * 7, 0);
+		}
+
+		gil_word it = 0, key, v;
+		int expected = 2;
+		while (gil_vm_namespace_next(&val, &it, &key, &v)) {
+			asserteq(key, expected * 7);
+			asserteq(v, expected);
+			expected += expected % 3 == 0 ? 2 : 1;
+		}
+		asserteq(expected, 40001);
+		asserteq(gil_vm_namespace_get(&vm, &val, 39998 * 7), 39998);
+		asserteq(gil_vm_namespace_get(&vm, &val, 39997 * 7), 0);
+	}
+
+	it("keeps hash tables compact") {
+		for (int i = 1; i <= 100; ++i) {
+			gil_vm_namespace_set(&vm, &val, i * 13, i);
+		}
+
+		// 256 one-byte indexes and room for 128 entries
+		asserteq(val.ns.ns->size, 256);
+		asserteq(gil_vm_namespace_bytes(val.ns.ns),
+				sizeof(struct gil_vm_namespace) + 256 + 128 * 2 * sizeof(gil_word));
+	}
+
+	it("stays as it was when it can't grow") {
+		capped_allocator_init(&capped, 256 * 1024);
+		gil_arena_free(&vm.arena);
+		gil_arena_init_with_allocator(&vm.arena, &capped.base);
+
+		int n = 1;
+		while (gil_vm_namespace_set(&vm, &val, n, n + 50) == 0) {
+			n += 1;
+		}
+
+		assert(n > 100);
+		asserteq(gil_vm_namespace_get(&vm, &val, n), 0);
+		for (int i = 1; i < n; ++i) {
+			asserteq(gil_vm_namespace_get(&vm, &val, i), i + 50);
+		}
+
+		asserteq(gil_vm_namespace_set(&vm, &val, 1, 0), 0);
+		asserteq(gil_vm_namespace_get(&vm, &val, 1), 0);
+	}
 }
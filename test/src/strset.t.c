@@ -1,8 +1,14 @@
 #include "strset.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <snow/snow.h>
 
+#include "capped_alloc.h"
+
+static struct capped_allocator capped;
+
 describe(gil_strset) {
 	struct gil_strset set;
 
@@ -39,4 +45,102 @@ describe(gil_strset) {
 			asserteq(gil_strset_get(&set, buf), i + 1);
 		}
 	}
+
+	it("takes ownership of strings") {
+		char *str = gil_allocator_alloc(set.alloc, 6);
+		memcpy(str, "hello", 6);
+		asserteq(gil_strset_put(&set, &str), 1);
+		asserteq(str, NULL);
+
+		str = gil_allocator_alloc(set.alloc, 6);
+		memcpy(str, "hello", 6);
+		asserteq(gil_strset_put(&set, &str), 1);
+		asserteq(str, NULL);
+	}
+
+	it("looks up strings which aren't NUL-terminated") {
+		asserteq(gil_strset_put_copy_n(&set, "hello world", 5), 1);
+		asserteq(gil_strset_put_copy_n(&set, "hello world", 11), 2);
+		asserteq(gil_strset_get(&set, "hello"), 1);
+		asserteq(gil_strset_get_n(&set, "hello there", 5), 1);
+		asserteq(gil_strset_get_n(&set, "hello there", 6), 0);
+		asserteq(gil_strset_get(&set, "hello world"), 2);
+	}
+
+	it("finds names by id") {
+		char buf[128];
+		for (int i = 0; i < 1000; ++i) {
+			snprintf(buf, sizeof(buf), "name-%d", i);
+			gil_strset_put_copy(&set, buf);
+		}
+
+		size_t len;
+		asserteq(gil_strset_name(&set, 0, NULL), NULL);
+		asserteq(gil_strset_name(&set, 1001, NULL), NULL);
+		for (int i = 0; i < 1000; ++i) {
+			snprintf(buf, sizeof(buf), "name-%d", i);
+			asserteq(gil_strset_name(&set, i + 1, &len), buf);
+			asserteq(len, strlen(buf));
+		}
+	}
+	it("hashes strings the same a byte at a time") {
+		const char *str = "a string which spans a few blocks";
+		for (size_t len = 0; len <= strlen(str); ++len) {
+			struct gil_strset_hasher hasher;
+			gil_strset_hasher_init(&hasher);
+			for (size_t i = 0; i < len; ++i) {
+				gil_strset_hasher_add(&hasher, (unsigned char)str[i]);
+			}
+
+			size_t id = gil_strset_put_hashed(
+					&set, str, len, gil_strset_hasher_finish(&hasher));
+			asserteq(id, len + 1);
+			asserteq(gil_strset_get_n(&set, str, len), id);
+		}
+	}
+
+	it("returns 0 when it can't grow") {
+		capped_allocator_init(&capped, 128 * 1024);
+		gil_strset_free(&set);
+		gil_strset_init_with_allocator(&set, &capped.base);
+
+		char buf[128];
+		size_t n = 0;
+		do {
+			n += 1;
+			snprintf(buf, sizeof(buf), "name-%zu", n);
+		} while (gil_strset_put_copy(&set, buf) == n);
+
+		assert(n > 50);
+		asserteq(gil_strset_get(&set, buf), 0);
+		for (size_t i = 1; i < n; ++i) {
+			snprintf(buf, sizeof(buf), "name-%zu", i);
+			asserteq(gil_strset_get(&set, buf), i);
+			asserteq(gil_strset_name(&set, i, NULL), buf);
+		}
+	}
+
+	it("extends a set with another's strings") {
+		struct gil_strset other;
+		gil_strset_init(&other);
+		gil_strset_put_copy(&set, "a");
+		gil_strset_put_copy(&other, "a");
+		gil_strset_put_copy(&other, "b");
+		gil_strset_put_copy(&other, "c");
+
+		asserteq(gil_strset_extend(&set, &other), 0);
+		asserteq(gil_strset_get(&set, "b"), 2);
+		asserteq(gil_strset_get(&set, "c"), 3);
+
+		gil_strset_put_copy(&set, "d");
+		asserteq(gil_strset_extend(&other, &set), 0);
+		asserteq(gil_strset_get(&other, "d"), 4);
+
+		gil_strset_put_copy(&set, "e");
+		gil_strset_put_copy(&other, "f");
+		gil_strset_put_copy(&other, "e");
+		asserteq(gil_strset_extend(&set, &other), -1);
+
+		gil_strset_free(&other);
+	}
 }